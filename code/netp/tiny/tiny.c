@@ -1,63 +1,417 @@
 /* $begin tinymain */
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
+ * tiny.c - A simple HTTP/1.0 Web server that uses the
  *     GET method to serve static and dynamic content.
  *
- * Updated 11/2019 droh 
+ *     The -m option picks how connections are served:
+ *       iterative - one connection at a time (the default)
+ *       threads   - a prethreaded pool of -n workers fed through an sbuf
+ *       epoll     - a single thread multiplexing nonblocking connections
+ *
+ * Updated 11/2019 droh
  *   - Fixed sprintf() aliasing issue in serve_static(), and clienterror().
+ * Updated 10/2026
+ *   - Added the prethreaded and epoll serving modes. A client that goes
+ *     away early no longer takes the server down.
  */
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include "csapp.h"
+#include "sbuf.h"
+
+#define NTHREADS  16   /* Default number of worker threads */
+#define SBUFSIZE  64   /* Connected descriptors waiting for a worker */
+#define MAXEVENTS 64   /* Events taken per epoll_wait() */
+
+/* Represents a connection in the epoll loop */
+typedef struct {
+    int fd;             /* Connected descriptor */
+    int writing;        /* 0 while reading the request, 1 once responding */
+    char buf[MAXBUF];   /* Request, then response headers */
+    int len;            /* Bytes in buf */
+    char *body;         /* Mapped file to send after buf, or NULL */
+    int size;           /* Bytes in body */
+    int sent;           /* Bytes of buf, then body, already sent */
+} conn_t;
 
+void serve_iterative(int listenfd);
+void serve_threads(int listenfd, int nthreads);
+void *thread(void *vargp);
+void serve_epoll(int listenfd);
+void accept_conns(int epfd, int listenfd);
+void read_request(int epfd, conn_t *c);
+void start_response(int epfd, conn_t *c);
+void write_response(int epfd, conn_t *c);
+void close_conn(int epfd, conn_t *c);
+void set_nonblocking(int fd, int on);
+void sigchld_handler(int sig);
 void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+int read_requesthdrs(rio_t *rp);
 int parse_uri(char *uri, char *filename, char *cgiargs);
 void serve_static(int fd, char *filename, int filesize);
+int static_headers(char *buf, char *filename, int filesize);
 void get_filetype(char *filename, char *filetype);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
-void clienterror(int fd, char *cause, char *errnum, 
+pid_t spawn_cgi(int fd, char *filename, char *cgiargs);
+void clienterror(int fd, char *cause, char *errnum,
 		 char *shortmsg, char *longmsg);
+int error_message(char *buf, char *cause, char *errnum,
+		  char *shortmsg, char *longmsg);
 
-int main(int argc, char **argv) 
+sbuf_t sbuf; /* Shared buffer of connected descriptors */
+
+void usage(char *prog)
 {
-    int listenfd, connfd;
-    char hostname[MAXLINE], port[MAXLINE];
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
+    fprintf(stderr, "usage: %s [-m iterative|threads|epoll] [-n nthreads] <port>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int listenfd, opt, nthreads = NTHREADS;
+    char *mode = "iterative";
 
     /* Check command line args */
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
-	exit(1);
+    while ((opt = getopt(argc, argv, "m:n:")) != -1) {
+	switch (opt) {
+	case 'm':
+	    mode = optarg;
+	    break;
+	case 'n':
+	    if ((nthreads = atoi(optarg)) <= 0)
+		usage(argv[0]);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
     }
+    if (optind != argc - 1)
+	usage(argv[0]);
+
+    /* Writes to a closed connection fail with EPIPE instead */
+    Signal(SIGPIPE, SIG_IGN);
+
+    listenfd = Open_listenfd(argv[optind]);
+    if (!strcmp(mode, "iterative"))
+	serve_iterative(listenfd);
+    else if (!strcmp(mode, "threads"))
+	serve_threads(listenfd, nthreads);
+    else if (!strcmp(mode, "epoll"))
+	serve_epoll(listenfd);
+    else
+	usage(argv[0]);
+    exit(0);
+}
+/* $end tinymain */
+
+/*
+ * serve_iterative - serve one connection after the other
+ */
+void serve_iterative(int listenfd)
+{
+    int connfd;
+    char hostname[MAXLINE], port[MAXLINE];
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
 
-    listenfd = Open_listenfd(argv[1]);
     while (1) {
 	clientlen = sizeof(clientaddr);
 	connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen); //line:netp:tiny:accept
-        Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
+        Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE,
                     port, MAXLINE, 0);
         printf("Accepted connection from (%s, %s)\n", hostname, port);
 	doit(connfd);                                             //line:netp:tiny:doit
 	Close(connfd);                                            //line:netp:tiny:close
     }
 }
-/* $end tinymain */
+
+/*
+ * serve_threads - the main thread accepts, a pool of workers serves
+ */
+void serve_threads(int listenfd, int nthreads)
+{
+    int i, connfd;
+    char hostname[MAXLINE], port[MAXLINE];
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    pthread_t tid;
+
+    sbuf_init(&sbuf, SBUFSIZE);
+    for (i = 0; i < nthreads; i++)  /* Create worker threads */
+	Pthread_create(&tid, NULL, thread, NULL);
+
+    while (1) {
+	clientlen = sizeof(clientaddr);
+	connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE,
+                    port, MAXLINE, 0);
+        printf("Accepted connection from (%s, %s)\n", hostname, port);
+	sbuf_insert(&sbuf, connfd); /* Blocks while every slot is taken */
+    }
+}
+
+void *thread(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    while (1) {
+	int connfd = sbuf_remove(&sbuf); /* Remove connfd from buffer */
+	doit(connfd);                    /* Service client */
+	Close(connfd);
+    }
+}
+
+/*
+ * serve_epoll - serve every connection from one event loop, so a slow
+ *     client only holds up its own connection
+ */
+void serve_epoll(int listenfd)
+{
+    int epfd, i, n;
+    struct epoll_event ev, events[MAXEVENTS];
+    conn_t *c;
+
+    Signal(SIGCHLD, sigchld_handler); /* CGI children are not waited for */
+    set_nonblocking(listenfd, 1);
+    if ((epfd = epoll_create1(0)) < 0)
+	unix_error("epoll_create1 error");
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;  /* NULL marks the listening descriptor */
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+	unix_error("epoll_ctl error");
+
+    while (1) {
+	if ((n = epoll_wait(epfd, events, MAXEVENTS, -1)) < 0) {
+	    if (errno == EINTR)  /* A CGI child was reaped */
+		continue;
+	    unix_error("epoll_wait error");
+	}
+	for (i = 0; i < n; i++) {
+	    c = events[i].data.ptr;
+	    if (c == NULL)
+		accept_conns(epfd, listenfd);
+	    else if (!c->writing)
+		read_request(epfd, c);
+	    else
+		write_response(epfd, c);
+	}
+    }
+}
+
+/*
+ * accept_conns - accept every pending connection and watch it for input
+ */
+void accept_conns(int epfd, int listenfd)
+{
+    int connfd;
+    char hostname[MAXLINE], port[MAXLINE];
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    struct epoll_event ev;
+    conn_t *c;
+
+    while (1) {
+	clientlen = sizeof(clientaddr);
+	if ((connfd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    if (errno != EAGAIN && errno != EWOULDBLOCK)
+		fprintf(stderr, "accept error: %s\n", strerror(errno));
+	    return;
+	}
+        Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE,
+                    port, MAXLINE, 0);
+        printf("Accepted connection from (%s, %s)\n", hostname, port);
+
+	set_nonblocking(connfd, 1);
+	c = Malloc(sizeof(conn_t));
+	c->fd = connfd;
+	c->writing = 0;
+	c->len = c->size = c->sent = 0;
+	c->body = NULL;
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0)
+	    unix_error("epoll_ctl error");
+    }
+}
+
+/*
+ * read_request - read what has arrived of the request, and respond once
+ *     the blank line ending its headers is in
+ */
+void read_request(int epfd, conn_t *c)
+{
+    ssize_t n;
+
+    while ((n = read(c->fd, c->buf + c->len, MAXBUF - 1 - c->len)) > 0) {
+	c->len += n;
+	c->buf[c->len] = '\0';
+	if (strstr(c->buf, "\r\n\r\n")) {
+	    start_response(epfd, c);
+	    return;
+	}
+	if (c->len == MAXBUF - 1) { /* Headers too large */
+	    close_conn(epfd, c);
+	    return;
+	}
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+	close_conn(epfd, c);
+}
+
+/*
+ * start_response - the same checks as doit, the response goes out as
+ *     the client takes it, except a CGI program's, which writes its own
+ */
+void start_response(int epfd, conn_t *c)
+{
+    int is_static, srcfd;
+    struct stat sbuf;
+    char method[MAXLINE] = "", uri[MAXLINE] = "", version[MAXLINE];
+    char filename[MAXLINE], cgiargs[MAXLINE];
+    struct epoll_event ev;
+
+    printf("%s", c->buf);
+    sscanf(c->buf, "%s %s %s", method, uri, version);
+    if (strcasecmp(method, "GET")) {
+	c->len = error_message(c->buf, method, "501", "Not Implemented",
+			       "Tiny does not implement this method");
+	goto respond;
+    }
+
+    is_static = parse_uri(uri, filename, cgiargs);
+    if (stat(filename, &sbuf) < 0) {
+	c->len = error_message(c->buf, filename, "404", "Not found",
+			       "Tiny couldn't find this file");
+    }
+    else if (is_static) {
+	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
+	    c->len = error_message(c->buf, filename, "403", "Forbidden",
+				   "Tiny couldn't read the file");
+	}
+	else {
+	    if ((srcfd = open(filename, O_RDONLY, 0)) < 0) {
+		close_conn(epfd, c);
+		return;
+	    }
+	    if (sbuf.st_size > 0) {
+		c->body = mmap(0, sbuf.st_size, PROT_READ, MAP_PRIVATE, srcfd, 0);
+		if (c->body == MAP_FAILED) {
+		    c->body = NULL;
+		    Close(srcfd);
+		    close_conn(epfd, c);
+		    return;
+		}
+		c->size = sbuf.st_size;
+	    }
+	    Close(srcfd);
+	    c->len = static_headers(c->buf, filename, sbuf.st_size);
+	}
+    }
+    else {
+	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
+	    c->len = error_message(c->buf, filename, "403", "Forbidden",
+				   "Tiny couldn't run the CGI program");
+	}
+	else {
+	    /* The child holds the connection open after we close it,
+	       so it leaves the epoll set explicitly */
+	    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	    set_nonblocking(c->fd, 0);
+	    spawn_cgi(c->fd, filename, cgiargs);
+	    close_conn(epfd, c);
+	    return;
+	}
+    }
+
+ respond:
+    c->writing = 1;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+	unix_error("epoll_ctl error");
+    write_response(epfd, c);
+}
+
+/*
+ * write_response - send as much of the headers and body as the socket
+ *     takes, and close the connection once all of it is sent
+ */
+void write_response(int epfd, conn_t *c)
+{
+    struct iovec iov[2];
+    ssize_t n;
+
+    while (c->sent < c->len + c->size) {
+	if (c->sent < c->len) {
+	    iov[0].iov_base = c->buf + c->sent;
+	    iov[0].iov_len = c->len - c->sent;
+	    iov[1].iov_base = c->body;
+	    iov[1].iov_len = c->size;
+	}
+	else {
+	    iov[0].iov_base = c->body + (c->sent - c->len);
+	    iov[0].iov_len = c->len + c->size - c->sent;
+	    iov[1].iov_len = 0;
+	}
+	if ((n = writev(c->fd, iov, 2)) < 0) {
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return; /* Resumed on EPOLLOUT */
+	    if (errno == EINTR)
+		continue;
+	    break;      /* The client went away */
+	}
+	c->sent += n;
+    }
+    close_conn(epfd, c);
+}
+
+/*
+ * close_conn - closing the descriptor also drops it from the epoll set
+ */
+void close_conn(int epfd, conn_t *c)
+{
+    if (c->body)
+	Munmap(c->body, c->size);
+    Close(c->fd);
+    Free(c);
+}
+
+void set_nonblocking(int fd, int on)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags < 0 || fcntl(fd, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) < 0)
+	unix_error("fcntl error");
+}
+
+/*
+ * sigchld_handler - reap every CGI child that has finished
+ */
+void sigchld_handler(int sig)
+{
+    int olderrno = errno;
+
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+	;
+    errno = olderrno;
+}
 
 /*
  * doit - handle one HTTP request/response transaction
  */
 /* $begin doit */
-void doit(int fd) 
+void doit(int fd)
 {
     int is_static;
     struct stat sbuf;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char buf[MAXLINE], method[MAXLINE] = "", uri[MAXLINE] = "", version[MAXLINE];
     char filename[MAXLINE], cgiargs[MAXLINE];
     rio_t rio;
 
     /* Read request line and headers */
     Rio_readinitb(&rio, fd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))  //line:netp:doit:readrequest
+    if (rio_readlineb(&rio, buf, MAXLINE) <= 0)  //line:netp:doit:readrequest
         return;
     printf("%s", buf);
     sscanf(buf, "%s %s %s", method, uri, version);       //line:netp:doit:parserequest
@@ -66,7 +420,8 @@ void doit(int fd)
                     "Tiny does not implement this method");
         return;
     }                                                    //line:netp:doit:endrequesterr
-    read_requesthdrs(&rio);                              //line:netp:doit:readrequesthdrs
+    if (read_requesthdrs(&rio) < 0)                      //line:netp:doit:readrequesthdrs
+        return;
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs);       //line:netp:doit:staticcheck
@@ -76,7 +431,7 @@ void doit(int fd)
 	return;
     }                                                    //line:netp:doit:endnotfound
 
-    if (is_static) { /* Serve static content */          
+    if (is_static) { /* Serve static content */
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) { //line:netp:doit:readable
 	    clienterror(fd, filename, "403", "Forbidden",
 			"Tiny couldn't read the file");
@@ -96,20 +451,20 @@ void doit(int fd)
 /* $end doit */
 
 /*
- * read_requesthdrs - read HTTP request headers
+ * read_requesthdrs - read HTTP request headers,
+ *                    return -1 if the client closed or failed first
  */
 /* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp) 
+int read_requesthdrs(rio_t *rp)
 {
     char buf[MAXLINE];
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
-	Rio_readlineb(rp, buf, MAXLINE);
+    do {
+	if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+	    return -1;
 	printf("%s", buf);
-    }
-    return;
+    } while(strcmp(buf, "\r\n"));         //line:netp:readhdrs:checkterm
+    return 0;
 }
 /* $end read_requesthdrs */
 
@@ -118,7 +473,7 @@ void read_requesthdrs(rio_t *rp)
  *             return 0 if dynamic content, 1 if static
  */
 /* $begin parse_uri */
-int parse_uri(char *uri, char *filename, char *cgiargs) 
+int parse_uri(char *uri, char *filename, char *cgiargs)
 {
     char *ptr;
 
@@ -136,7 +491,7 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 	    strcpy(cgiargs, ptr+1);
 	    *ptr = '\0';
 	}
-	else 
+	else
 	    strcpy(cgiargs, "");                         //line:netp:parseuri:endextract
 	strcpy(filename, ".");                           //line:netp:parseuri:beginconvert2
 	strcat(filename, uri);                           //line:netp:parseuri:endconvert2
@@ -146,37 +501,47 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client 
+ * serve_static - copy a file back to the client
+ *     A failed write means the client went away, nothing more to do.
  */
 /* $begin serve_static */
 void serve_static(int fd, char *filename, int filesize)
 {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
+    int srcfd, len;
+    char *srcp, buf[MAXBUF];
 
     /* Send response headers to client */
-    get_filetype(filename, filetype);    //line:netp:servestatic:getfiletype
-    sprintf(buf, "HTTP/1.0 200 OK\r\n"); //line:netp:servestatic:beginserve
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n", filesize);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: %s\r\n\r\n", filetype);
-    Rio_writen(fd, buf, strlen(buf));    //line:netp:servestatic:endserve
+    len = static_headers(buf, filename, filesize); //line:netp:servestatic:beginserve
+    if (rio_writen(fd, buf, len) != len)           //line:netp:servestatic:endserve
+        return;
 
     /* Send response body to client */
     srcfd = Open(filename, O_RDONLY, 0); //line:netp:servestatic:open
     srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0); //line:netp:servestatic:mmap
     Close(srcfd);                       //line:netp:servestatic:close
-    Rio_writen(fd, srcp, filesize);     //line:netp:servestatic:write
+    rio_writen(fd, srcp, filesize);     //line:netp:servestatic:write
     Munmap(srcp, filesize);             //line:netp:servestatic:munmap
 }
 
+/*
+ * static_headers - format the response headers for a file into buf,
+ *                  return their length
+ */
+int static_headers(char *buf, char *filename, int filesize)
+{
+    char filetype[MAXLINE];
+
+    get_filetype(filename, filetype);    //line:netp:servestatic:getfiletype
+    return snprintf(buf, MAXBUF, "HTTP/1.0 200 OK\r\n"
+                    "Server: Tiny Web Server\r\n"
+                    "Content-length: %d\r\n"
+                    "Content-type: %s\r\n\r\n", filesize, filetype);
+}
+
 /*
  * get_filetype - derive file type from file name
  */
-void get_filetype(char *filename, char *filetype) 
+void get_filetype(char *filename, char *filetype)
 {
     if (strstr(filename, ".html"))
 	strcpy(filetype, "text/html");
@@ -188,30 +553,44 @@ void get_filetype(char *filename, char *filetype)
 	strcpy(filetype, "image/jpeg");
     else
 	strcpy(filetype, "text/plain");
-}  
+}
 /* $end serve_static */
 
 /*
  * serve_dynamic - run a CGI program on behalf of the client
  */
 /* $begin serve_dynamic */
-void serve_dynamic(int fd, char *filename, char *cgiargs) 
+void serve_dynamic(int fd, char *filename, char *cgiargs)
+{
+    pid_t pid = spawn_cgi(fd, filename, cgiargs);
+
+    /* Other workers have children too, so wait for this one only */
+    if (pid > 0)
+	Waitpid(pid, NULL, 0); /* Parent waits for and reaps child */ //line:netp:servedynamic:wait
+}
+
+/*
+ * spawn_cgi - send the first part of the response and start the CGI
+ *             program, return its pid, or 0 if the client went away
+ */
+pid_t spawn_cgi(int fd, char *filename, char *cgiargs)
 {
+    pid_t pid;
     char buf[MAXLINE], *emptylist[] = { NULL };
 
     /* Return first part of HTTP response */
-    sprintf(buf, "HTTP/1.0 200 OK\r\n"); 
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-  
-    if (Fork() == 0) { /* Child */ //line:netp:servedynamic:fork
+    sprintf(buf, "HTTP/1.0 200 OK\r\n"
+                 "Server: Tiny Web Server\r\n");
+    if (rio_writen(fd, buf, strlen(buf)) != strlen(buf))
+	return 0;
+
+    if ((pid = Fork()) == 0) { /* Child */ //line:netp:servedynamic:fork
 	/* Real server would set all CGI vars here */
 	setenv("QUERY_STRING", cgiargs, 1); //line:netp:servedynamic:setenv
 	Dup2(fd, STDOUT_FILENO);         /* Redirect stdout to client */ //line:netp:servedynamic:dup2
 	Execve(filename, emptylist, environ); /* Run CGI program */ //line:netp:servedynamic:execve
     }
-    Wait(NULL); /* Parent waits for and reaps child */ //line:netp:servedynamic:wait
+    return pid;
 }
 /* $end serve_dynamic */
 
@@ -219,27 +598,35 @@ void serve_dynamic(int fd, char *filename, char *cgiargs)
  * clienterror - returns an error message to the client
  */
 /* $begin clienterror */
-void clienterror(int fd, char *cause, char *errnum, 
-		 char *shortmsg, char *longmsg) 
+void clienterror(int fd, char *cause, char *errnum,
+		 char *shortmsg, char *longmsg)
 {
-    char buf[MAXLINE];
+    char buf[MAXBUF];
+    int len = error_message(buf, cause, errnum, shortmsg, longmsg);
+
+    rio_writen(fd, buf, len);
+}
+
+/*
+ * error_message - format the whole error response into buf,
+ *                 return its length
+ */
+int error_message(char *buf, char *cause, char *errnum,
+		  char *shortmsg, char *longmsg)
+{
+    int len;
 
     /* Print the HTTP response headers */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    len = snprintf(buf, MAXBUF, "HTTP/1.0 %s %s\r\n"
+                   "Content-type: text/html\r\n\r\n", errnum, shortmsg);
 
     /* Print the HTTP response body */
-    sprintf(buf, "<html><title>Tiny Error</title>");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<body bgcolor=""ffffff"">\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<p>%s: %s\r\n", longmsg, cause);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<hr><em>The Tiny Web server</em>\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    len += snprintf(buf + len, MAXBUF - len, "<html><title>Tiny Error</title>"
+                    "<body bgcolor=""ffffff"">\r\n"
+                    "%s: %s\r\n"
+                    "<p>%s: %.*s\r\n"
+                    "<hr><em>The Tiny Web server</em>\r\n",
+                    errnum, shortmsg, longmsg, MAXLINE / 2, cause);
+    return (len < MAXBUF ? len : MAXBUF - 1);
 }
 /* $end clienterror */
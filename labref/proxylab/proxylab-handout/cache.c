@@ -0,0 +1,567 @@
+#include <limits.h>
+#include "cache.h"
+#include "log.h"
+
+static Cache cache;
+
+static void lru_access(unsigned int hash, CacheObject* object);
+static int lru_insert(CacheObject* object);
+static void clock_access(unsigned int hash, CacheObject* object);
+static int clock_insert(CacheObject* object);
+static void tinylfu_access(unsigned int hash, CacheObject* object);
+static int tinylfu_insert(CacheObject* object);
+
+static const CachePolicy policies[] = {
+    { "lru",     lru_access,     lru_insert,     MAX_CACHE_SIZE },
+    { "clock",   clock_access,   clock_insert,   MAX_CACHE_SIZE },
+    { "tinylfu", tinylfu_access, tinylfu_insert, MAX_CACHE_SIZE - CACHE_WINDOW_SIZE },
+};
+
+static int is_least_recently(const timeval_t* t1, const timeval_t* t2);
+static sem_t* stripe_of(unsigned int hash);
+static CacheObject** find_object(const char* key, unsigned int hash);
+static CacheRing* ring_of(CacheObject* object);
+static void ring_push(CacheRing* ring, CacheObject* object);
+static void ring_remove(CacheRing* ring, CacheObject* object);
+static CacheObject* clock_victim(CacheRing* ring);
+static unsigned int sketch_index(unsigned int hash, int row);
+static void sketch_increment(unsigned int hash);
+static int sketch_estimate(unsigned int hash);
+static CacheObject* new_object(ChunkChain* chain, const char* key, unsigned int hash,
+                               const Freshness* freshness);
+static void link_object(CacheObject* object);
+static void unlink_object(CacheObject* object);
+static void evict_object(CacheObject* object);
+static void free_object(CacheObject* object);
+
+/* FNV-1a hash of the key */
+unsigned int hash_key(const char* key) {
+    unsigned int hash = 2166136261u;
+    for (const char* p = key; *p != '\0'; ++p) {
+        hash ^= (unsigned char)*p;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/* returns 0 if there is no policy of that name, spill gets every object
+   evicted, under writer, before it leaves the cache */
+int init_cache(const char* policy, void (*spill)(CacheObject* object)) {
+    cache.policy = NULL;
+    for (int i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i) {
+        if (strcmp(policies[i].name, policy) == 0) {
+            cache.policy = &policies[i];
+        }
+    }
+    if (cache.policy == NULL) {
+        return 0;
+    }
+    cache.spill = spill;
+
+    cache.window.hand = cache.main.hand = NULL;
+    cache.window.nobjects = cache.main.nobjects = 0;
+    cache.window.size = cache.main.size = 0;
+    cache.nobjects = 0;
+    cache.size = 0;
+    cache.nevicted = 0;
+
+    for (int i = 0; i < CACHE_BUCKET_COUNT; ++i) {
+        cache.buckets[i] = NULL;
+    }
+
+    for (int i = 0; i < CACHE_STRIPE_COUNT; ++i) {
+        Sem_init(&cache.stripes[i], 0, 1);
+    }
+
+    Sem_init(&cache.writer, 0, 1);
+
+    memset(cache.sketch, 0, sizeof(cache.sketch));
+    cache.nsamples = 0;
+
+    return 1;
+}
+
+/* find the object and pin it, the caller must cache_release it */
+CacheObject* cache_lookup(const char* key, unsigned int hash) {
+    sem_t* stripe = stripe_of(hash);
+
+    /* begin stripe critical section */
+    P(stripe);
+
+    CacheObject* object = *find_object(key, hash);
+    if (object != NULL) {
+        __atomic_add_fetch(&object->refcnt, 1, __ATOMIC_RELAXED);
+    }
+    cache.policy->access(hash, object);
+
+    V(stripe);
+    /* end stripe critical section */
+
+    return object;
+}
+
+/* take another reference to an object already pinned or still linked */
+void cache_pin(CacheObject* object) {
+    __atomic_add_fetch(&object->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/* drop a reference, the last one frees the object */
+void cache_release(CacheObject* object) {
+    if (__atomic_sub_fetch(&object->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        free_object(object);
+    }
+}
+
+int read_cache(int clientfd, const char* key, unsigned int hash) {
+    CacheObject* object = cache_lookup(key, hash);
+
+    if (object != NULL) {
+        /* send data to the client without holding any lock */
+        int len = object->size;
+        if (len != chain_writen(clientfd, object->chain, 0, len)) {
+            log_warn("Proxy write data to client failure");
+        }
+
+        cache_release(object);
+    }
+
+    log_debug("read_cache: %d", object != NULL);
+
+    return object != NULL;
+}
+
+/* the object adopts the chain without copying it, returns the object
+   pinned for the caller, who must cache_release it, it stays out of the
+   cache if it is too large, and replaces the object cached under the key,
+   which must have gone stale, a NULL freshness never expires */
+CacheObject* write_cache(ChunkChain* chain, const char* key, unsigned int hash,
+                         const Freshness* freshness) {
+    int size = chain->size;
+
+    /* build the object before taking any lock, the cache owns one
+       reference and the caller another */
+    CacheObject* object = new_object(chain, key, hash, freshness);
+    object->refcnt = 2;
+
+    if (size > MAX_OBJECT_SIZE) {
+        object->refcnt = 1;
+        return object;
+    }
+
+    /* only one writer at a time, so the index can't change under our feet */
+    P(&cache.writer);
+
+    /* the newer response wins, the old one isn't worth spilling */
+    sem_t* stripe = stripe_of(hash);
+    P(stripe);
+    CacheObject* old = *find_object(key, hash);
+    V(stripe);
+    if (old != NULL) {
+        unlink_object(old);
+        cache_release(old);
+    }
+
+    link_object(object);
+    int nevicted = cache.policy->insert(object);
+    cache.nevicted += nevicted;
+
+    V(&cache.writer);
+
+    log_debug("write %d bytes to cache, %d objects evicted", size, nevicted);
+
+    return object;
+}
+
+/* put an object of a snapshot back on the ring it was on without going
+   through the policy, it becomes the last of the ring to be evicted,
+   returns 0 and frees the chain if the object doesn't fit the budget of
+   the ring or the key is cached already */
+int cache_restore(ChunkChain* chain, const char* key, unsigned int hash,
+                  const Freshness* freshness, enum CacheSegment segment) {
+    int size = chain->size;
+
+    /* a policy without a window keeps everything on main */
+    int window_size = MAX_CACHE_SIZE - cache.policy->main_size;
+    if (window_size == 0) {
+        segment = SEGMENT_MAIN;
+    }
+    CacheRing* ring = (segment == SEGMENT_WINDOW ? &cache.window : &cache.main);
+    int budget = (segment == SEGMENT_WINDOW ? window_size : cache.policy->main_size);
+
+    P(&cache.writer);
+
+    sem_t* stripe = stripe_of(hash);
+    P(stripe);
+    int exists = (*find_object(key, hash) != NULL);
+    V(stripe);
+    if (exists || size > MAX_OBJECT_SIZE || cache.size + size > MAX_CACHE_SIZE ||
+        ring->size + size > budget) {
+        V(&cache.writer);
+        free_chain(chain);
+        return 0;
+    }
+
+    CacheObject* object = new_object(chain, key, hash, freshness);
+    object->segment = segment;
+    link_object(object);
+    ring_push(ring, object);
+
+    V(&cache.writer);
+
+    return 1;
+}
+
+int is_fresh(const CacheObject* object, time_t now) {
+    return now < __atomic_load_n(&object->freshness.expires, __ATOMIC_RELAXED);
+}
+
+/* the server says the stale object didn't change, serve it for longer */
+void cache_renew(CacheObject* object, const Freshness* freshness) {
+    __atomic_store_n(&object->freshness.expires, freshness->expires, __ATOMIC_RELAXED);
+}
+
+/* consistent as of one write */
+void cache_stats(int* nobjects, int* size, long* nevicted) {
+    P(&cache.writer);
+    *nobjects = cache.nobjects;
+    *size = cache.size;
+    *nevicted = cache.nevicted;
+    V(&cache.writer);
+}
+
+/* pin every cached object, the main ring then the window, the next to be
+   evicted first in each, and return them in a malloc'd array, nmain gets
+   how many are on main, the caller must cache_release each one */
+int cache_pin_objects(CacheObject*** objects, int* nmain) {
+    P(&cache.writer);
+
+    int n = 0;
+    *objects = Malloc((cache.nobjects + 1) * sizeof(CacheObject*));
+    CacheRing* rings[] = { &cache.main, &cache.window };
+    for (int i = 0; i < sizeof(rings) / sizeof(rings[0]); ++i) {
+        CacheObject* p = rings[i]->hand;
+        for (int j = 0; j < rings[i]->nobjects; ++j) {
+            __atomic_add_fetch(&p->refcnt, 1, __ATOMIC_RELAXED);
+            (*objects)[n++] = p;
+            p = p->next_object;
+        }
+    }
+    *nmain = cache.main.nobjects;
+
+    V(&cache.writer);
+
+    return n;
+}
+
+void deinit_cache() {
+    cache.spill = NULL;
+    while (cache.window.hand != NULL) {
+        evict_object(cache.window.hand);
+    }
+    while (cache.main.hand != NULL) {
+        evict_object(cache.main.hand);
+    }
+
+    for (int i = 0; i < CACHE_STRIPE_COUNT; ++i) {
+        sem_destroy(&cache.stripes[i]);
+    }
+
+    sem_destroy(&cache.writer);
+}
+
+/*
+ * LRU: every hit stamps the object, eviction scans every object for the
+ * oldest stamp, taking each stripe in turn.
+ */
+static void lru_access(unsigned int hash, CacheObject* object) {
+    if (object != NULL) {
+        gettimeofday(&object->timestamp, NULL);
+    }
+}
+
+static int lru_insert(CacheObject* object) {
+    ring_push(&cache.main, object);
+
+    int nevicted = 0;
+    while (cache.size > MAX_CACHE_SIZE) {
+        /* find the victim using the approximate LRU,
+           despite the timestamp may get changed during comparision */
+        CacheObject* victim = NULL;
+        timeval_t min_timestamp = { LONG_MAX, LONG_MAX };
+        CacheObject* p = cache.main.hand;
+        do {
+            sem_t* object_stripe = stripe_of(p->hash);
+            P(object_stripe);
+            if (p != object && is_least_recently(&p->timestamp, &min_timestamp)) {
+                victim = p;
+                min_timestamp = p->timestamp;
+            }
+            V(object_stripe);
+            p = p->next_object;
+        } while (p != cache.main.hand);
+
+        evict_object(victim);
+        nevicted++;
+    }
+
+    return nevicted;
+}
+
+/*
+ * CLOCK: a hit only sets the reference bit, the hand gives every
+ * referenced object a second chance before evicting it.
+ */
+static void clock_access(unsigned int hash, CacheObject* object) {
+    if (object != NULL && !object->referenced) {
+        __atomic_store_n(&object->referenced, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static int clock_insert(CacheObject* object) {
+    ring_push(&cache.main, object);
+
+    int nevicted = 0;
+    while (cache.size > MAX_CACHE_SIZE) {
+        evict_object(clock_victim(&cache.main));
+        nevicted++;
+    }
+
+    return nevicted;
+}
+
+/*
+ * W-TinyLFU: new objects enter a small CLOCK window. An object pushed out
+ * of the window only gets into the main CLOCK segment if the sketch saw
+ * its key more often than the key of the main victim, so a burst of
+ * one-hit wonders can't flush the objects that are hit all the time.
+ */
+static void tinylfu_access(unsigned int hash, CacheObject* object) {
+    clock_access(hash, object);
+    sketch_increment(hash);
+}
+
+static int tinylfu_insert(CacheObject* object) {
+    object->segment = SEGMENT_WINDOW;
+    ring_push(&cache.window, object);
+
+    int nevicted = 0;
+    while (cache.window.size > CACHE_WINDOW_SIZE) {
+        CacheObject* candidate = clock_victim(&cache.window);
+        int frequency = sketch_estimate(candidate->hash);
+
+        /* the candidate replaces victims as long as it is more popular */
+        int admitted = 1;
+        while (cache.main.size + candidate->size > cache.policy->main_size) {
+            CacheObject* victim = clock_victim(&cache.main);
+            if (sketch_estimate(victim->hash) >= frequency) {
+                admitted = 0;
+                break;
+            }
+            evict_object(victim);
+            nevicted++;
+        }
+
+        if (admitted) {
+            ring_remove(&cache.window, candidate);
+            candidate->segment = SEGMENT_MAIN;
+            ring_push(&cache.main, candidate);
+        } else {
+            evict_object(candidate);
+            nevicted++;
+        }
+    }
+
+    return nevicted;
+}
+
+static int is_least_recently(const timeval_t* t1, const timeval_t* t2) {
+    if ((t1->tv_sec < t2->tv_sec) ||
+        ((t1->tv_sec == t2->tv_sec) && (t1->tv_usec < t2->tv_usec))) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+/* the lock guarding the bucket of the hash */
+static sem_t* stripe_of(unsigned int hash) {
+    return &cache.stripes[(hash & (CACHE_BUCKET_COUNT - 1)) % CACHE_STRIPE_COUNT];
+}
+
+/* find the link pointing to the object with the key,
+   or the tail link of the bucket, caller holds the stripe */
+static CacheObject** find_object(const char* key, unsigned int hash) {
+    CacheObject** link = &cache.buckets[hash & (CACHE_BUCKET_COUNT - 1)];
+    while (*link != NULL) {
+        if ((*link)->hash == hash && strcmp((*link)->key, key) == 0) {
+            break;
+        }
+        link = &(*link)->next;
+    }
+
+    return link;
+}
+
+static CacheRing* ring_of(CacheObject* object) {
+    return (object->segment == SEGMENT_WINDOW ? &cache.window : &cache.main);
+}
+
+/* add the object right behind the hand, so it is examined last */
+static void ring_push(CacheRing* ring, CacheObject* object) {
+    if (ring->hand == NULL) {
+        object->prev_object = object->next_object = object;
+        ring->hand = object;
+    } else {
+        object->next_object = ring->hand;
+        object->prev_object = ring->hand->prev_object;
+        ring->hand->prev_object->next_object = object;
+        ring->hand->prev_object = object;
+    }
+
+    ring->nobjects++;
+    ring->size += object->size;
+}
+
+static void ring_remove(CacheRing* ring, CacheObject* object) {
+    if (object->next_object == object) {
+        ring->hand = NULL;
+    } else {
+        object->prev_object->next_object = object->next_object;
+        object->next_object->prev_object = object->prev_object;
+        if (ring->hand == object) {
+            ring->hand = object->next_object;
+        }
+    }
+
+    ring->nobjects--;
+    ring->size -= object->size;
+}
+
+/* advance the hand past the referenced objects, clearing their bit,
+   and return the first one that wasn't, the ring must not be empty */
+static CacheObject* clock_victim(CacheRing* ring) {
+    /* hits keep setting bits behind the hand, so bound the sweep */
+    for (int i = 0; i < 2 * ring->nobjects; ++i) {
+        if (!__atomic_exchange_n(&ring->hand->referenced, 0, __ATOMIC_RELAXED)) {
+            break;
+        }
+        ring->hand = ring->hand->next_object;
+    }
+
+    return ring->hand;
+}
+
+/* counter of the hash in the row, each row mixes the hash differently */
+static unsigned int sketch_index(unsigned int hash, int row) {
+    static const unsigned int seeds[CACHE_SKETCH_DEPTH] = {
+        0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu
+    };
+
+    unsigned int h = (hash ^ (hash >> 16)) * seeds[row];
+    return (h ^ (h >> 15)) & (CACHE_SKETCH_WIDTH - 1);
+}
+
+/* count an access, counters saturate at 15 and are all halved every
+   CACHE_SKETCH_RESET accesses, so old popularity fades; races between
+   threads only make the counts a bit less exact */
+static void sketch_increment(unsigned int hash) {
+    for (int row = 0; row < CACHE_SKETCH_DEPTH; ++row) {
+        unsigned char* counter = &cache.sketch[row][sketch_index(hash, row)];
+        if (__atomic_load_n(counter, __ATOMIC_RELAXED) < 15) {
+            __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (__atomic_add_fetch(&cache.nsamples, 1, __ATOMIC_RELAXED) == CACHE_SKETCH_RESET) {
+        for (int row = 0; row < CACHE_SKETCH_DEPTH; ++row) {
+            for (int i = 0; i < CACHE_SKETCH_WIDTH; ++i) {
+                unsigned char* counter = &cache.sketch[row][i];
+                __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) >> 1,
+                                 __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_store_n(&cache.nsamples, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/* the least of the counters bounds the real count from above */
+static int sketch_estimate(unsigned int hash) {
+    int estimate = 15;
+    for (int row = 0; row < CACHE_SKETCH_DEPTH; ++row) {
+        int count = __atomic_load_n(&cache.sketch[row][sketch_index(hash, row)], __ATOMIC_RELAXED);
+        if (count < estimate) {
+            estimate = count;
+        }
+    }
+
+    return estimate;
+}
+
+/* an object adopting the chain with a single reference, for the cache */
+static CacheObject* new_object(ChunkChain* chain, const char* key, unsigned int hash,
+                               const Freshness* freshness) {
+    CacheObject* object = Malloc(sizeof(CacheObject));
+    gettimeofday(&object->timestamp, NULL);
+    object->referenced = 0;
+    object->segment = SEGMENT_MAIN;
+    object->hash = hash;
+    object->key = Malloc(strlen(key) + 1);
+    strcpy(object->key, key);
+    object->chain = chain;
+    object->size = chain->size;
+    if (freshness != NULL) {
+        object->freshness = *freshness;
+    } else {
+        object->freshness.expires = LONG_MAX;
+        object->freshness.etag[0] = object->freshness.last_modified[0] = '\0';
+    }
+    object->refcnt = 1;
+    object->next = NULL;
+
+    return object;
+}
+
+/* publish the object in the index and account for its bytes, the policy
+   puts it on a ring, caller holds the writer */
+static void link_object(CacheObject* object) {
+    int bucket = object->hash & (CACHE_BUCKET_COUNT - 1);
+    sem_t* stripe = stripe_of(object->hash);
+    P(stripe);
+    object->next = cache.buckets[bucket];
+    cache.buckets[bucket] = object;
+    V(stripe);
+
+    cache.nobjects++;
+    cache.size += object->size;
+}
+
+/* remove the object from the index so no new reader can find it,
+   and from its ring, caller holds the writer */
+static void unlink_object(CacheObject* object) {
+    sem_t* stripe = stripe_of(object->hash);
+    P(stripe);
+    CacheObject** link = find_object(object->key, object->hash);
+    *link = object->next;
+    V(stripe);
+
+    ring_remove(ring_of(object), object);
+
+    cache.nobjects--;
+    cache.size -= object->size;
+}
+
+/* readers that pinned the object keep it alive */
+static void evict_object(CacheObject* object) {
+    if (cache.spill != NULL) {
+        cache.spill(object);
+    }
+    unlink_object(object);
+    cache_release(object);
+}
+
+static void free_object(CacheObject* object) {
+    free(object->key);
+    free_chain(object->chain);
+    free(object);
+}
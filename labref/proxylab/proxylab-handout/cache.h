@@ -0,0 +1,106 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "csapp.h"
+#include "chunk.h"
+#include "http.h"
+
+/* Recommended max cache and object sizes, the cache holds as many objects
+   as fit in MAX_CACHE_SIZE bytes of data */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/* Hash index, the bucket count must be a power of 2 */
+#define CACHE_BUCKET_COUNT 1024
+#define CACHE_STRIPE_COUNT 64
+
+/* W-TinyLFU: share of the bytes for the admission window, and the
+   frequency sketch, whose width must be a power of 2 */
+#define CACHE_WINDOW_PERCENT 10
+#define CACHE_WINDOW_SIZE (MAX_CACHE_SIZE / 100 * CACHE_WINDOW_PERCENT)
+#define CACHE_SKETCH_DEPTH 4
+#define CACHE_SKETCH_WIDTH 4096
+#define CACHE_SKETCH_RESET (10 * CACHE_SKETCH_WIDTH)
+
+#define DEFAULT_CACHE_POLICY "tinylfu"
+
+typedef struct timeval timeval_t;
+
+enum CacheSegment {
+    SEGMENT_WINDOW,               /* recently admitted, W-TinyLFU only */
+    SEGMENT_MAIN,                 /* everything else */
+};
+
+/*
+ * A cached object is immutable once it is published in the index, but for
+ * its expiry. Readers pin it with a reference, drop every lock, and stream
+ * it to the client; eviction only unlinks it and the last reference frees it.
+ */
+typedef struct CacheObject {
+    timeval_t timestamp;          /* last hit for the LRU policy, guarded by the stripe */
+    int referenced;               /* CLOCK reference bit, set on hit without a lock */
+    enum CacheSegment segment;    /* ring the object is on, guarded by writer */
+    unsigned int hash;            /* hash of the key */
+    char* key;                    /* key for cached object */
+    ChunkChain* chain;            /* cached data */
+    int size;                     /* size of the cache object */
+    Freshness freshness;          /* a 304 renews expires, updated atomically */
+    int refcnt;                   /* number of references, updated atomically */
+    struct CacheObject* next;     /* next object in the same bucket */
+    struct CacheObject* prev_object;  /* ring of the segment, guarded by writer */
+    struct CacheObject* next_object;
+} CacheObject;
+
+/* objects in a circular list, the CLOCK hand points at the next one to examine */
+typedef struct CacheRing {
+    CacheObject* hand;
+    int nobjects;
+    int size;                     /* bytes of the objects */
+} CacheRing;
+
+/*
+ * A replacement policy. access runs on every lookup under the stripe, with
+ * a NULL object on a miss; insert runs under writer, links the new object
+ * and evicts until the cache fits, returning how many objects it evicted.
+ * main_size bounds the main ring, the rest of the budget is the window.
+ */
+typedef struct CachePolicy {
+    const char* name;
+    void (*access)(unsigned int hash, CacheObject* object);
+    int (*insert)(CacheObject* object);
+    int main_size;
+} CachePolicy;
+
+typedef struct Cache {
+    const CachePolicy* policy;                 /* replacement policy */
+    void (*spill)(CacheObject* object);        /* gets every evicted object, NULL if none */
+    CacheRing window;                          /* admission window, guarded by writer */
+    CacheRing main;                            /* main segment, guarded by writer */
+    int nobjects;                              /* number of cached objects */
+    int size;                                  /* bytes of cached data, at most MAX_CACHE_SIZE */
+    long nevicted;                             /* objects evicted so far, guarded by writer */
+    CacheObject* buckets[CACHE_BUCKET_COUNT];  /* hash index on the keys */
+    sem_t stripes[CACHE_STRIPE_COUNT];         /* bucket i is guarded by stripe i % CACHE_STRIPE_COUNT */
+    sem_t writer;                              /* serialize the writers */
+    unsigned char sketch[CACHE_SKETCH_DEPTH][CACHE_SKETCH_WIDTH];  /* 4-bit access counters */
+    int nsamples;                              /* accesses since the counters were halved */
+} Cache;
+
+unsigned int hash_key(const char* key);
+
+int init_cache(const char* policy, void (*spill)(CacheObject* object));
+CacheObject* cache_lookup(const char* key, unsigned int hash);
+void cache_pin(CacheObject* object);
+void cache_release(CacheObject* object);
+int read_cache(int clientfd, const char* key, unsigned int hash);
+CacheObject* write_cache(ChunkChain* chain, const char* key, unsigned int hash,
+                         const Freshness* freshness);
+int cache_restore(ChunkChain* chain, const char* key, unsigned int hash,
+                  const Freshness* freshness, enum CacheSegment segment);
+int is_fresh(const CacheObject* object, time_t now);
+void cache_renew(CacheObject* object, const Freshness* freshness);
+void cache_stats(int* nobjects, int* size, long* nevicted);
+int cache_pin_objects(CacheObject*** objects, int* nmain);
+void deinit_cache();
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,234 @@
+/*
+ * cachebench - replay a trace of requests against the proxy cache and
+ * compare the replacement policies
+ *
+ * A trace file has one request per line, "key [size]", e.g. the URLs the
+ * proxy logged; without a size the object gets a made-up one. Without a
+ * trace file the requests follow a Zipf distribution over the keys.
+ * Every miss fills a chain and writes it to the cache, like the proxy
+ * does after fetching the object from the server.
+ */
+#include <math.h>
+#include "cache.h"
+
+#define DEFAULT_REQUEST_COUNT 1000000
+#define DEFAULT_KEY_COUNT 10000
+#define DEFAULT_SKEW 0.9
+#define MIN_SYNTHETIC_SIZE 256
+
+typedef struct TraceRequest {
+    char* key;
+    unsigned int hash;
+    int size;
+} TraceRequest;
+
+typedef struct Trace {
+    TraceRequest* requests;
+    int nrequests;
+} Trace;
+
+typedef struct Replay {
+    const Trace* trace;
+    int first;                    /* the thread replays first, first + stride, ... */
+    int stride;
+    long hits;
+    long bytes;
+    long hit_bytes;
+} Replay;
+
+static const char* all_policies[] = { "lru", "clock", "tinylfu" };
+
+void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-p policy] [-t threads] [-n requests] [-k keys] [-s skew] [trace]\n"
+                    "  -p  policy to replay: lru, clock or tinylfu (default: all of them)\n"
+                    "  -n, -k, -s  shape of the Zipf trace made up without a trace file\n"
+                    "              (default: %d requests over %d keys, skew %.1f)\n",
+            name, DEFAULT_REQUEST_COUNT, DEFAULT_KEY_COUNT, DEFAULT_SKEW);
+    exit(1);
+}
+
+/* log-uniform in [MIN_SYNTHETIC_SIZE, MAX_OBJECT_SIZE], fixed per key */
+int synthetic_size(unsigned int hash) {
+    double u = (hash % 10007) / 10007.0;
+    return (int)(MIN_SYNTHETIC_SIZE * pow((double)MAX_OBJECT_SIZE / MIN_SYNTHETIC_SIZE, u));
+}
+
+void add_request(Trace* trace, int* capacity, const char* key, int size) {
+    if (trace->nrequests == *capacity) {
+        *capacity = (*capacity == 0 ? 1024 : 2 * *capacity);
+        trace->requests = Realloc(trace->requests, *capacity * sizeof(TraceRequest));
+    }
+
+    TraceRequest* request = &trace->requests[trace->nrequests++];
+    request->key = Malloc(strlen(key) + 1);
+    strcpy(request->key, key);
+    request->hash = hash_key(key);
+    request->size = (size > 0 ? size : synthetic_size(request->hash));
+}
+
+void read_trace(Trace* trace, const char* filename) {
+    char line[MAXLINE], key[MAXLINE];
+    int capacity = 0;
+
+    FILE* fp = fopen(filename, "r");
+    if (fp == NULL) {
+        unix_error("Open trace failure");
+    }
+
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        int size = 0;
+        if (sscanf(line, "%s %d", key, &size) >= 1) {
+            add_request(trace, &capacity, key, size);
+        }
+    }
+
+    fclose(fp);
+}
+
+void make_trace(Trace* trace, int nrequests, int nkeys, double skew) {
+    char key[MAXLINE];
+    int capacity = 0;
+
+    /* cumulative distribution, key i has weight 1 / (i + 1)^skew */
+    double* cdf = Malloc(nkeys * sizeof(double));
+    double sum = 0;
+    for (int i = 0; i < nkeys; ++i) {
+        sum += 1.0 / pow(i + 1, skew);
+        cdf[i] = sum;
+    }
+
+    unsigned int seed = 1;
+    for (int i = 0; i < nrequests; ++i) {
+        double u = (double)rand_r(&seed) / RAND_MAX * sum;
+        int lo = 0, hi = nkeys - 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (cdf[mid] < u) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        sprintf(key, "http://www.cmu.edu/object/%d", lo);
+        add_request(trace, &capacity, key, 0);
+    }
+
+    free(cdf);
+}
+
+void* replay_routine(void* vargp) {
+    Replay* replay = (Replay*)vargp;
+    const Trace* trace = replay->trace;
+
+    for (int i = replay->first; i < trace->nrequests; i += replay->stride) {
+        const TraceRequest* request = &trace->requests[i];
+        replay->bytes += request->size;
+
+        CacheObject* object = cache_lookup(request->key, request->hash);
+        if (object != NULL) {
+            replay->hits++;
+            replay->hit_bytes += object->size;
+            cache_release(object);
+            continue;
+        }
+
+        /* the bytes don't matter, so claim the tail space as it is */
+        ChunkChain* chain = new_chain(request->size);
+        int room;
+        char* tail;
+        while ((tail = chain_tail(chain, &room)) != NULL) {
+            chain_append(chain, tail, room);
+        }
+        cache_release(write_cache(chain, request->key, request->hash, NULL));
+    }
+
+    return NULL;
+}
+
+void replay_trace(const Trace* trace, const char* policy, int nthreads) {
+    struct timeval start, end;
+    pthread_t* tids = Malloc(nthreads * sizeof(pthread_t));
+    Replay* replays = Malloc(nthreads * sizeof(Replay));
+
+    if (!init_cache(policy, NULL)) {
+        fprintf(stderr, "Unknown policy %s\n", policy);
+        exit(1);
+    }
+    init_chunks();
+
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < nthreads; ++i) {
+        replays[i].trace = trace;
+        replays[i].first = i;
+        replays[i].stride = nthreads;
+        replays[i].hits = replays[i].bytes = replays[i].hit_bytes = 0;
+        Pthread_create(&tids[i], NULL, replay_routine, &replays[i]);
+    }
+
+    long hits = 0, bytes = 0, hit_bytes = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        Pthread_join(tids[i], NULL);
+        hits += replays[i].hits;
+        bytes += replays[i].bytes;
+        hit_bytes += replays[i].hit_bytes;
+    }
+    gettimeofday(&end, NULL);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%-8s  hit ratio %6.2f%%  byte hit ratio %6.2f%%  %10.0f requests/s\n",
+           policy, 100.0 * hits / trace->nrequests, 100.0 * hit_bytes / bytes,
+           trace->nrequests / seconds);
+
+    deinit_cache();
+    deinit_chunks();
+    free(replays);
+    free(tids);
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    const char* policy = NULL;
+    int nthreads = 1;
+    int nrequests = DEFAULT_REQUEST_COUNT;
+    int nkeys = DEFAULT_KEY_COUNT;
+    double skew = DEFAULT_SKEW;
+    Trace trace = { NULL, 0 };
+
+    while ((opt = getopt(argc, argv, "p:t:n:k:s:")) != -1) {
+        switch (opt) {
+            case 'p': policy = optarg;          break;
+            case 't': nthreads = atoi(optarg);  break;
+            case 'n': nrequests = atoi(optarg); break;
+            case 'k': nkeys = atoi(optarg);     break;
+            case 's': skew = atof(optarg);      break;
+            default:  usage(argv[0]);           break;
+        }
+    }
+
+    if (optind < argc - 1 || nthreads <= 0 || nrequests <= 0 || nkeys <= 0) {
+        usage(argv[0]);
+    }
+
+    if (optind == argc - 1) {
+        read_trace(&trace, argv[optind]);
+    } else {
+        make_trace(&trace, nrequests, nkeys, skew);
+    }
+    if (trace.nrequests == 0) {
+        fprintf(stderr, "Empty trace\n");
+        exit(1);
+    }
+
+    printf("%d requests, cache of %d bytes, %d threads\n",
+           trace.nrequests, MAX_CACHE_SIZE, nthreads);
+    if (policy != NULL) {
+        replay_trace(&trace, policy, nthreads);
+    } else {
+        for (int i = 0; i < sizeof(all_policies) / sizeof(all_policies[0]); ++i) {
+            replay_trace(&trace, all_policies[i], nthreads);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,205 @@
+#define _GNU_SOURCE // IOV_MAX
+#include <limits.h>
+#include <sys/uio.h>
+#include "chunk.h"
+
+typedef struct ChunkPool {
+    Chunk* free;                  /* free chunks kept for reuse */
+    int nfree;
+    sem_t mutex;                  /* protect free and nfree */
+} ChunkPool;
+
+static ChunkPool pool;
+
+static Chunk* alloc_chunk();
+static void free_chunks(Chunk* head);
+
+void init_chunks() {
+    pool.free = NULL;
+    pool.nfree = 0;
+
+    Sem_init(&pool.mutex, 0, 1);
+}
+
+ChunkChain* new_chain(int maxsize) {
+    ChunkChain* chain = Malloc(sizeof(ChunkChain));
+    chain->head = chain->tail = NULL;
+    chain->size = 0;
+    chain->nchunks = 0;
+    chain->maxsize = maxsize;
+
+    return chain;
+}
+
+/* free space after the last byte, a new chunk is linked in if the tail is
+   full, room is 0 once the chain reached maxsize; the bytes written there
+   belong to the chain only after chain_append of that very pointer */
+char* chain_tail(ChunkChain* chain, int* room) {
+    if (chain->size == chain->maxsize) {
+        *room = 0;
+        return NULL;
+    }
+
+    if (chain->size == chain->nchunks * CHUNK_SIZE) {
+        Chunk* chunk = alloc_chunk();
+        if (chain->tail != NULL) {
+            chain->tail->next = chunk;
+        } else {
+            chain->head = chunk;
+        }
+        chain->tail = chunk;
+        chain->nchunks++;
+    }
+
+    int offset = chain->size % CHUNK_SIZE;
+    *room = CHUNK_SIZE - offset;
+    if (*room > chain->maxsize - chain->size) {
+        *room = chain->maxsize - chain->size;
+    }
+
+    return chain->tail->data + offset;
+}
+
+/* append n bytes, which may already sit at chain_tail, returns 0 and
+   leaves the chain unchanged if they would grow it past maxsize */
+int chain_append(ChunkChain* chain, const char* buf, int n) {
+    if (chain->size + n > chain->maxsize) {
+        return 0;
+    }
+
+    while (n > 0) {
+        int room;
+        char* tail = chain_tail(chain, &room);
+        int len = (n < room ? n : room);
+        if (buf != tail) {
+            memcpy(tail, buf, len);
+        }
+        chain->size += len;
+        buf += len;
+        n -= len;
+    }
+
+    return 1;
+}
+
+/* copy the bytes [from, to) to buf */
+void chain_copy(const ChunkChain* chain, char* buf, int from, int to) {
+    Chunk* chunk = chain->head;
+    for (int i = 0; i < from / CHUNK_SIZE; ++i) {
+        chunk = chunk->next;
+    }
+
+    int offset = from % CHUNK_SIZE;
+    while (from < to) {
+        int len = CHUNK_SIZE - offset;
+        if (len > to - from) {
+            len = to - from;
+        }
+        memcpy(buf, chunk->data + offset, len);
+
+        buf += len;
+        from += len;
+        offset = 0;
+        chunk = chunk->next;
+    }
+}
+
+/* one writev of the bytes [from, to), returns what write returned */
+int chain_write(int fd, const ChunkChain* chain, int from, int to) {
+    struct iovec iov[IOV_MAX];
+    int iovcnt = 0;
+
+    Chunk* chunk = chain->head;
+    for (int i = 0; i < from / CHUNK_SIZE; ++i) {
+        chunk = chunk->next;
+    }
+
+    int offset = from % CHUNK_SIZE;
+    while (from < to && iovcnt < IOV_MAX) {
+        int len = CHUNK_SIZE - offset;
+        if (len > to - from) {
+            len = to - from;
+        }
+        iov[iovcnt].iov_base = chunk->data + offset;
+        iov[iovcnt].iov_len = len;
+        iovcnt++;
+
+        from += len;
+        offset = 0;
+        chunk = chunk->next;
+    }
+
+    return writev(fd, iov, iovcnt);
+}
+
+/* write the bytes [from, to) to a blocking descriptor, returns how many
+   were written, less than to - from on error */
+int chain_writen(int fd, const ChunkChain* chain, int from, int to) {
+    int pos = from;
+    while (pos < to) {
+        int n = chain_write(fd, chain, pos, to);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        pos += n;
+    }
+
+    return pos - from;
+}
+
+void free_chain(ChunkChain* chain) {
+    free_chunks(chain->head);
+    free(chain);
+}
+
+void deinit_chunks() {
+    while (pool.free != NULL) {
+        Chunk* chunk = pool.free;
+        pool.free = chunk->next;
+        free(chunk);
+    }
+    pool.nfree = 0;
+
+    sem_destroy(&pool.mutex);
+}
+
+static Chunk* alloc_chunk() {
+    P(&pool.mutex);
+    Chunk* chunk = pool.free;
+    if (chunk != NULL) {
+        pool.free = chunk->next;
+        pool.nfree--;
+    }
+    V(&pool.mutex);
+
+    if (chunk == NULL) {
+        chunk = Malloc(sizeof(Chunk));
+    }
+    chunk->next = NULL;
+
+    return chunk;
+}
+
+/* give the chunks back to the pool, free what doesn't fit */
+static void free_chunks(Chunk* head) {
+    while (head != NULL) {
+        Chunk* chunk = head;
+        head = chunk->next;
+
+        P(&pool.mutex);
+        int kept = (pool.nfree < CHUNK_POOL_MAX);
+        if (kept) {
+            chunk->next = pool.free;
+            pool.free = chunk;
+            pool.nfree++;
+        }
+        V(&pool.mutex);
+
+        if (!kept) {
+            free(chunk);
+        }
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef __CHUNK_H__
+#define __CHUNK_H__
+
+#include "csapp.h"
+
+/* Size of a chunk, and how many free chunks the pool keeps for reuse */
+#define CHUNK_SIZE 8192
+#define CHUNK_POOL_MAX 1024
+
+typedef struct Chunk {
+    struct Chunk* next;           /* next chunk of the chain, or of the free list */
+    char data[CHUNK_SIZE];
+} Chunk;
+
+/*
+ * A byte string stored in fixed-size chunks taken from a shared pool, so
+ * it grows without reallocating or moving the bytes already appended.
+ * Every chunk but the tail is full, byte i lives in chunk i / CHUNK_SIZE.
+ */
+typedef struct ChunkChain {
+    Chunk* head;
+    Chunk* tail;
+    int size;                     /* bytes in the chain */
+    int nchunks;                  /* chunks linked, the tail may be empty */
+    int maxsize;                  /* the chain refuses to grow past this */
+} ChunkChain;
+
+void init_chunks();
+ChunkChain* new_chain(int maxsize);
+char* chain_tail(ChunkChain* chain, int* room);
+int chain_append(ChunkChain* chain, const char* buf, int n);
+void chain_copy(const ChunkChain* chain, char* buf, int from, int to);
+int chain_write(int fd, const ChunkChain* chain, int from, int to);
+int chain_writen(int fd, const ChunkChain* chain, int from, int to);
+void free_chain(ChunkChain* chain);
+void deinit_chunks();
+
+#endif /* __CHUNK_H__ */
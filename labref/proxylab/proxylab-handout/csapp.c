@@ -993,7 +993,7 @@ int open_clientfd(char *hostname, char *port) {
  *       -1 with errno set for other errors.
  */
 /* $begin open_listenfd */
-int open_listenfd(char *port) 
+static int open_listenfd_opt(char *port, int reuseport) 
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -1018,6 +1018,14 @@ int open_listenfd(char *port)
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
 
+        /* Let every worker process bind the port, the kernel spreads
+           connections among their sockets */
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                    (const void *)&optval , sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
+
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
             break; /* Success */
@@ -1040,6 +1048,20 @@ int open_listenfd(char *port)
     }
     return listenfd;
 }
+
+int open_listenfd(char *port) 
+{
+    return open_listenfd_opt(port, 0);
+}
+
+/*
+ * open_reuseport_listenfd - Like open_listenfd, but other sockets with
+ *     SO_REUSEPORT may listen on the same port.
+ */
+int open_reuseport_listenfd(char *port) 
+{
+    return open_listenfd_opt(port, 1);
+}
 /* $end open_listenfd */
 
 /****************************************************
@@ -1063,4 +1085,13 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_reuseport_listenfd(char *port) 
+{
+    int rc;
+
+    if ((rc = open_reuseport_listenfd(port)) < 0)
+        unix_error("Open_reuseport_listenfd error");
+    return rc;
+}
+
 /* $end csapp.c */
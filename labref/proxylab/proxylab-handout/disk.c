@@ -0,0 +1,520 @@
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include "disk.h"
+#include "http.h"
+#include "log.h"
+
+/*
+ * Only the disk thread appends and compacts, so the segment data needs no
+ * lock. Readers only look up the index and pin segments, which the mutex
+ * guards. The queue has a lock of its own, an eviction holding the writer
+ * of the memory cache only waits for other evictions.
+ */
+typedef struct Disk {
+    int enabled;
+    char dir[MAXLINE];            /* where the segment files live */
+    int max_segments;             /* the log is compacted beyond this */
+    Segment* oldest;              /* the log, oldest segment first */
+    Segment* newest;              /* the segment objects are appended to */
+    int nsegments;
+    int next_id;
+    DiskEntry* buckets[DISK_BUCKET_COUNT];  /* hash index on the keys */
+    long nobjects;                /* number of stored objects */
+    long size;                    /* bytes of stored objects */
+    pthread_mutex_t mutex;        /* protect the index, the log and the refcnts */
+    DiskJob* queue;               /* evicted objects to append, oldest first */
+    DiskJob* queue_tail;
+    long queued;                  /* bytes of the queued objects */
+    int stopping;                 /* the thread exits once the queue is empty */
+    pthread_mutex_t queue_mutex;  /* protect the queue and stopping */
+    pthread_cond_t queue_ready;   /* signaled when an object is queued */
+    pthread_t thread;             /* appends the queued objects */
+} Disk;
+
+static Disk disk;
+
+static void* disk_routine(void* argp);
+static void append_object(CacheObject* object);
+static void remove_segments();
+static Segment* new_segment();
+static void retire_segment(Segment* segment);
+static void release_segment(Segment* segment);
+static int roll_log();
+static void compact_segment(Segment* segment, Segment* into);
+static DiskEntry** find_entry(const char* key, unsigned int hash);
+static void unlink_entry(DiskEntry* entry);
+static void free_entry(DiskEntry* entry);
+
+/* capacity is in bytes, returns 0 if the directory or the first segment
+   can't be set up, the proxy then runs without the second tier */
+int init_disk(const char* dir, long capacity) {
+    if (strlen(dir) >= sizeof(disk.dir) - 32) {
+        log_error("Disk cache directory name too long");
+        return 0;
+    }
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        log_error("mkdir %s error: %s", dir, strerror(errno));
+        return 0;
+    }
+    strcpy(disk.dir, dir);
+    remove_segments();
+
+    disk.max_segments = capacity / DISK_SEGMENT_SIZE;
+    if (disk.max_segments < 2) {
+        disk.max_segments = 2;
+    }
+    disk.oldest = disk.newest = NULL;
+    disk.nsegments = 0;
+    disk.next_id = 0;
+
+    for (int i = 0; i < DISK_BUCKET_COUNT; ++i) {
+        disk.buckets[i] = NULL;
+    }
+    disk.nobjects = 0;
+    disk.size = 0;
+
+    pthread_mutex_init(&disk.mutex, NULL);
+
+    if (new_segment() == NULL) {
+        pthread_mutex_destroy(&disk.mutex);
+        return 0;
+    }
+
+    disk.queue = disk.queue_tail = NULL;
+    disk.queued = 0;
+    disk.stopping = 0;
+    pthread_mutex_init(&disk.queue_mutex, NULL);
+    pthread_cond_init(&disk.queue_ready, NULL);
+    Pthread_create(&disk.thread, NULL, disk_routine, NULL);
+
+    disk.enabled = 1;
+    return 1;
+}
+
+/* queue an object evicted from memory for the disk thread, called under
+   the writer of the memory cache, so the object is only pinned, and
+   dropped if the thread is too far behind */
+void disk_store(CacheObject* object) {
+    /* an older copy on disk is out of date already */
+    pthread_mutex_lock(&disk.mutex);
+    DiskEntry* old = *find_entry(object->key, object->hash);
+    if (old != NULL) {
+        unlink_entry(old);
+        old->dead = 1;
+    }
+    pthread_mutex_unlock(&disk.mutex);
+
+    pthread_mutex_lock(&disk.queue_mutex);
+    if (disk.stopping || disk.queued + object->size > DISK_QUEUE_SIZE) {
+        pthread_mutex_unlock(&disk.queue_mutex);
+        log_debug("disk_store: queue full, %d bytes dropped", object->size);
+        return;
+    }
+
+    DiskJob* job = Malloc(sizeof(DiskJob));
+    cache_pin(object);
+    job->object = object;
+    job->next = NULL;
+    if (disk.queue_tail != NULL) {
+        disk.queue_tail->next = job;
+    } else {
+        disk.queue = job;
+    }
+    disk.queue_tail = job;
+    disk.queued += object->size;
+    pthread_cond_signal(&disk.queue_ready);
+    pthread_mutex_unlock(&disk.queue_mutex);
+}
+
+/* append the queued objects one by one, rolling and compacting the log
+   as it fills, until deinit_disk stops the thread */
+static void* disk_routine(void* argp) {
+    while (1) {
+        pthread_mutex_lock(&disk.queue_mutex);
+        while (disk.queue == NULL && !disk.stopping) {
+            pthread_cond_wait(&disk.queue_ready, &disk.queue_mutex);
+        }
+        DiskJob* job = disk.queue;
+        if (job == NULL) {
+            pthread_mutex_unlock(&disk.queue_mutex);
+            return NULL;
+        }
+        disk.queue = job->next;
+        if (disk.queue == NULL) {
+            disk.queue_tail = NULL;
+        }
+        disk.queued -= job->object->size;
+        pthread_mutex_unlock(&disk.queue_mutex);
+
+        append_object(job->object);
+        cache_release(job->object);
+        free(job);
+    }
+}
+
+/* append the object to the log, it replaces any older copy */
+static void append_object(CacheObject* object) {
+    int size = object->size;
+
+    /* a copy appended since the object was queued is older, it stays in
+       its segment until compaction frees it */
+    pthread_mutex_lock(&disk.mutex);
+    DiskEntry* old = *find_entry(object->key, object->hash);
+    if (old != NULL) {
+        unlink_entry(old);
+        old->dead = 1;
+    }
+    pthread_mutex_unlock(&disk.mutex);
+
+    /* compaction leaves room for the object in the new segment */
+    if (disk.newest->size + size > DISK_SEGMENT_SIZE && !roll_log()) {
+        return;
+    }
+
+    /* nobody reads the space past size, so copy without the lock */
+    Segment* segment = disk.newest;
+    DiskEntry* entry = Malloc(sizeof(DiskEntry));
+    entry->hash = object->hash;
+    entry->key = Malloc(strlen(object->key) + 1);
+    strcpy(entry->key, object->key);
+    entry->segment = segment;
+    entry->offset = segment->size;
+    entry->size = size;
+    entry->persistent = is_persistent_response(object->chain, size);
+    entry->expires = object->freshness.expires;
+    entry->referenced = 0;
+    entry->dead = 0;
+
+    chain_copy(object->chain, segment->data + segment->size, 0, size);
+    segment->size += size;
+
+    pthread_mutex_lock(&disk.mutex);
+    DiskEntry** bucket = &disk.buckets[entry->hash & (DISK_BUCKET_COUNT - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    entry->next_entry = segment->entries;
+    segment->entries = entry;
+    disk.nobjects++;
+    disk.size += size;
+    pthread_mutex_unlock(&disk.mutex);
+
+    log_debug("append_object: %d bytes to segment %d", size, segment->id);
+}
+
+/* find the object and pin its segment if it is still fresh, the caller
+   must disk_release it */
+DiskObject* disk_lookup(const char* key, unsigned int hash) {
+    if (!disk.enabled) {
+        return NULL;
+    }
+
+    DiskObject* object = NULL;
+
+    pthread_mutex_lock(&disk.mutex);
+    DiskEntry* entry = *find_entry(key, hash);
+    if (entry != NULL && time(NULL) < entry->expires) {
+        entry->referenced = 1;
+        entry->segment->refcnt++;
+
+        object = Malloc(sizeof(DiskObject));
+        object->segment = entry->segment;
+        object->offset = entry->offset;
+        object->size = entry->size;
+        object->persistent = entry->persistent;
+    }
+    pthread_mutex_unlock(&disk.mutex);
+
+    return object;
+}
+
+/* copy the bytes [from, to) into buf, returns how many were read */
+int disk_read(const DiskObject* object, char* buf, int from, int to) {
+    int pos = from;
+    while (pos < to) {
+        int n = pread(object->segment->fd, buf + pos - from, to - pos, object->offset + pos);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        pos += n;
+    }
+
+    return pos - from;
+}
+
+/* one sendfile of the bytes [from, to), returns what sendfile returned */
+int disk_write(int fd, const DiskObject* object, int from, int to) {
+    off_t offset = object->offset + from;
+    return sendfile(fd, object->segment->fd, &offset, to - from);
+}
+
+/* send the bytes [from, to) to a blocking descriptor, returns how many
+   were sent, less than to - from on error */
+int disk_writen(int fd, const DiskObject* object, int from, int to) {
+    int pos = from;
+    while (pos < to) {
+        int n = disk_write(fd, object, pos, to);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        pos += n;
+    }
+
+    return pos - from;
+}
+
+void disk_release(DiskObject* object) {
+    pthread_mutex_lock(&disk.mutex);
+    release_segment(object->segment);
+    pthread_mutex_unlock(&disk.mutex);
+
+    free(object);
+}
+
+/* returns 0 if there is no second tier */
+int disk_stats(long* nobjects, long* size) {
+    if (!disk.enabled) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&disk.mutex);
+    *nobjects = disk.nobjects;
+    *size = disk.size;
+    pthread_mutex_unlock(&disk.mutex);
+
+    return 1;
+}
+
+void deinit_disk() {
+    if (!disk.enabled) {
+        return;
+    }
+    disk.enabled = 0;
+
+    /* the thread appends what is queued before it exits */
+    pthread_mutex_lock(&disk.queue_mutex);
+    disk.stopping = 1;
+    pthread_cond_signal(&disk.queue_ready);
+    pthread_mutex_unlock(&disk.queue_mutex);
+    Pthread_join(disk.thread, NULL);
+    pthread_mutex_destroy(&disk.queue_mutex);
+    pthread_cond_destroy(&disk.queue_ready);
+
+    pthread_mutex_lock(&disk.mutex);
+    while (disk.oldest != NULL) {
+        Segment* segment = disk.oldest;
+        while (segment->entries != NULL) {
+            DiskEntry* entry = segment->entries;
+            segment->entries = entry->next_entry;
+            free_entry(entry);
+        }
+        retire_segment(segment);
+    }
+    for (int i = 0; i < DISK_BUCKET_COUNT; ++i) {
+        disk.buckets[i] = NULL;
+    }
+    pthread_mutex_unlock(&disk.mutex);
+
+    pthread_mutex_destroy(&disk.mutex);
+}
+
+/* ids start over on every run, so the segments of an earlier one would
+   never be reused nor retired */
+static void remove_segments() {
+    char path[MAXLINE];
+    struct dirent* dirent;
+    int id;
+
+    DIR* dir = opendir(disk.dir);
+    if (dir == NULL) {
+        log_error("opendir %s error: %s", disk.dir, strerror(errno));
+        return;
+    }
+    while ((dirent = readdir(dir)) != NULL) {
+        if (sscanf(dirent->d_name, "segment.%d", &id) == 1) {
+            sprintf(path, "%s/%s", disk.dir, dirent->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+/* create the next segment file and append it to the log */
+static Segment* new_segment() {
+    char path[MAXLINE];
+    int rc;
+
+    int id = disk.next_id++;
+    sprintf(path, "%s/segment.%d", disk.dir, id);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log_error("open %s error: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    /* reserve the blocks now, running out of disk while storing through
+       the mapping would raise SIGBUS */
+    if ((rc = posix_fallocate(fd, 0, DISK_SEGMENT_SIZE)) != 0) {
+        log_error("posix_fallocate %s error: %s", path, strerror(rc));
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+
+    char* data = mmap(NULL, DISK_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        log_error("mmap %s error: %s", path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+
+    Segment* segment = Malloc(sizeof(Segment));
+    segment->id = id;
+    segment->fd = fd;
+    segment->data = data;
+    segment->size = 0;
+    segment->refcnt = 1;
+    segment->entries = NULL;
+    segment->next = NULL;
+
+    pthread_mutex_lock(&disk.mutex);
+    if (disk.newest != NULL) {
+        disk.newest->next = segment;
+    } else {
+        disk.oldest = segment;
+    }
+    disk.newest = segment;
+    disk.nsegments++;
+    pthread_mutex_unlock(&disk.mutex);
+
+    return segment;
+}
+
+/* take the oldest segment out of the log and remove its file, readers
+   still sending from it keep the descriptor open, caller holds the mutex */
+static void retire_segment(Segment* segment) {
+    char path[MAXLINE];
+
+    disk.oldest = segment->next;
+    if (disk.oldest == NULL) {
+        disk.newest = NULL;
+    }
+    disk.nsegments--;
+
+    sprintf(path, "%s/segment.%d", disk.dir, segment->id);
+    unlink(path);
+    munmap(segment->data, DISK_SEGMENT_SIZE);
+    segment->data = NULL;
+
+    release_segment(segment);
+}
+
+/* caller holds the mutex */
+static void release_segment(Segment* segment) {
+    if (--segment->refcnt == 0) {
+        close(segment->fd);
+        free(segment);
+    }
+}
+
+/* start a new segment, compacting the oldest one if the log is full,
+   returns 0 if the new segment can't be created */
+static int roll_log() {
+    Segment* segment = new_segment();
+    if (segment == NULL) {
+        return 0;
+    }
+
+    if (disk.nsegments > disk.max_segments) {
+        compact_segment(disk.oldest, segment);
+    }
+
+    return 1;
+}
+
+/* move the objects of the segment hit since they were written into the
+   empty segment, as long as room for one more object is left, drop the
+   others, then retire it */
+static void compact_segment(Segment* segment, Segment* into) {
+    DiskEntry* kept = NULL;
+    long room = DISK_SEGMENT_SIZE - MAX_OBJECT_SIZE - into->size;
+
+    /* decide once, a hit from now on can't save an object any more */
+    pthread_mutex_lock(&disk.mutex);
+    while (segment->entries != NULL) {
+        DiskEntry* entry = segment->entries;
+        segment->entries = entry->next_entry;
+        if (entry->referenced && !entry->dead && entry->size <= room) {
+            room -= entry->size;
+            entry->next_entry = kept;
+            kept = entry;
+        } else {
+            if (!entry->dead) {
+                unlink_entry(entry);
+            }
+            free_entry(entry);
+        }
+    }
+    pthread_mutex_unlock(&disk.mutex);
+
+    /* readers keep using the old copies meanwhile */
+    long offset = into->size;
+    for (DiskEntry* entry = kept; entry != NULL; entry = entry->next_entry) {
+        memcpy(into->data + offset, segment->data + entry->offset, entry->size);
+        offset += entry->size;
+    }
+
+    pthread_mutex_lock(&disk.mutex);
+    while (kept != NULL) {
+        DiskEntry* entry = kept;
+        kept = entry->next_entry;
+        entry->segment = into;
+        entry->offset = into->size;
+        entry->referenced = 0;
+        into->size += entry->size;
+        entry->next_entry = into->entries;
+        into->entries = entry;
+    }
+    retire_segment(segment);
+    pthread_mutex_unlock(&disk.mutex);
+}
+
+/* find the link pointing to the entry with the key,
+   or the tail link of the bucket, caller holds the mutex */
+static DiskEntry** find_entry(const char* key, unsigned int hash) {
+    DiskEntry** link = &disk.buckets[hash & (DISK_BUCKET_COUNT - 1)];
+    while (*link != NULL) {
+        if ((*link)->hash == hash && strcmp((*link)->key, key) == 0) {
+            break;
+        }
+        link = &(*link)->next;
+    }
+
+    return link;
+}
+
+/* remove the entry from the index, other entries may share its key,
+   caller holds the mutex */
+static void unlink_entry(DiskEntry* entry) {
+    DiskEntry** link = &disk.buckets[entry->hash & (DISK_BUCKET_COUNT - 1)];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+
+    disk.nobjects--;
+    disk.size -= entry->size;
+}
+
+static void free_entry(DiskEntry* entry) {
+    free(entry->key);
+    free(entry);
+}
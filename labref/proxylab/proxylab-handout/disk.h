@@ -0,0 +1,73 @@
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* Size of a segment file, default disk budget, and the index size, the
+   bucket count must be a power of 2 */
+#define DISK_SEGMENT_SIZE (64L << 20)
+#define DEFAULT_DISK_CACHE_MB 4096
+#define DISK_BUCKET_COUNT (1 << 16)
+
+/* Bytes of evicted objects waiting for the disk thread, more are dropped */
+#define DISK_QUEUE_SIZE (16L << 20)
+
+/*
+ * The second tier of the cache. Objects evicted from memory are queued,
+ * and a thread of its own appends them to the newest of a log of segment
+ * files, written through a shared mapping, so evictions never wait for
+ * the disk. When the log is full the oldest segment is compacted: objects
+ * hit since they were written move to the newest segment, the others are
+ * dropped along with the file. Hits go from the file to the socket with
+ * sendfile, so their bytes never cross user space.
+ */
+typedef struct Segment {
+    int id;                       /* the file is segment.<id> in the directory */
+    int fd;
+    char* data;                   /* shared mapping of the file, for appending */
+    long size;                    /* bytes appended */
+    int refcnt;                   /* the log and the readers, guarded by the mutex */
+    struct DiskEntry* entries;    /* objects stored in the segment */
+    struct Segment* next;         /* next newer segment */
+} Segment;
+
+typedef struct DiskEntry {
+    unsigned int hash;            /* hash of the key */
+    char* key;                    /* key of the cached object */
+    Segment* segment;             /* where the object is stored */
+    long offset;
+    int size;
+    int persistent;               /* the response allows another request after it */
+    time_t expires;               /* a stale entry is a miss */
+    int referenced;               /* hit since written, so compaction keeps it */
+    int dead;                     /* replaced by a newer copy, out of the index */
+    struct DiskEntry* next;       /* next entry in the same bucket */
+    struct DiskEntry* next_entry; /* next entry of the same segment */
+} DiskEntry;
+
+/* an evicted object waiting to be appended, pinned meanwhile */
+typedef struct DiskJob {
+    CacheObject* object;
+    struct DiskJob* next;
+} DiskJob;
+
+/* an object pinned for a reader, its segment outlives compaction */
+typedef struct DiskObject {
+    Segment* segment;
+    long offset;
+    int size;
+    int persistent;
+} DiskObject;
+
+int init_disk(const char* dir, long capacity);
+void disk_store(CacheObject* object);
+DiskObject* disk_lookup(const char* key, unsigned int hash);
+int disk_read(const DiskObject* object, char* buf, int from, int to);
+int disk_write(int fd, const DiskObject* object, int from, int to);
+int disk_writen(int fd, const DiskObject* object, int from, int to);
+void disk_release(DiskObject* object);
+int disk_stats(long* nobjects, long* size);
+void deinit_disk();
+
+#endif /* __DISK_H__ */
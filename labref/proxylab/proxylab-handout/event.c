@@ -0,0 +1,952 @@
+#define _GNU_SOURCE // accept4, splice
+#include <sys/epoll.h>
+#include "event.h"
+#include "http.h"
+#include "cache.h"
+#include "disk.h"
+#include "shared.h"
+#include "resolver.h"
+#include "stats.h"
+#include "tunnel.h"
+#include "range.h"
+#include "log.h"
+
+typedef struct EventLoop {
+    int epfd;                     /* epoll instance of the loop */
+    int listenfd;                 /* listening socket shared by all loops */
+    Request* request;             /* scratch request for parsing */
+    Conn* closed;                 /* connections closed in the current batch */
+    Conn* tunnels;                /* open tunnels, swept for idle ones */
+    time_t next_sweep;            /* when to sweep them next */
+} EventLoop;
+
+static void* event_loop_routine(void* argp);
+static void run_event_loop(int listenfd);
+
+static void on_accept(EventLoop* loop);
+static void on_client_event(EventLoop* loop, Conn* conn, int events);
+static void on_server_event(EventLoop* loop, Conn* conn, int events);
+
+static void read_request(EventLoop* loop, Conn* conn);
+static void process_request(EventLoop* loop, Conn* conn);
+static void connect_server(EventLoop* loop, Conn* conn, const RequestLine* line);
+static void send_request(EventLoop* loop, Conn* conn);
+static void relay_response(EventLoop* loop, Conn* conn);
+static int check_response(Conn* conn, int n);
+static void drop_fill(Conn* conn);
+static void start_splice(Conn* conn);
+static void splice_response(EventLoop* loop, Conn* conn);
+static void flush_response(EventLoop* loop, Conn* conn);
+static void send_cached(EventLoop* loop, Conn* conn);
+static void send_disk(EventLoop* loop, Conn* conn);
+static void start_range(Conn* conn, const Request* request);
+static void send_range(EventLoop* loop, Conn* conn);
+static void send_error(EventLoop* loop, Conn* conn, enum StatusCode code, const char* details);
+static void start_tunnel(EventLoop* loop, Conn* conn);
+static void relay_tunnel(EventLoop* loop, Conn* conn);
+static void sweep_tunnels(EventLoop* loop);
+static void finish_response(EventLoop* loop, Conn* conn);
+static void time_first_byte(Conn* conn);
+
+static void set_events(EventLoop* loop, Endpoint* endpoint, int events);
+static void forget_endpoint(EventLoop* loop, Endpoint* endpoint);
+static void close_endpoint(Endpoint* endpoint);
+static void close_conn(EventLoop* loop, Conn* conn);
+static int set_nonblocking(int fd);
+
+/* run nloops event loops, the calling thread runs the last one */
+void run_event_loops(int listenfd, int nloops) {
+    pthread_t tid;
+
+    if (set_nonblocking(listenfd) < 0) {
+        unix_error("set_nonblocking error");
+    }
+
+    for (int i = 0; i < nloops - 1; ++i) {
+        Pthread_create(&tid, NULL, event_loop_routine, (void*)(long)listenfd);
+    }
+
+    log_info("Run %d event loops", nloops);
+
+    run_event_loop(listenfd);
+}
+
+static void* event_loop_routine(void* argp) {
+    Pthread_detach(pthread_self());
+    run_event_loop((int)(long)argp);
+    return NULL;
+}
+
+static void run_event_loop(int listenfd) {
+    EventLoop loop;
+    struct epoll_event events[MAX_EVENTS];
+
+    loop.epfd = epoll_create1(0);
+    if (loop.epfd < 0) {
+        unix_error("epoll_create1 error");
+    }
+    loop.listenfd = listenfd;
+    loop.request = new_request();
+    loop.closed = NULL;
+    loop.tunnels = NULL;
+    loop.next_sweep = 0;
+
+    /* every loop waits on the listener, but only one is woken per connection */
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, listenfd, &event) < 0) {
+        unix_error("epoll_ctl error");
+    }
+
+    while (1) {
+        /* the loop has no timers, a tunnel bounds the wait so it can be swept */
+        int timeout = (loop.tunnels != NULL ? EVENT_SWEEP_INTERVAL * 1000 : -1);
+        int n = epoll_wait(loop.epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno != EINTR) {
+                log_error("epoll_wait error: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            Endpoint* endpoint = events[i].data.ptr;
+            if (endpoint == NULL) {
+                on_accept(&loop);
+            } else if (endpoint->conn->state == CONN_CLOSED) {
+                continue;
+            } else if (endpoint == &endpoint->conn->client) {
+                on_client_event(&loop, endpoint->conn, events[i].events);
+            } else {
+                on_server_event(&loop, endpoint->conn, events[i].events);
+            }
+        }
+
+        if (loop.tunnels != NULL && time(NULL) >= loop.next_sweep) {
+            sweep_tunnels(&loop);
+        }
+
+        /* the batch may refer to a connection closed by an earlier event,
+           so free them only now */
+        while (loop.closed != NULL) {
+            Conn* conn = loop.closed;
+            loop.closed = conn->next_closed;
+            free(conn);
+        }
+    }
+}
+
+static void on_accept(EventLoop* loop) {
+    while (1) {
+        int clientfd = accept4(loop->listenfd, NULL, NULL, SOCK_NONBLOCK);
+        if (clientfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_error("accept error: %s", strerror(errno));
+            }
+            return;
+        }
+
+        Conn* conn = Malloc(sizeof(Conn));
+        conn->state = CONN_READ_REQUEST;
+        conn->client.fd = clientfd;
+        conn->client.events = -1;
+        conn->client.conn = conn;
+        conn->server.fd = -1;
+        conn->server.events = -1;
+        conn->server.conn = conn;
+        conn->buf = Malloc(MAXBUF);
+        conn->len = 0;
+        conn->pos = 0;
+        conn->server_done = 0;
+        conn->key = NULL;
+        conn->hash = 0;
+        conn->object = NULL;
+        conn->disk = NULL;
+        conn->range = NULL;
+        conn->part = 0;
+        conn->fill = NULL;
+        conn->parser = NULL;
+        conn->pipe[0] = conn->pipe[1] = -1;
+        conn->piped = 0;
+        conn->tunnel = NULL;
+        conn->active = 0;
+        conn->prev_tunnel = conn->next_tunnel = NULL;
+        conn->start = 0;
+        conn->first_byte = 0;
+        conn->next_closed = NULL;
+
+        stats_count(STATS_CONNECTIONS, 1);
+        stats_count(STATS_ACTIVE_CONNECTIONS, 1);
+        set_events(loop, &conn->client, EPOLLIN);
+    }
+}
+
+static void on_client_event(EventLoop* loop, Conn* conn, int events) {
+    /* the client went away, nobody is left to send the response to, but a
+       tunnel reports a hangup once the client closed after its half was
+       shut, the bytes it sent before are still to be read */
+    if ((events & EPOLLERR) || ((events & EPOLLHUP) && conn->state != CONN_TUNNEL)) {
+        close_conn(loop, conn);
+        return;
+    }
+
+    switch (conn->state) {
+        case CONN_READ_REQUEST: read_request(loop, conn);   break;
+        case CONN_RELAY:        flush_response(loop, conn); break;
+        case CONN_SPLICE:
+            if (conn->pos < conn->len) {
+                flush_response(loop, conn);
+            } else {
+                splice_response(loop, conn);
+            }
+            break;
+        case CONN_SEND_CACHED:  send_cached(loop, conn);    break;
+        case CONN_SEND_DISK:    send_disk(loop, conn);      break;
+        case CONN_SEND_ERROR:   flush_response(loop, conn); break;
+        case CONN_SEND_STATS:   flush_response(loop, conn); break;
+        case CONN_TUNNEL:       relay_tunnel(loop, conn);   break;
+        default:                                            break;
+    }
+}
+
+static void on_server_event(EventLoop* loop, Conn* conn, int events) {
+    switch (conn->state) {
+        case CONN_CONNECT: {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(conn->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+                send_error(loop, conn, BadGateway, "Proxy cannot connect to server");
+                return;
+            }
+            stats_count(STATS_ORIGIN_CONNECTS, 1);
+            stats_record(STATS_CONNECT, stats_now() - conn->connect_start);
+            conn->state = CONN_SEND_REQUEST;
+            send_request(loop, conn);
+            break;
+        }
+        case CONN_SEND_REQUEST: send_request(loop, conn);  break;
+        case CONN_RELAY:        relay_response(loop, conn); break;
+        case CONN_SPLICE:       splice_response(loop, conn); break;
+        case CONN_TUNNEL:       relay_tunnel(loop, conn);   break;
+        default:                                           break;
+    }
+}
+
+/* accumulate the request until the blank line ending its headers */
+static void read_request(EventLoop* loop, Conn* conn) {
+    while (conn->len < MAXBUF - 1) {
+        int n = read(conn->client.fd, conn->buf + conn->len, MAXBUF - 1 - conn->len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close_conn(loop, conn);
+            }
+            return;
+        }
+
+        if (n == 0) {
+            /* no actual data received */
+            close_conn(loop, conn);
+            return;
+        }
+
+        conn->len += n;
+        conn->buf[conn->len] = '\0';
+        if (strstr(conn->buf, "\r\n\r\n") != NULL || strstr(conn->buf, "\n\n") != NULL) {
+            process_request(loop, conn);
+            return;
+        }
+    }
+
+    send_error(loop, conn, BadRequest, "Request too long to handle");
+}
+
+static void process_request(EventLoop* loop, Conn* conn) {
+    Request* request = loop->request;
+    char line[MAXLINE];
+    char details[MAXLINE];
+    enum StatusCode code;
+    int room;
+
+    reset_request(request);
+
+    /* split the request into lines, the first one is the request line,
+       each is copied once, to the arena of the request */
+    char* p = conn->buf;
+    int first = 1;
+    while (*p != '\0') {
+        char* eol = strchr(p, '\n');
+        int n = (eol ? eol + 1 - p : (int)strlen(p));
+        char* tail = request_tail(request, &room);
+        if (n >= room) {
+            send_error(loop, conn, BadRequest, "Request too long to handle");
+            return;
+        }
+        memcpy(tail, p, n);
+        tail[n] = '\0';
+        p += n;
+
+        if (first) {
+            if (!parse_request_line(request, n, &code, details)) {
+                send_error(loop, conn, code, details);
+                return;
+            }
+            first = 0;
+            continue;
+        }
+
+        /* end of request header */
+        if (strcmp(tail, "\r\n") == 0 || strcmp(tail, "\n") == 0) {
+            break;
+        }
+
+        if (!add_request_header(request, n, &code, details)) {
+            send_error(loop, conn, code, details);
+            return;
+        }
+    }
+
+    /* the proxy answers the stats path itself, whatever the host */
+    if (strcmp(request->line.path, STATS_PATH) == 0) {
+        conn->state = CONN_SEND_STATS;
+        conn->len = format_stats(conn->buf, MAXBUF);
+        conn->pos = 0;
+        flush_response(loop, conn);
+        return;
+    }
+
+    /* a CONNECT isn't forwarded, the server gets what the client sent
+       past its head once connected, then the tunnel opens */
+    if (request->tunnel) {
+        conn->tunnel = new_tunnel();
+        conn->len = conn->buf + conn->len - p;
+        memmove(conn->buf, p, conn->len);
+        conn->pos = 0;
+        connect_server(loop, conn, &request->line);
+        return;
+    }
+
+    conn->start = stats_now();
+    stats_count(STATS_REQUESTS, 1);
+
+    /* generate key */
+    if (!generate_key(&request->line, line, sizeof(line))) {
+        send_error(loop, conn, InternalServerError, "generate_key error");
+        return;
+    }
+    conn->key = Malloc(strlen(line) + 1);
+    strcpy(conn->key, line);
+    conn->hash = hash_key(conn->key);
+
+    /* search cache for response, a stale one is fetched again as a whole */
+    conn->object = cache_lookup(conn->key, conn->hash);
+    if (conn->object != NULL && !is_fresh(conn->object, time(NULL))) {
+        cache_release(conn->object);
+        conn->object = NULL;
+    }
+    if (conn->object != NULL) {
+        stats_count(STATS_MEMORY_HITS, 1);
+    } else if ((conn->object = shared_lookup(conn->key, conn->hash)) != NULL) {
+        stats_count(STATS_SHARED_HITS, 1);
+    }
+    if (conn->object != NULL) {
+        start_range(conn, request);
+        time_first_byte(conn);
+        conn->state = CONN_SEND_CACHED;
+        conn->pos = 0;
+        send_cached(loop, conn);
+        return;
+    }
+
+    conn->disk = disk_lookup(conn->key, conn->hash);
+    if (conn->disk != NULL) {
+        stats_count(STATS_DISK_HITS, 1);
+        start_range(conn, request);
+        time_first_byte(conn);
+        conn->state = CONN_SEND_DISK;
+        conn->pos = 0;
+        send_disk(loop, conn);
+        return;
+    }
+
+    stats_count(STATS_MISSES, 1);
+
+    /* the forwarded request replaces the one from the client */
+    conn->len = build_request(request, conn->buf, MAXBUF, 0);
+    conn->pos = 0;
+    if (conn->len < 0) {
+        send_error(loop, conn, BadRequest, "Request headers too long to forward");
+        return;
+    }
+
+    connect_server(loop, conn, &request->line);
+}
+
+static void connect_server(EventLoop* loop, Conn* conn, const RequestLine* line) {
+    /* only a host missing from the resolver cache blocks the loop */
+    ResolverAddr addrs[RESOLVER_MAX_ADDRS];
+    int naddrs = resolve(line->host, line->port, addrs, RESOLVER_MAX_ADDRS);
+    if (naddrs == 0) {
+        send_error(loop, conn, BadGateway, "Proxy cannot resolve server");
+        return;
+    }
+
+    /* start a non-blocking connect on the first usable address */
+    conn->connect_start = stats_now();
+    int serverfd = -1, rc = -1;
+    for (int i = 0; i < naddrs; ++i) {
+        serverfd = socket(addrs[i].family, addrs[i].socktype | SOCK_NONBLOCK, addrs[i].protocol);
+        if (serverfd < 0) {
+            continue;
+        }
+
+        rc = connect(serverfd, (struct sockaddr*)&addrs[i].addr, addrs[i].addrlen);
+        if (rc == 0 || errno == EINPROGRESS) {
+            break;
+        }
+
+        close(serverfd);
+        serverfd = -1;
+    }
+
+    if (serverfd < 0) {
+        send_error(loop, conn, BadGateway, "Proxy cannot connect to server");
+        return;
+    }
+
+    log_debug("Connecting to (%s, %s)", line->host, line->port);
+
+    conn->server.fd = serverfd;
+    set_events(loop, &conn->client, 0);
+    if (rc == 0) {
+        stats_count(STATS_ORIGIN_CONNECTS, 1);
+        stats_record(STATS_CONNECT, stats_now() - conn->connect_start);
+        conn->state = CONN_SEND_REQUEST;
+        send_request(loop, conn);
+    } else {
+        conn->state = CONN_CONNECT;
+        set_events(loop, &conn->server, EPOLLOUT);
+    }
+}
+
+static void send_request(EventLoop* loop, Conn* conn) {
+    while (conn->pos < conn->len) {
+        int n = write(conn->server.fd, conn->buf + conn->pos, conn->len - conn->pos);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                set_events(loop, &conn->server, EPOLLOUT);
+            } else {
+                send_error(loop, conn, BadGateway, "Proxy forward header failure");
+            }
+            return;
+        }
+        conn->pos += n;
+    }
+
+    if (conn->tunnel != NULL) {
+        start_tunnel(loop, conn);
+        return;
+    }
+
+    /* the buffer now holds response bytes, the cache gets a copy unless
+       the head rules it out */
+    conn->state = CONN_RELAY;
+    conn->len = conn->pos = 0;
+    conn->fill = new_chain(MAX_OBJECT_SIZE);
+    conn->parser = Malloc(sizeof(ResponseParser));
+    init_response_parser(conn->parser);
+    set_events(loop, &conn->server, EPOLLIN);
+}
+
+/* read from the server only when the last chunk reached the client */
+static void relay_response(EventLoop* loop, Conn* conn) {
+    if (conn->pos < conn->len) {
+        return;
+    }
+
+    int n = read(conn->server.fd, conn->buf, MAXBUF);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            log_warn("Proxy read data from server failure");
+            close_conn(loop, conn);
+        }
+        return;
+    }
+
+    if (n == 0) {
+        conn->server_done = 1;
+        close_endpoint(&conn->server);
+        finish_response(loop, conn);
+        return;
+    }
+
+    /* a response too large to cache skips the copy, and once buf is
+       flushed the rest bypasses user space */
+    int large = check_response(conn, n);
+    if (conn->fill != NULL && !chain_append(conn->fill, conn->buf, n)) {
+        drop_fill(conn);
+        large = 1;
+    }
+    if (large) {
+        start_splice(conn);
+    }
+
+    time_first_byte(conn);
+    stats_count(STATS_BYTES_ORIGIN, n);
+
+    conn->len = n;
+    conn->pos = 0;
+    flush_response(loop, conn);
+}
+
+/* feed the parser while the cache wants a copy, it must see the whole
+   body before the copy is stored, drops the copy if the head says not to
+   cache, returns 1 if the body is too large to cache */
+static int check_response(Conn* conn, int n) {
+    if (conn->parser == NULL) {
+        return 0;
+    }
+
+    int head = (conn->parser->state == RESPONSE_HEAD);
+    int len = parse_response(conn->parser, conn->buf, n);
+    if (len < 0) {
+        drop_fill(conn);
+        return 0;
+    }
+    if (!head || conn->parser->state == RESPONSE_HEAD) {
+        return 0;
+    }
+
+    Freshness freshness;
+    int large = (conn->parser->content_length > MAX_OBJECT_SIZE);
+    if (large || !response_freshness(conn->parser, time(NULL), &freshness)) {
+        drop_fill(conn);
+    }
+
+    return large;
+}
+
+/* the response won't be cached, stop copying and parsing it */
+static void drop_fill(Conn* conn) {
+    if (conn->fill != NULL) {
+        free_chain(conn->fill);
+        conn->fill = NULL;
+    }
+    free(conn->parser);
+    conn->parser = NULL;
+}
+
+/* relay the rest of the response through a pipe, a relay through buf
+   still works if there is none */
+static void start_splice(Conn* conn) {
+    if (pipe2(conn->pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        log_error("pipe2 error: %s", strerror(errno));
+        conn->pipe[0] = conn->pipe[1] = -1;
+        return;
+    }
+
+    /* a larger pipe means fewer round trips, the default still works */
+    if (fcntl(conn->pipe[1], F_SETPIPE_SZ, EVENT_SPLICE_SIZE) < 0) {
+        log_warn("F_SETPIPE_SZ error: %s", strerror(errno));
+    }
+    conn->state = CONN_SPLICE;
+}
+
+/* fill the pipe from the server and drain it to the client, one pipe
+   per call so other connections get their turn, a client that can't
+   take more stops the server side */
+static void splice_response(EventLoop* loop, Conn* conn) {
+    if (conn->piped == 0) {
+        ssize_t n = splice(conn->server.fd, NULL, conn->pipe[1], NULL, EVENT_SPLICE_SIZE,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_warn("Proxy read data from server failure");
+                close_conn(loop, conn);
+            }
+            return;
+        }
+
+        if (n == 0) {
+            conn->server_done = 1;
+            close_endpoint(&conn->server);
+            finish_response(loop, conn);
+            return;
+        }
+
+        stats_count(STATS_BYTES_ORIGIN, n);
+        conn->piped = n;
+    }
+
+    /* no SPLICE_F_MORE, the client may be waiting for the last of these */
+    while (conn->piped > 0) {
+        ssize_t n = splice(conn->pipe[0], NULL, conn->client.fd, NULL, conn->piped,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                set_events(loop, &conn->client, EPOLLOUT);
+                set_events(loop, &conn->server, 0);
+            } else {
+                log_warn("Proxy write data to client failure");
+                close_conn(loop, conn);
+            }
+            return;
+        }
+        conn->piped -= n;
+    }
+
+    set_events(loop, &conn->client, 0);
+    set_events(loop, &conn->server, EPOLLIN);
+}
+
+/* write the pending bytes of buf, applying backpressure to the server */
+static void flush_response(EventLoop* loop, Conn* conn) {
+    while (conn->pos < conn->len) {
+        int n = write(conn->client.fd, conn->buf + conn->pos, conn->len - conn->pos);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                set_events(loop, &conn->client, EPOLLOUT);
+                if (conn->server.fd >= 0) {
+                    set_events(loop, &conn->server, 0);
+                }
+            } else {
+                log_warn("Proxy write data to client failure");
+                close_conn(loop, conn);
+            }
+            return;
+        }
+        conn->pos += n;
+    }
+
+    if (conn->state == CONN_SEND_ERROR || conn->state == CONN_SEND_STATS) {
+        close_conn(loop, conn);
+    } else if (conn->server_done) {
+        finish_response(loop, conn);
+    } else {
+        set_events(loop, &conn->client, 0);
+        set_events(loop, &conn->server, EPOLLIN);
+    }
+}
+
+static void send_cached(EventLoop* loop, Conn* conn) {
+    CacheObject* object = conn->object;
+    if (conn->range != NULL) {
+        send_range(loop, conn);
+        return;
+    }
+
+    while (conn->pos < object->size) {
+        int n = chain_write(conn->client.fd, object->chain, conn->pos, object->size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                set_events(loop, &conn->client, EPOLLOUT);
+            } else {
+                log_warn("Proxy write data to client failure");
+                close_conn(loop, conn);
+            }
+            return;
+        }
+        conn->pos += n;
+    }
+
+    stats_count(STATS_BYTES_MEMORY, object->size);
+    close_conn(loop, conn);
+}
+
+static void send_disk(EventLoop* loop, Conn* conn) {
+    DiskObject* object = conn->disk;
+    if (conn->range != NULL) {
+        send_range(loop, conn);
+        return;
+    }
+
+    while (conn->pos < object->size) {
+        int n = disk_write(conn->client.fd, object, conn->pos, object->size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                set_events(loop, &conn->client, EPOLLOUT);
+            } else {
+                log_warn("Proxy write data to client failure");
+                close_conn(loop, conn);
+            }
+            return;
+        }
+        conn->pos += n;
+    }
+
+    stats_count(STATS_BYTES_DISK, object->size);
+    close_conn(loop, conn);
+}
+
+/* answer the Range header of the request from the pinned object, the
+   whole object goes out if it can't */
+static void start_range(Conn* conn, const Request* request) {
+    if (request->range < 0) {
+        return;
+    }
+
+    char head[MAXBUF];
+    int size = (conn->object != NULL ? conn->object->size : conn->disk->size);
+    int head_len = (size < MAXBUF ? size : MAXBUF);
+    if (conn->object != NULL) {
+        chain_copy(conn->object->chain, head, 0, head_len);
+    } else if (disk_read(conn->disk, head, 0, head_len) != head_len) {
+        return;
+    }
+
+    conn->range = Malloc(sizeof(RangeReply));
+    if (!prepare_range(request, head, head_len, size, conn->range)) {
+        free(conn->range);
+        conn->range = NULL;
+        return;
+    }
+
+    stats_count(STATS_RANGES, 1);
+    conn->part = 0;
+}
+
+/* write the range reply part after part, its text then its bytes of the
+   object, pos counts the bytes of the current part already written */
+static void send_range(EventLoop* loop, Conn* conn) {
+    RangeReply* reply = conn->range;
+
+    while (conn->part < reply->nparts) {
+        RangePart* part = &reply->parts[conn->part];
+        if (conn->pos == part->text_len + part->to - part->from) {
+            conn->part++;
+            conn->pos = 0;
+            continue;
+        }
+
+        int n;
+        if (conn->pos < part->text_len) {
+            n = write(conn->client.fd, reply->buf + part->text + conn->pos,
+                      part->text_len - conn->pos);
+        } else {
+            int from = part->from + conn->pos - part->text_len;
+            if (conn->object != NULL) {
+                n = chain_write(conn->client.fd, conn->object->chain, from, part->to);
+            } else {
+                n = disk_write(conn->client.fd, conn->disk, from, part->to);
+            }
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                set_events(loop, &conn->client, EPOLLOUT);
+            } else {
+                log_warn("Proxy write data to client failure");
+                close_conn(loop, conn);
+            }
+            return;
+        }
+        conn->pos += n;
+    }
+
+    stats_count(conn->object != NULL ? STATS_BYTES_MEMORY : STATS_BYTES_DISK, reply->size);
+    close_conn(loop, conn);
+}
+
+static void send_error(EventLoop* loop, Conn* conn, enum StatusCode code, const char* details) {
+    close_endpoint(&conn->server);
+
+    conn->state = CONN_SEND_ERROR;
+    conn->len = format_error(code, details, conn->buf, MAXBUF);
+    conn->pos = 0;
+    flush_response(loop, conn);
+}
+
+/* the server is connected, tell the client through the tunnel itself */
+static void start_tunnel(EventLoop* loop, Conn* conn) {
+    if (!open_tunnel(conn->tunnel, conn->client.fd, conn->server.fd) ||
+        !tunnel_preload(conn->tunnel, TUNNEL_DOWN, TUNNEL_ESTABLISHED,
+                        strlen(TUNNEL_ESTABLISHED))) {
+        send_error(loop, conn, InternalServerError, "Proxy cannot open tunnel");
+        return;
+    }
+
+    log_debug("Tunnel open on %d and %d", conn->client.fd, conn->server.fd);
+
+    conn->state = CONN_TUNNEL;
+    conn->prev_tunnel = NULL;
+    conn->next_tunnel = loop->tunnels;
+    if (loop->tunnels != NULL) {
+        loop->tunnels->prev_tunnel = conn;
+    }
+    loop->tunnels = conn;
+    relay_tunnel(loop, conn);
+}
+
+static void relay_tunnel(EventLoop* loop, Conn* conn) {
+    int client_events, server_events;
+    if (pump_tunnel(conn->tunnel, &client_events, &server_events) <= 0) {
+        close_conn(loop, conn);
+        return;
+    }
+    conn->active = time(NULL);
+
+    /* a socket done both ways would report its hangup on every wait */
+    if (tunnel_done(conn->tunnel, TUNNEL_UP)) {
+        forget_endpoint(loop, &conn->client);
+    } else {
+        set_events(loop, &conn->client, client_events);
+    }
+    if (tunnel_done(conn->tunnel, TUNNEL_DOWN)) {
+        forget_endpoint(loop, &conn->server);
+    } else {
+        set_events(loop, &conn->server, server_events);
+    }
+}
+
+/* close the tunnels idle for TUNNEL_IDLE_TIMEOUT seconds, as the threaded
+   engine does */
+static void sweep_tunnels(EventLoop* loop) {
+    time_t now = time(NULL);
+    loop->next_sweep = now + EVENT_SWEEP_INTERVAL;
+
+    Conn* conn = loop->tunnels;
+    while (conn != NULL) {
+        Conn* next = conn->next_tunnel;
+        if (now - conn->active >= TUNNEL_IDLE_TIMEOUT) {
+            log_debug("Tunnel on %d idle, closed", conn->client.fd);
+            close_conn(loop, conn);
+        }
+        conn = next;
+    }
+}
+
+/* the server is done and the client got every byte */
+static void finish_response(EventLoop* loop, Conn* conn) {
+    if (conn->pos < conn->len) {
+        return;
+    }
+
+    /* the cache adopts the chain if the head of the response allows it and
+       the body is complete, a server that died halfway leaves it short */
+    Freshness freshness;
+    int complete = (conn->parser != NULL && (conn->parser->state == RESPONSE_DONE ||
+                                             conn->parser->state == RESPONSE_UNTIL_CLOSE));
+    if (conn->fill != NULL && complete &&
+        chain_freshness(conn->fill, conn->fill->size, time(NULL), &freshness)) {
+        CacheObject* object = write_cache(conn->fill, conn->key, conn->hash, &freshness);
+        shared_store(object);
+        cache_release(object);
+        conn->fill = NULL;
+    }
+
+    close_conn(loop, conn);
+}
+
+/* time from the parsed request until the response starts, once */
+static void time_first_byte(Conn* conn) {
+    if (!conn->first_byte) {
+        conn->first_byte = 1;
+        stats_record(STATS_FIRST_BYTE, stats_now() - conn->start);
+    }
+}
+
+static void set_events(EventLoop* loop, Endpoint* endpoint, int events) {
+    if (endpoint->events == events) {
+        return;
+    }
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = endpoint;
+    int op = (endpoint->events < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+    if (epoll_ctl(loop->epfd, op, endpoint->fd, &event) < 0) {
+        log_error("epoll_ctl error: %s", strerror(errno));
+    }
+    endpoint->events = events;
+}
+
+/* stop waiting on a descriptor that stays open */
+static void forget_endpoint(EventLoop* loop, Endpoint* endpoint) {
+    if (endpoint->events >= 0) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, endpoint->fd, NULL);
+        endpoint->events = -1;
+    }
+}
+
+/* closing the descriptor also removes it from the epoll instance */
+static void close_endpoint(Endpoint* endpoint) {
+    if (endpoint->fd >= 0) {
+        close(endpoint->fd);
+        endpoint->fd = -1;
+        endpoint->events = -1;
+    }
+}
+
+static void close_conn(EventLoop* loop, Conn* conn) {
+    close_endpoint(&conn->client);
+    close_endpoint(&conn->server);
+
+    if (conn->object != NULL) {
+        cache_release(conn->object);
+    }
+    if (conn->disk != NULL) {
+        disk_release(conn->disk);
+    }
+    free(conn->range);
+    if (conn->fill != NULL) {
+        free_chain(conn->fill);
+    }
+    if (conn->pipe[0] >= 0) {
+        close(conn->pipe[0]);
+        close(conn->pipe[1]);
+    }
+    if (conn->tunnel != NULL) {
+        free_tunnel(conn->tunnel);
+    }
+    if (conn->state == CONN_TUNNEL) {
+        if (conn->prev_tunnel != NULL) {
+            conn->prev_tunnel->next_tunnel = conn->next_tunnel;
+        } else {
+            loop->tunnels = conn->next_tunnel;
+        }
+        if (conn->next_tunnel != NULL) {
+            conn->next_tunnel->prev_tunnel = conn->prev_tunnel;
+        }
+    }
+    free(conn->parser);
+    free(conn->key);
+    free(conn->buf);
+
+    if (conn->start != 0) {
+        stats_record(STATS_TOTAL, stats_now() - conn->start);
+    }
+    stats_count(STATS_ACTIVE_CONNECTIONS, -1);
+
+    conn->state = CONN_CLOSED;
+    conn->next_closed = loop->closed;
+    loop->closed = conn;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
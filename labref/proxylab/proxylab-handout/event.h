@@ -0,0 +1,76 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include "csapp.h"
+#include "chunk.h"
+
+#define MAX_EVENTS 256
+
+/* Bytes a connection moves per splice of a response too large to cache,
+   the pipe of each such connection is sized to match */
+#define EVENT_SPLICE_SIZE (1 << 18)
+
+/* Seconds between two sweeps of a loop for idle tunnels */
+#define EVENT_SWEEP_INTERVAL 10
+
+/*
+ * Event-driven engine: each loop owns an epoll instance and drives every
+ * connection it accepts through a state machine on non-blocking sockets,
+ * so an idle or slow client costs a few KB instead of a thread.
+ */
+enum ConnState {
+    CONN_READ_REQUEST,            /* reading the request from the client */
+    CONN_CONNECT,                 /* waiting for the connection to the server */
+    CONN_SEND_REQUEST,            /* writing the request to the server */
+    CONN_RELAY,                   /* relaying the response to the client */
+    CONN_SPLICE,                  /* splicing a response too large to cache to the client */
+    CONN_SEND_CACHED,             /* writing a cached object to the client */
+    CONN_SEND_DISK,               /* sending an object stored on disk to the client */
+    CONN_SEND_ERROR,              /* writing an error page to the client */
+    CONN_SEND_STATS,              /* writing the counters to the client */
+    CONN_TUNNEL,                  /* relaying a CONNECT both ways */
+    CONN_CLOSED,                  /* freed once the current batch of events is done */
+};
+
+struct Conn;
+struct ResponseParser;
+struct Tunnel;
+struct RangeReply;
+
+typedef struct Endpoint {
+    int fd;                       /* -1 if not open */
+    int events;                   /* registered epoll events, -1 if not registered */
+    struct Conn* conn;            /* owner of the endpoint */
+} Endpoint;
+
+typedef struct Conn {
+    enum ConnState state;
+    Endpoint client;
+    Endpoint server;
+    char* buf;                    /* request, then the forwarded request, then the response */
+    int len;                      /* bytes in buf */
+    int pos;                      /* bytes of buf already written */
+    int server_done;              /* server closed the connection */
+    char* key;                    /* cache key of the request */
+    unsigned int hash;            /* hash of the key */
+    struct CacheObject* object;   /* pinned cache object being sent */
+    struct DiskObject* disk;      /* pinned disk object being sent */
+    struct RangeReply* range;     /* ranges of the object to send, NULL for all of it */
+    int part;                     /* part of the range reply being sent */
+    ChunkChain* fill;             /* copy of the response for the cache, NULL if too large */
+    struct ResponseParser* parser;  /* framing of the response until its head is parsed */
+    int pipe[2];                  /* pipe of CONN_SPLICE, -1 if none */
+    int piped;                    /* bytes in the pipe not yet sent to the client */
+    struct Tunnel* tunnel;        /* relay of a CONNECT, NULL for other requests */
+    time_t active;                /* last time the tunnel had an event */
+    struct Conn* prev_tunnel;     /* list of the open tunnels of the loop */
+    struct Conn* next_tunnel;
+    long start;                   /* when the request was parsed, 0 until then */
+    long connect_start;           /* when the connect to the server began */
+    int first_byte;               /* the first byte of the response was timed */
+    struct Conn* next_closed;     /* list of connections to free */
+} Conn;
+
+void run_event_loops(int listenfd, int nloops);
+
+#endif /* __EVENT_H__ */
@@ -0,0 +1,160 @@
+#include "flight.h"
+#include "shared.h"
+
+typedef struct FlightTable {
+    Flight* buckets[FLIGHT_BUCKET_COUNT];
+    sem_t mutex;                  /* protect buckets and refcnt of flights */
+} FlightTable;
+
+static FlightTable flights;
+
+static void unpublish_flight(Flight* flight);
+
+void init_flights() {
+    for (int i = 0; i < FLIGHT_BUCKET_COUNT; ++i) {
+        flights.buckets[i] = NULL;
+    }
+
+    Sem_init(&flights.mutex, 0, 1);
+}
+
+/* join the flight of the key, or start one and become its leader,
+   the caller must flight_release it */
+Flight* flight_join(const char* key, unsigned int hash, int* leader) {
+    int bucket = hash % FLIGHT_BUCKET_COUNT;
+
+    P(&flights.mutex);
+
+    Flight* flight = flights.buckets[bucket];
+    while (flight != NULL) {
+        if (flight->hash == hash && strcmp(flight->key, key) == 0) {
+            break;
+        }
+        flight = flight->next;
+    }
+
+    if (flight != NULL) {
+        flight->refcnt++;
+        *leader = 0;
+    } else {
+        flight = Malloc(sizeof(Flight));
+        flight->hash = hash;
+        flight->key = Malloc(strlen(key) + 1);
+        strcpy(flight->key, key);
+        flight->chain = new_chain(MAX_OBJECT_SIZE);
+        flight->size = 0;
+        flight->object = NULL;
+        flight->cacheable = 0;
+        flight->state = FLIGHT_RUNNING;
+        flight->refcnt = 1;
+        pthread_mutex_init(&flight->mutex, NULL);
+        pthread_cond_init(&flight->cond, NULL);
+
+        flight->next = flights.buckets[bucket];
+        flights.buckets[bucket] = flight;
+        *leader = 1;
+    }
+
+    V(&flights.mutex);
+
+    return flight;
+}
+
+/* free space after the received bytes, the leader may read straight into
+   it and append from there without a copy */
+char* flight_tail(Flight* flight, int* room) {
+    return chain_tail(flight->chain, room);
+}
+
+/* leader appends received bytes, followers see them, and any appended
+   before, once publish is set, returns 0 once the flight is abandoned */
+int flight_append(Flight* flight, const char* buf, int n, int publish) {
+    if (flight->state != FLIGHT_RUNNING) {
+        return 0;
+    }
+
+    /* the bytes are invisible to followers until size covers them */
+    if (!chain_append(flight->chain, buf, n)) {
+        flight_finish(flight, FLIGHT_ABANDONED);
+        return 0;
+    }
+    if (!publish) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&flight->mutex);
+    flight->size = flight->chain->size;
+    pthread_cond_broadcast(&flight->cond);
+    pthread_mutex_unlock(&flight->mutex);
+
+    return 1;
+}
+
+/* leader ends the flight, later requests go to the cache or a new flight,
+   a complete response is cached if its head allows it, for a 304 the
+   leader sets object to the renewed one first */
+void flight_finish(Flight* flight, enum FlightState state) {
+    if (state == FLIGHT_DONE && flight->cacheable) {
+        flight->object = write_cache(flight->chain, flight->key, flight->hash,
+                                     &flight->freshness);
+        shared_store(flight->object);
+    }
+
+    unpublish_flight(flight);
+
+    pthread_mutex_lock(&flight->mutex);
+    flight->state = state;
+    pthread_cond_broadcast(&flight->cond);
+    pthread_mutex_unlock(&flight->mutex);
+}
+
+/* follower waits for bytes beyond pos, returns the bytes available */
+int flight_wait(Flight* flight, int pos, enum FlightState* state) {
+    pthread_mutex_lock(&flight->mutex);
+    while (flight->size <= pos && flight->state == FLIGHT_RUNNING) {
+        pthread_cond_wait(&flight->cond, &flight->mutex);
+    }
+    int size = flight->size;
+    *state = flight->state;
+    pthread_mutex_unlock(&flight->mutex);
+
+    return size;
+}
+
+void flight_release(Flight* flight) {
+    P(&flights.mutex);
+    int refcnt = --flight->refcnt;
+    V(&flights.mutex);
+
+    if (refcnt == 0) {
+        pthread_mutex_destroy(&flight->mutex);
+        pthread_cond_destroy(&flight->cond);
+        free(flight->key);
+        if (flight->object == NULL || flight->state == FLIGHT_NOT_MODIFIED) {
+            free_chain(flight->chain);
+        }
+        if (flight->object != NULL) {
+            cache_release(flight->object);
+        }
+        free(flight);
+    }
+}
+
+void deinit_flights() {
+    sem_destroy(&flights.mutex);
+}
+
+/* remove the flight from the table, no-op if already removed */
+static void unpublish_flight(Flight* flight) {
+    P(&flights.mutex);
+
+    Flight** link = &flights.buckets[flight->hash % FLIGHT_BUCKET_COUNT];
+    while (*link != NULL && *link != flight) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        *link = flight->next;
+    }
+
+    V(&flights.mutex);
+}
@@ -0,0 +1,48 @@
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+#define FLIGHT_BUCKET_COUNT 256
+
+enum FlightState {
+    FLIGHT_RUNNING,               /* leader is still receiving from the server */
+    FLIGHT_DONE,                  /* the whole response is in the chain */
+    FLIGHT_FAILED,                /* leader gave up, e.g. server unreachable */
+    FLIGHT_ABANDONED,             /* response outgrew MAX_OBJECT_SIZE or can't be shared */
+    FLIGHT_NOT_MODIFIED,          /* the server renewed the stale object, which is sent instead */
+};
+
+/*
+ * An in-flight cache miss. The first requester of a key becomes the leader
+ * and fetches from the server, appending what it receives to the chain;
+ * the followers stream the same bytes to their own clients as they arrive.
+ * Bytes below size never change, so followers read them without the lock.
+ * Once done, the chain becomes the cached object as is.
+ */
+typedef struct Flight {
+    unsigned int hash;            /* hash of the key */
+    char* key;                    /* cache key of the request */
+    ChunkChain* chain;            /* bytes received so far, owned by object once set */
+    int size;                     /* bytes of the chain published to followers */
+    CacheObject* object;          /* the cached object made from the chain, or the renewed one */
+    int cacheable;                /* the head of the response allows caching it */
+    Freshness freshness;          /* lifetime and validators of the response */
+    enum FlightState state;
+    int refcnt;                   /* leader and followers, guarded by the table */
+    pthread_mutex_t mutex;        /* protect size and state */
+    pthread_cond_t cond;          /* signaled on new data or state change */
+    struct Flight* next;          /* next flight in the same bucket */
+} Flight;
+
+void init_flights();
+Flight* flight_join(const char* key, unsigned int hash, int* leader);
+char* flight_tail(Flight* flight, int* room);
+int flight_append(Flight* flight, const char* buf, int n, int publish);
+void flight_finish(Flight* flight, enum FlightState state);
+int flight_wait(Flight* flight, int pos, enum FlightState* state);
+void flight_release(Flight* flight);
+void deinit_flights();
+
+#endif /* __FLIGHT_H__ */
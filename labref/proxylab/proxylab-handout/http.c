@@ -0,0 +1,702 @@
+#define _GNU_SOURCE // strcasestr, strptime, timegm
+#include <string.h>
+#include <time.h>
+#include "http.h"
+
+/* You won't lose style points for including this long line in your code */
+static const char *user_agent_hdr = 
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+
+/* the headers the proxy looks at, each in the slot of header_slot */
+static const struct {
+    const char* name;
+    int len;
+    enum HeaderName id;
+} header_table[HEADER_TABLE_SIZE] = {
+    [0]  = { "proxy-connection",  16, HEADER_PROXY_CONNECTION },
+    [1]  = { "if-range",           8, HEADER_IF_RANGE },
+    [6]  = { "if-none-match",     13, HEADER_IF_NONE_MATCH },
+    [7]  = { "range",              5, HEADER_RANGE },
+    [10] = { "if-modified-since", 17, HEADER_IF_MODIFIED_SINCE },
+    [12] = { "host",               4, HEADER_HOST },
+    [13] = { "connection",        10, HEADER_CONNECTION },
+    [15] = { "user-agent",        10, HEADER_USER_AGENT },
+};
+
+/* append the n bytes of str at buf + len, returns the new length, which
+   is at least maxlen if they don't fit */
+static int append_bytes(char* buf, int len, int maxlen, const char* str, int n) {
+    if (len + n >= maxlen) {
+        return maxlen;
+    }
+
+    memcpy(buf + len, str, n);
+    buf[len + n] = '\0';
+    return len + n;
+}
+
+static int append_string(char* buf, int len, int maxlen, const char* str) {
+    return append_bytes(buf, len, maxlen, str, strlen(str));
+}
+
+/* a perfect hash of the names in header_table, from the length and the
+   first letter, any other name is told apart by the compare after it */
+static int header_slot(const char* name, int len) {
+    return (len + (name[0] | 0x20)) & (HEADER_TABLE_SIZE - 1);
+}
+
+static enum HeaderName classify_header(const char* name, int len) {
+    if (len == 0) {
+        return HEADER_OTHER;
+    }
+
+    int slot = header_slot(name, len);
+    if (header_table[slot].len == len && strncasecmp(header_table[slot].name, name, len) == 0) {
+        return header_table[slot].id;
+    }
+
+    return HEADER_OTHER;
+}
+
+/* copy n bytes of str to the arena with a null, returns the copy, or NULL
+   if the arena is full */
+static const char* arena_strndup(Request* request, const char* str, int n) {
+    if (request->used + n + 1 > REQUEST_ARENA_SIZE) {
+        return NULL;
+    }
+
+    char* copy = request->arena + request->used;
+    memcpy(copy, str, n);
+    copy[n] = '\0';
+    request->used += n + 1;
+
+    return copy;
+}
+
+/* null-terminate the next token at *p in place and move past it, returns
+   NULL if there is none */
+static char* next_token(char** p) {
+    const char* spaces = " \t\r\n";
+    char* token = *p + strspn(*p, spaces);
+    int n = strcspn(token, spaces);
+    if (n == 0) {
+        return NULL;
+    }
+
+    *p = token + n;
+    if (**p != '\0') {
+        *(*p)++ = '\0';
+    }
+
+    return token;
+}
+
+/* split the uri in place, host and port are copied to the arena, as the
+   byte after each is needed, returns 0 if the arena is full */
+static int parse_uri(const char* uri, const char* default_port, Request* request) {
+    // According to HTTP/1.0 Protocal
+    // https://datatracker.ietf.org/doc/html/rfc1945#section-5.1,
+    // if method is GET, and proxy used, then the request line will be
+    //     GET SP Request-URI SP HTTP/1.0 CLRF
+    //     the Request-URI should be absoluteURI:
+    //         http://www.xxx.com[:port][/path]
+    // According to HTTP/1.1 Protocol 
+    // https://datatracker.ietf.org/doc/html/rfc2616#page-36,
+    // if method is GET, then the request line will be
+    //     GET SP /abs/path SP HTTP/1.1 CLRF, followed by
+    //     Host: SP http://www.xxxx.com:port CLRF
+    // According to HTTP/1.1 Protocol 
+    // https://datatracker.ietf.org/doc/html/rfc2616#page-36,
+    // if method is CONNECT, the request is made to a proxy,
+    // then the request line will be
+    //     CONNECT SP Request-URI SP HTTP/1.1 CLRF
+    //     the Request-URI will be absoluteURI:
+    //         http://www.xxx.com[:port][/path]
+
+    // We'll assume the proxy to be absoluteURI as request is sent to the proxy,
+    // the authority of a CONNECT, host:port, parses the same way
+
+    const char* p = strstr(uri, "://");
+    p = (p ? p + 3 : uri);
+
+    int host_len = strcspn(p, ":/");
+    request->line.host = arena_strndup(request, p, host_len);
+    p += host_len;
+
+    request->line.port = default_port;
+    if (*p == ':') {
+        int port_len = strcspn(++p, "/");
+        request->line.port = arena_strndup(request, p, port_len);
+        p += port_len;
+    }
+
+    /* the path runs to the end of the uri, which is null-terminated */
+    request->line.path = (*p == '/' ? p : "/");
+
+    return request->line.host != NULL && request->line.port != NULL;
+}
+
+void status_message(enum StatusCode code, char* buf, int maxlen) {
+    char message[32];
+    switch (code) {
+        case OK:                  strcpy(message, "OK");                    break;
+        case Created:             strcpy(message, "Created");               break;
+        case Accepted:            strcpy(message, "Accepted");              break;
+        case NoContent:           strcpy(message, "No Content");            break;
+        case PartialContent:      strcpy(message, "Partial Content");       break;
+        case MovedPermanently:    strcpy(message, "Moved Permanently");     break;
+        case MovedTemporarily:    strcpy(message, "Moved Temporarily");     break;
+        case NotModified:         strcpy(message, "Not Modified");          break;
+        case BadRequest:          strcpy(message, "Bad Request");           break;
+        case Unauthorized:        strcpy(message, "Unauthorized");          break;
+        case Forbidden:           strcpy(message, "Forbidden");             break;
+        case NotFound:            strcpy(message, "Not Found");             break;
+        case RangeNotSatisfiable: strcpy(message, "Range Not Satisfiable"); break;
+        case InternalServerError: strcpy(message, "Internal Server Error"); break;
+        case NotImplemented:      strcpy(message, "Not Implemented");       break;
+        case BadGateway:          strcpy(message, "Bad Gateway");           break;
+        case ServiceUnavailable:  strcpy(message, "Service Unavailable");   break;
+        case GatewayTimeout:      strcpy(message, "Gateway Timeout");       break;
+        default:                  strcpy(message, "Unknown");               break;
+    }
+
+    int message_len = strlen(message);
+    if (message_len + 1 > maxlen) {
+        message_len = maxlen - 1;
+    }
+
+    memcpy(buf, message, message_len);
+    buf[message_len] = '\0';
+}
+
+/* format the whole error response, returns its length */
+int format_error(enum StatusCode code, const char* details, char* buf, int maxlen) {
+    const char* err_template = 
+        "HTTP/1.0 %d %s\r\n"
+        "Content-type: text/html\r\n\r\n"
+        "<html>\r\n"
+        "<head>\r\n"
+        "  <title>Proxy Error</title>\r\n"
+        "</head>\r\n"
+        "<body>\r\n"
+        "  <h1>HTTP Status %d - %s</h1>\r\n"
+        "  <p>%.*s</p>\r\n"
+        "</body>\r\n"
+        "</html>\r\n";
+
+    char message[32];
+    status_message(code, message, sizeof(message));
+
+    int len = snprintf(buf, maxlen, err_template, code, message, code, message, 1024, details);
+    return (len < maxlen ? len : maxlen - 1);
+}
+
+void proxy_error(int connfd, enum StatusCode code, const char* details) {
+    char buf[MAXLINE];
+
+    /* the client already got part of a response, an error page would corrupt it */
+    if (connfd < 0) {
+        return;
+    }
+
+    int len = format_error(code, details, buf, sizeof(buf));
+    rio_writen(connfd, buf, len);
+}
+
+Request* new_request() {
+    Request* request = Malloc(sizeof(Request));
+    request->capacity = 16;
+    request->headers = Malloc(request->capacity * sizeof(RequestHeader));
+    reset_request(request);
+
+    return request;
+}
+
+/* empty the arena for the next request */
+void reset_request(Request* request) {
+    request->nheaders = 0;
+    request->keep_alive = 0;
+    request->tunnel = 0;
+    request->range = -1;
+    request->if_range = -1;
+    request->stale = NULL;
+    request->used = 0;
+}
+
+void free_request(Request* request) {
+    free(request->headers);
+    free(request);
+}
+
+/* free space of the arena, the next line is read right into it and then
+   parsed in place, room counts the byte for the null */
+char* request_tail(Request* request, int* room) {
+    *room = REQUEST_ARENA_SIZE - request->used;
+    return request->arena + request->used;
+}
+
+/* parse the request line: Method URI HTTP/version, the n bytes at the
+   tail of a reset request, on failure fill in the status and details
+   to report to the client */
+int parse_request_line(Request* request, int n,
+                       enum StatusCode* code, char* details) {
+    char* line = request->arena + request->used;
+    line[n] = '\0';
+    request->used += n + 1;
+
+    char* p = line;
+    char* method = next_token(&p);
+    char* uri = next_token(&p);
+    char* version = next_token(&p);
+    if (version == NULL) {
+        /* undo the nulls of the tokens for the message */
+        for (int i = 0; i < n; ++i) {
+            line[i] = (line[i] == '\0' ? ' ' : line[i]);
+        }
+        sprintf(details, "invalid http request line: %.*s", MAXLINE / 2, line);
+        *code = BadRequest;
+        return 0;
+    }
+
+    request->line.method = method;
+    request->line.version = version;
+
+    request->tunnel = (strcasecmp(method, "CONNECT") == 0);
+    if (strcasecmp(method, "GET") && !request->tunnel) {
+        sprintf(details, "Proxy only support GET and CONNECT methods");
+        *code = NotImplemented;
+        return 0;
+    }
+
+    /* HTTP/1.1 is persistent unless told otherwise, HTTP/1.0 the opposite */
+    request->keep_alive = 0;
+    if (strcasecmp(version, "HTTP/1.1") == 0) {
+        request->keep_alive = 1;
+        request->line.version = "HTTP/1.0";
+    }
+
+    if (!parse_uri(uri, request->tunnel ? "443" : "80", request)) {
+        sprintf(details, "Request too long to handle");
+        *code = BadRequest;
+        return 0;
+    }
+
+    return 1;
+}
+
+/* keep the header line, the n bytes at the tail, for forwarding */
+int add_request_header(Request* request, int n,
+                       enum StatusCode* code, char* details) {
+    char* line = request->arena + request->used;
+    line[n] = '\0';
+
+    char* colon = memchr(line, ':', n);
+    if (colon == NULL) {
+        sprintf(details, "invalid http header: %.*s", MAXLINE / 2, line);
+        *code = BadRequest;
+        return 0;
+    }
+
+    if (request->nheaders == request->capacity) {
+        request->capacity *= 2;
+        request->headers = Realloc(request->headers,
+                                   request->capacity * sizeof(RequestHeader));
+    }
+
+    char* value = colon + 1 + strspn(colon + 1, " \t");
+    char* end = line + n;
+    while (end > value && strchr(" \t\r\n", end[-1]) != NULL) {
+        end--;
+    }
+
+    RequestHeader* header = &request->headers[request->nheaders++];
+    header->name = classify_header(line, colon - line);
+    header->line.offset = request->used;
+    header->line.len = n;
+    header->value.offset = value - request->arena;
+    header->value.len = end - value;
+    request->used += n + 1;
+
+    /* a cached response may answer the range itself */
+    if (header->name == HEADER_RANGE) {
+        request->range = request->nheaders - 1;
+    } else if (header->name == HEADER_IF_RANGE) {
+        request->if_range = request->nheaders - 1;
+    }
+
+    /* the connection headers are for the proxy, build_request drops them */
+    if (header->name == HEADER_CONNECTION || header->name == HEADER_PROXY_CONNECTION) {
+        if (strcasestr(value, "close")) {
+            request->keep_alive = 0;
+        } else if (strcasestr(value, "keep-alive")) {
+            request->keep_alive = 1;
+        }
+    }
+
+    return 1;
+}
+
+/* build the request sent to the server, asking it to keep the connection
+   open if keep_alive, returns its length, or -1 if it doesn't fit in the buffer */
+int build_request(const Request* request, char* buf, int maxlen, int keep_alive) {
+    const char* connection = (keep_alive ? "keep-alive" : "close");
+    int len = snprintf(buf, maxlen, "%s %s %s\r\n"
+                       "Host: %s:%s\r\n"
+                       "Connection: %s\r\n"
+                       "Proxy-Connection: %s\r\n",
+                       request->line.method, request->line.path, request->line.version,
+                       request->line.host, request->line.port, connection, connection);
+
+    int find_user_agent_hdr = 0;
+    for (int i = 0; i < request->nheaders && len < maxlen; ++i) {
+        const RequestHeader* header = &request->headers[i];
+        /* filter some fields */
+        if (header->name == HEADER_HOST ||
+            header->name == HEADER_CONNECTION ||
+            header->name == HEADER_PROXY_CONNECTION) {
+            continue;
+        }
+
+        /* revalidating our copy, whatever copy the client has doesn't count */
+        if (request->stale != NULL &&
+            (header->name == HEADER_IF_NONE_MATCH ||
+             header->name == HEADER_IF_MODIFIED_SINCE)) {
+            continue;
+        }
+
+        if (header->name == HEADER_USER_AGENT) {
+            find_user_agent_hdr = 1;
+        }
+
+        /* fill in the fields */
+        len = append_bytes(buf, len, maxlen, request->arena + header->line.offset,
+                           header->line.len);
+    }
+
+    if (!find_user_agent_hdr) {
+        len = append_string(buf, len, maxlen, user_agent_hdr);
+    }
+
+    /* a 304 answer renews the stale copy instead of sending it again */
+    const Freshness* stale = request->stale;
+    if (stale != NULL && stale->etag[0] != '\0' && len < maxlen) {
+        len += snprintf(buf + len, maxlen - len, "If-None-Match: %s\r\n", stale->etag);
+    }
+    if (stale != NULL && stale->last_modified[0] != '\0' && len < maxlen) {
+        len += snprintf(buf + len, maxlen - len, "If-Modified-Since: %s\r\n", stale->last_modified);
+    }
+
+    len = append_string(buf, len, maxlen, "\r\n");
+
+    return (len < maxlen ? len : -1);
+}
+
+int generate_key(const RequestLine* request_line, char* key, int maxlen) {
+    /* host */ 
+    const char* p = request_line->host;
+    for (char ch = *p; ch != '\0'; ch = *++p) {
+        if (--maxlen <= 0) {
+            return 0;
+        }
+
+        *(key++) = ch;
+    }
+
+    /* path */
+    p = request_line->path;
+    for (char ch = *p; ch != '\0'; ch = *++p) {
+        if (--maxlen <= 0) {
+            return 0;
+        }
+
+        *(key++) = ch;
+    }
+
+    *key = '\0';
+
+    return 1;
+}
+
+
+void init_response_parser(ResponseParser* parser) {
+    parser->state = RESPONSE_HEAD;
+    parser->status = 0;
+    parser->keep_alive = 0;
+    parser->chunked = 0;
+    parser->content_length = -1;
+    parser->remaining = 0;
+    parser->no_store = 0;
+    parser->no_cache = 0;
+    parser->max_age = -1;
+    parser->age = 0;
+    parser->date = -1;
+    parser->expires = -1;
+    parser->last_modified_time = -1;
+    parser->etag[0] = '\0';
+    parser->last_modified[0] = '\0';
+    parser->line_len = 0;
+}
+
+/* seconds since the epoch of an HTTP-date, -1 if it isn't one */
+static time_t parse_http_date(const char* value) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+
+    while (*value == ' ' || *value == '\t') {
+        value++;
+    }
+    if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) {
+        return -1;
+    }
+
+    return timegm(&tm);
+}
+
+/* copy the value of a header without the spaces around it and the line
+   end, leaves dst empty if it doesn't fit */
+static void copy_header_value(char* dst, const char* value, int maxlen) {
+    while (*value == ' ' || *value == '\t') {
+        value++;
+    }
+    int len = strcspn(value, "\r\n");
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t')) {
+        len--;
+    }
+
+    if (len >= maxlen) {
+        len = 0;
+    }
+    memcpy(dst, value, len);
+    dst[len] = '\0';
+}
+
+/* the directives of Cache-Control a shared cache cares about */
+static void parse_cache_control(ResponseParser* parser, const char* value) {
+    const char* p;
+    if (strcasestr(value, "no-store") || strcasestr(value, "private")) {
+        parser->no_store = 1;
+    }
+    if (strcasestr(value, "no-cache")) {
+        parser->no_cache = 1;
+    }
+
+    /* s-maxage is meant for shared caches like this one, so it wins */
+    if ((p = strcasestr(value, "s-maxage=")) != NULL) {
+        parser->max_age = strtol(p + 9, NULL, 10);
+    } else if ((p = strcasestr(value, "max-age=")) != NULL) {
+        parser->max_age = strtol(p + 8, NULL, 10);
+    }
+}
+
+/* the blank line ends the head, the status and headers tell how the body ends */
+static void end_response_head(ResponseParser* parser) {
+    if (parser->status / 100 == 1 && parser->status != 101) {
+        /* interim response, the real one follows */
+        int keep_alive = parser->keep_alive;
+        init_response_parser(parser);
+        parser->keep_alive = keep_alive;
+    } else if (parser->status == NoContent || parser->status == NotModified) {
+        parser->state = RESPONSE_DONE;
+    } else if (parser->chunked) {
+        parser->state = RESPONSE_CHUNK_SIZE;
+    } else if (parser->content_length >= 0) {
+        parser->remaining = parser->content_length;
+        parser->state = (parser->remaining > 0 ? RESPONSE_BODY : RESPONSE_DONE);
+    } else {
+        parser->state = RESPONSE_UNTIL_CLOSE;
+        parser->keep_alive = 0;
+    }
+}
+
+/* handle a complete line of the head or the chunk framing, returns 0 if malformed */
+static int parse_response_line(ResponseParser* parser) {
+    char* line = parser->line;
+    int blank = (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0);
+
+    switch (parser->state) {
+        case RESPONSE_HEAD:
+            if (parser->status == 0) {
+                int major, minor;
+                if (sscanf(line, "HTTP/%d.%d %d", &major, &minor, &parser->status) != 3) {
+                    /* not a response we understand, pass it through until close */
+                    parser->state = RESPONSE_UNTIL_CLOSE;
+                    parser->keep_alive = 0;
+                    return 1;
+                }
+                /* HTTP/1.1 is persistent unless told otherwise, HTTP/1.0 the opposite */
+                parser->keep_alive = (major == 1 && minor >= 1);
+            } else if (blank) {
+                end_response_head(parser);
+            } else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+                parser->content_length = strtol(line + 15, NULL, 10);
+            } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+                parser->chunked = (strcasestr(line + 18, "chunked") != NULL);
+            } else if (strncasecmp(line, "Connection:", 11) == 0) {
+                if (strcasestr(line + 11, "close")) {
+                    parser->keep_alive = 0;
+                } else if (strcasestr(line + 11, "keep-alive")) {
+                    parser->keep_alive = 1;
+                }
+            } else if (strncasecmp(line, "Cache-Control:", 14) == 0) {
+                parse_cache_control(parser, line + 14);
+            } else if (strncasecmp(line, "Expires:", 8) == 0) {
+                /* an invalid date, like 0, means already expired */
+                parser->expires = parse_http_date(line + 8);
+                if (parser->expires < 0) {
+                    parser->expires = 0;
+                }
+            } else if (strncasecmp(line, "Date:", 5) == 0) {
+                parser->date = parse_http_date(line + 5);
+            } else if (strncasecmp(line, "Age:", 4) == 0) {
+                parser->age = strtol(line + 4, NULL, 10);
+            } else if (strncasecmp(line, "ETag:", 5) == 0) {
+                copy_header_value(parser->etag, line + 5, MAX_VALIDATOR_LEN);
+            } else if (strncasecmp(line, "Last-Modified:", 14) == 0) {
+                copy_header_value(parser->last_modified, line + 14, MAX_VALIDATOR_LEN);
+                parser->last_modified_time = parse_http_date(line + 14);
+            } else if (strncasecmp(line, "Vary:", 5) == 0) {
+                /* the response depends on more than the key */
+                if (strchr(line + 5, '*') != NULL) {
+                    parser->no_store = 1;
+                }
+            }
+            return 1;
+        case RESPONSE_CHUNK_SIZE: {
+            char* end;
+            parser->remaining = strtol(line, &end, 16);
+            if (end == line || parser->remaining < 0) {
+                return 0;
+            }
+            parser->state = (parser->remaining > 0 ? RESPONSE_CHUNK_DATA : RESPONSE_TRAILER);
+            return 1;
+        }
+        case RESPONSE_CHUNK_END:
+            parser->state = RESPONSE_CHUNK_SIZE;
+            return blank;
+        case RESPONSE_TRAILER:
+            if (blank) {
+                parser->state = RESPONSE_DONE;
+            }
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* feed n bytes received from the server, returns how many of them belong
+   to the response, less than n only once it is done, or -1 if malformed */
+int parse_response(ResponseParser* parser, const char* buf, int n) {
+    int pos = 0;
+
+    while (pos < n && parser->state != RESPONSE_DONE) {
+        switch (parser->state) {
+            case RESPONSE_BODY:
+            case RESPONSE_CHUNK_DATA: {
+                int len = (parser->remaining < n - pos ? parser->remaining : n - pos);
+                parser->remaining -= len;
+                pos += len;
+                if (parser->remaining == 0) {
+                    parser->state = (parser->state == RESPONSE_BODY ?
+                                     RESPONSE_DONE : RESPONSE_CHUNK_END);
+                }
+                break;
+            }
+            case RESPONSE_UNTIL_CLOSE:
+                pos = n;
+                break;
+            default: {
+                /* the other states read line by line */
+                char c = buf[pos++];
+                if (parser->line_len == MAXLINE - 1) {
+                    return -1;
+                }
+                parser->line[parser->line_len++] = c;
+                if (c == '\n') {
+                    parser->line[parser->line_len] = '\0';
+                    parser->line_len = 0;
+                    if (!parse_response_line(parser)) {
+                        return -1;
+                    }
+                }
+                break;
+            }
+        }
+    }
+
+    return pos;
+}
+
+/* whether the first size bytes of the chain are a whole response the client
+   can tell the end of, so the connection can carry another one */
+int is_persistent_response(const ChunkChain* chain, int size) {
+    ResponseParser parser;
+    init_response_parser(&parser);
+
+    int pos = 0;
+    for (Chunk* chunk = chain->head; chunk != NULL && pos < size; chunk = chunk->next) {
+        int len = (size - pos < CHUNK_SIZE ? size - pos : CHUNK_SIZE);
+        if (parse_response(&parser, chunk->data, len) != len) {
+            return 0;
+        }
+        pos += len;
+    }
+
+    return (parser.state == RESPONSE_DONE && parser.keep_alive);
+}
+
+/* whether the response with the parsed head may be cached, and until when
+   it is fresh, a 304 gets its new lifetime without being cacheable itself */
+int response_freshness(const ResponseParser* parser, time_t now, Freshness* freshness) {
+    long lifetime;
+    time_t date = (parser->date >= 0 ? parser->date : now);
+
+    /* explicit lifetime first, then a tenth of the time since the last
+       change, then a default for responses that say nothing */
+    if (parser->no_cache) {
+        lifetime = 0;
+    } else if (parser->max_age >= 0) {
+        lifetime = parser->max_age;
+    } else if (parser->expires >= 0) {
+        lifetime = parser->expires - date;
+    } else if (parser->last_modified_time >= 0 && parser->last_modified_time <= date) {
+        lifetime = (date - parser->last_modified_time) / 10;
+        if (lifetime > MAX_HEURISTIC_LIFETIME) {
+            lifetime = MAX_HEURISTIC_LIFETIME;
+        }
+    } else {
+        lifetime = DEFAULT_FRESHNESS_LIFETIME;
+    }
+    lifetime -= parser->age;
+
+    freshness->expires = now + (lifetime > 0 ? lifetime : 0);
+    strcpy(freshness->etag, parser->etag);
+    strcpy(freshness->last_modified, parser->last_modified);
+
+    /* only complete responses that stay the same for everyone, an entry that
+       is stale at once is only worth keeping if it can be revalidated */
+    int status = parser->status;
+    int validated = (parser->etag[0] != '\0' || parser->last_modified[0] != '\0');
+    return ((status == OK || status == 203 || status == 300 || status == MovedPermanently) &&
+            !parser->no_store && (lifetime > 0 || validated));
+}
+
+/* response_freshness of the response in the first size bytes of the chain,
+   0 if its head isn't all there */
+int chain_freshness(const ChunkChain* chain, int size, time_t now, Freshness* freshness) {
+    ResponseParser parser;
+    init_response_parser(&parser);
+
+    int pos = 0;
+    for (Chunk* chunk = chain->head; chunk != NULL && pos < size; chunk = chunk->next) {
+        int len = (size - pos < CHUNK_SIZE ? size - pos : CHUNK_SIZE);
+        if (parse_response(&parser, chunk->data, len) < 0) {
+            return 0;
+        }
+        pos += len;
+        if (parser.state != RESPONSE_HEAD) {
+            break;
+        }
+    }
+
+    return (parser.state != RESPONSE_HEAD && response_freshness(&parser, now, freshness));
+}
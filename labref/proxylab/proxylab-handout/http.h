@@ -0,0 +1,159 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+#include "chunk.h"
+
+/* Bytes of the arena holding the head of a request, the request line,
+   the headers and the copies of host and port must fit */
+#define REQUEST_ARENA_SIZE (16 << 10)
+
+/* Slots of the table classifying header names, a power of 2 */
+#define HEADER_TABLE_SIZE 16
+
+/* Longest ETag or Last-Modified kept for revalidation */
+#define MAX_VALIDATOR_LEN 256
+
+/* Seconds a response stays fresh when it says nothing about it, and the
+   cap on the lifetime guessed from Last-Modified */
+#define DEFAULT_FRESHNESS_LIFETIME 300
+#define MAX_HEURISTIC_LIFETIME 86400
+
+enum StatusCode {
+    OK = 200,
+    Created = 201,
+    Accepted = 202,
+    NoContent = 204,
+    PartialContent = 206,
+    MovedPermanently = 301,
+    MovedTemporarily = 302,
+    NotModified = 304,
+    BadRequest = 400,
+    Unauthorized = 401,
+    Forbidden = 403,
+    NotFound = 404, 
+    RangeNotSatisfiable = 416,
+    InternalServerError = 500,
+    NotImplemented = 501,
+    BadGateway = 502,
+    ServiceUnavailable = 503,
+    GatewayTimeout = 504,
+};
+
+/* the fields are null-terminated, in the arena of the request or static */
+typedef struct RequestLine {
+    const char* method;
+    const char* version;
+    const char* host;
+    const char* port;
+    const char* path;
+} RequestLine;
+
+/* the headers the proxy looks at, the others are forwarded untouched */
+enum HeaderName {
+    HEADER_OTHER,
+    HEADER_HOST,
+    HEADER_CONNECTION,
+    HEADER_PROXY_CONNECTION,
+    HEADER_USER_AGENT,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_RANGE,
+    HEADER_IF_RANGE,
+};
+
+/* bytes of the arena, not null-terminated */
+typedef struct Slice {
+    int offset;
+    int len;
+} Slice;
+
+typedef struct RequestHeader {
+    enum HeaderName name;
+    Slice line;                   /* the whole line, CRLF included */
+    Slice value;                  /* the value, without the spaces around it */
+} RequestHeader;
+
+/* how long a response may be served from the cache, and how to ask the
+   server whether it changed once it is stale */
+typedef struct Freshness {
+    time_t expires;               /* fresh until then */
+    char etag[MAX_VALIDATOR_LEN];           /* "" if none */
+    char last_modified[MAX_VALIDATOR_LEN];  /* "" if none */
+} Freshness;
+
+/*
+ * A request keeps its raw head in one arena, the headers are slices of it,
+ * so parsing copies each byte once. A worker reuses the same request, the
+ * header array only grows.
+ */
+typedef struct Request {
+    RequestLine line;
+    RequestHeader* headers;
+    int nheaders;
+    int capacity;                 /* slots of headers */
+    int keep_alive;               /* the client keeps the connection open */
+    int tunnel;                   /* CONNECT, the uri was host:port */
+    int range;                    /* index of the Range header, -1 if none */
+    int if_range;                 /* index of the If-Range header, -1 if none */
+    const Freshness* stale;       /* validators of a stale cached copy, NULL if none */
+    int used;                     /* bytes of the arena in use */
+    char arena[REQUEST_ARENA_SIZE];
+} Request;
+
+enum ResponseState {
+    RESPONSE_HEAD,                /* reading the status line and headers */
+    RESPONSE_BODY,                /* reading a body of known length */
+    RESPONSE_CHUNK_SIZE,          /* reading a chunk-size line */
+    RESPONSE_CHUNK_DATA,          /* reading the data of a chunk */
+    RESPONSE_CHUNK_END,           /* reading the CRLF after the data of a chunk */
+    RESPONSE_TRAILER,             /* reading the trailer after the last chunk */
+    RESPONSE_UNTIL_CLOSE,         /* the body ends when the server closes */
+    RESPONSE_DONE,                /* the whole response was read */
+};
+
+/*
+ * Incremental parser for the framing of a response, it finds where the
+ * response ends, so a persistent connection can carry the next one, and
+ * picks up the headers that decide whether and how long to cache it.
+ */
+typedef struct ResponseParser {
+    enum ResponseState state;
+    int status;                   /* status code, 0 until the status line is read */
+    int keep_alive;               /* the server keeps the connection open */
+    int chunked;                  /* Transfer-Encoding: chunked */
+    long content_length;          /* -1 if not given */
+    long remaining;               /* bytes left in the body or the chunk */
+    int no_store;                 /* Cache-Control: no-store or private, or Vary: * */
+    int no_cache;                 /* Cache-Control: no-cache, revalidate on every use */
+    long max_age;                 /* Cache-Control: s-maxage or max-age, -1 if not given */
+    long age;                     /* Age, 0 if not given */
+    time_t date;                  /* Date, -1 if not given */
+    time_t expires;               /* Expires, -1 if not given, 0 if invalid */
+    time_t last_modified_time;    /* Last-Modified, -1 if not given */
+    char etag[MAX_VALIDATOR_LEN];           /* ETag, "" if none */
+    char last_modified[MAX_VALIDATOR_LEN];  /* Last-Modified, "" if none */
+    int line_len;                 /* bytes in line */
+    char line[MAXLINE];           /* partial line of the head or a chunk */
+} ResponseParser;
+
+void status_message(enum StatusCode code, char* buf, int maxlen);
+int format_error(enum StatusCode code, const char* details, char* buf, int maxlen);
+void proxy_error(int connfd, enum StatusCode code, const char* details);
+
+Request* new_request();
+void reset_request(Request* request);
+void free_request(Request* request);
+char* request_tail(Request* request, int* room);
+int parse_request_line(Request* request, int n, enum StatusCode* code, char* details);
+int add_request_header(Request* request, int n, enum StatusCode* code, char* details);
+int build_request(const Request* request, char* buf, int maxlen, int keep_alive);
+int generate_key(const RequestLine* line, char* key, int maxlen);
+
+void init_response_parser(ResponseParser* parser);
+int parse_response(ResponseParser* parser, const char* buf, int n);
+int is_persistent_response(const ChunkChain* chain, int size);
+int response_freshness(const ResponseParser* parser, time_t now, Freshness* freshness);
+int chain_freshness(const ChunkChain* chain, int size, time_t now, Freshness* freshness);
+
+#endif /* __HTTP_H__ */
@@ -0,0 +1,447 @@
+/*
+ * loadgen - load a web server, directly or through the proxy, and report
+ * throughput and latency percentiles
+ *
+ * Every connection is a thread. In a closed loop (the default) it sends
+ * the next request as soon as the last response is in; in an open loop
+ * (-r) the requests go out on a fixed schedule whatever the latency, and
+ * a late request is timed from when it should have been sent, so a slow
+ * server can't hide behind a slow client. The paths come from a file,
+ * one per line, most popular first, or from a template with a %d for the
+ * key, e.g. a Tiny CGI script; either way they follow a Zipf distribution.
+ */
+#define _GNU_SOURCE // strcasestr
+#include <math.h>
+#include "csapp.h"
+
+#define DEFAULT_CONNECTION_COUNT 8
+#define DEFAULT_DURATION 10
+#define DEFAULT_KEY_COUNT 1000
+#define DEFAULT_SKEW 0.9
+#define DEFAULT_TEMPLATE "/cgi-bin/adder?%d&0"
+
+typedef struct Load {
+    char* connect_host;           /* the proxy, or the server when direct */
+    char* connect_port;
+    char prefix[MAXLINE];         /* "http://host:port" through the proxy, "" direct */
+    char host[MAXLINE];           /* value of the Host header */
+    char** paths;                 /* paths by popularity */
+    int npaths;
+    double* cdf;                  /* cumulative Zipf weights of the paths */
+    int keep_alive;               /* reuse connections the server keeps open */
+    long start;                   /* microseconds, when the run began */
+    long end;                     /* microseconds, when the run ends */
+    long interval;                /* microseconds between two requests of a connection
+                                     in an open loop, 0 in a closed loop */
+} Load;
+
+typedef struct Client {
+    const Load* load;
+    unsigned int seed;
+    long offset;                  /* microseconds into the run of its first request
+                                     in an open loop */
+    long* latencies;              /* microseconds per completed request */
+    long nlatencies;
+    long capacity;
+    long errors;
+    long bytes;                   /* bytes of response bodies */
+    long statuses[6];             /* responses by status class, other ones at 0 */
+} Client;
+
+void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-c connections] [-d seconds] [-r rate] [-K] [-x proxy:port]\n"
+                    "       [-f paths | -u template] [-k keys] [-s skew] <host> <port>\n"
+                    "  -c  connections, one thread each (default: %d)\n"
+                    "  -d  length of the run in seconds (default: %d)\n"
+                    "  -r  open loop at rate requests/s in total (default: closed loop)\n"
+                    "  -K  keep connections open across requests\n"
+                    "  -x  go through the proxy at proxy:port\n"
+                    "  -f  request the paths in the file, most popular first\n"
+                    "  -u  request template with %%d for the key (default: %s)\n"
+                    "  -k  keys of the template (default: %d)\n"
+                    "  -s  Zipf skew of the popularity, 0 for uniform (default: %.1f)\n",
+            name, DEFAULT_CONNECTION_COUNT, DEFAULT_DURATION, DEFAULT_TEMPLATE,
+            DEFAULT_KEY_COUNT, DEFAULT_SKEW);
+    exit(1);
+}
+
+long now_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+void add_path(Load* load, int* capacity, const char* path) {
+    if (load->npaths == *capacity) {
+        *capacity = (*capacity == 0 ? 1024 : 2 * *capacity);
+        load->paths = Realloc(load->paths, *capacity * sizeof(char*));
+    }
+
+    load->paths[load->npaths] = Malloc(strlen(path) + 1);
+    strcpy(load->paths[load->npaths++], path);
+}
+
+void read_paths(Load* load, const char* filename) {
+    char line[MAXLINE], path[MAXLINE];
+    int capacity = 0;
+
+    FILE* fp = fopen(filename, "r");
+    if (fp == NULL) {
+        unix_error("Open paths failure");
+    }
+
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        if (sscanf(line, "%s", path) == 1) {
+            add_path(load, &capacity, path);
+        }
+    }
+
+    fclose(fp);
+}
+
+void make_paths(Load* load, const char* template, int nkeys) {
+    char path[MAXLINE];
+    int capacity = 0;
+
+    for (int i = 0; i < nkeys; ++i) {
+        snprintf(path, sizeof(path), template, i);
+        add_path(load, &capacity, path);
+    }
+}
+
+/* path i has weight 1 / (i + 1)^skew */
+void make_cdf(Load* load, double skew) {
+    load->cdf = Malloc(load->npaths * sizeof(double));
+    double sum = 0;
+    for (int i = 0; i < load->npaths; ++i) {
+        sum += 1.0 / pow(i + 1, skew);
+        load->cdf[i] = sum;
+    }
+}
+
+const char* pick_path(const Load* load, unsigned int* seed) {
+    double u = (double)rand_r(seed) / RAND_MAX * load->cdf[load->npaths - 1];
+    int lo = 0, hi = load->npaths - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (load->cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return load->paths[lo];
+}
+
+/* read and drop n bytes, or everything until EOF if n < 0, returns the
+   bytes read or -1 if the body ended early */
+long discard(rio_t* rio, long n) {
+    char buf[MAXBUF];
+    long total = 0;
+    while (n < 0 || total < n) {
+        long want = (n < 0 || n - total > MAXBUF ? MAXBUF : n - total);
+        ssize_t rc = rio_readnb(rio, buf, want);
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc == 0) {
+            break;
+        }
+        total += rc;
+    }
+
+    return (n < 0 || total == n ? total : -1);
+}
+
+/* a chunked body up to the end of its trailer */
+long discard_chunked(rio_t* rio) {
+    char line[MAXLINE];
+    long total = 0;
+    while (1) {
+        long size;
+        if (rio_readlineb(rio, line, MAXLINE) <= 0 || sscanf(line, "%lx", &size) != 1) {
+            return -1;
+        }
+        if (size == 0) {
+            break;
+        }
+        if (discard(rio, size) < 0 || rio_readlineb(rio, line, MAXLINE) <= 0) {
+            return -1;
+        }
+        total += size;
+    }
+
+    do {
+        if (rio_readlineb(rio, line, MAXLINE) <= 0) {
+            return -1;
+        }
+    } while (strcmp(line, "\r\n") != 0 && strcmp(line, "\n") != 0);
+
+    return total;
+}
+
+/* send one request and read the whole response, returns the bytes of the
+   body or -1, persistent tells if the connection can carry another one */
+long fetch(int fd, rio_t* rio, const Load* load, const char* path, int* status,
+           int* persistent) {
+    char buf[MAXLINE];
+    int len = snprintf(buf, sizeof(buf), "GET %s%s HTTP/1.%d\r\nHost: %s\r\n%s\r\n",
+                       load->prefix, path, load->keep_alive, load->host,
+                       load->keep_alive ? "" : "Connection: close\r\n");
+    if (rio_writen(fd, buf, len) != len) {
+        return -1;
+    }
+
+    int minor;
+    if (rio_readlineb(rio, buf, MAXLINE) <= 0 ||
+        sscanf(buf, "HTTP/1.%d %d", &minor, status) != 2) {
+        return -1;
+    }
+
+    /* HTTP/1.1 keeps the connection open unless told otherwise */
+    long length = -1;
+    int chunked = 0;
+    *persistent = (minor >= 1);
+    while (1) {
+        if (rio_readlineb(rio, buf, MAXLINE) <= 0) {
+            return -1;
+        }
+        if (strcmp(buf, "\r\n") == 0 || strcmp(buf, "\n") == 0) {
+            break;
+        }
+
+        if (strncasecmp(buf, "Content-Length:", 15) == 0) {
+            length = atol(buf + 15);
+        } else if (strncasecmp(buf, "Transfer-Encoding:", 18) == 0) {
+            chunked = (strcasestr(buf + 18, "chunked") != NULL);
+        } else if (strncasecmp(buf, "Connection:", 11) == 0) {
+            if (strcasestr(buf + 11, "close") != NULL) {
+                *persistent = 0;
+            } else if (strcasestr(buf + 11, "keep-alive") != NULL) {
+                *persistent = 1;
+            }
+        }
+    }
+
+    if (*status == 204 || *status == 304 || *status / 100 == 1) {
+        length = 0;
+    }
+
+    if (chunked) {
+        return discard_chunked(rio);
+    }
+    if (length < 0) {
+        *persistent = 0;
+    }
+    return discard(rio, length);
+}
+
+void record_latency(Client* client, long latency) {
+    if (client->nlatencies == client->capacity) {
+        client->capacity = (client->capacity == 0 ? 4096 : 2 * client->capacity);
+        client->latencies = Realloc(client->latencies, client->capacity * sizeof(long));
+    }
+    client->latencies[client->nlatencies++] = latency;
+}
+
+void* client_routine(void* vargp) {
+    Client* client = (Client*)vargp;
+    const Load* load = client->load;
+    int fd = -1;
+    rio_t rio;
+
+    long next = load->start + client->offset;
+
+    while (1) {
+        long sent = now_us();
+        if (load->interval > 0) {
+            if (next >= load->end) {
+                break;
+            }
+            if (sent < next) {
+                usleep(next - sent);
+            }
+            sent = next;
+            next += load->interval;
+        } else if (sent >= load->end) {
+            break;
+        }
+
+        const char* path = pick_path(load, &client->seed);
+        if (fd < 0) {
+            if ((fd = open_clientfd(load->connect_host, load->connect_port)) < 0) {
+                client->errors++;
+                continue;
+            }
+            Rio_readinitb(&rio, fd);
+        }
+
+        int status, persistent;
+        long n = fetch(fd, &rio, load, path, &status, &persistent);
+        if (n < 0) {
+            client->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+
+        record_latency(client, now_us() - sent);
+        client->bytes += n;
+        client->statuses[status / 100 < 6 ? status / 100 : 0]++;
+
+        if (!load->keep_alive || !persistent) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return NULL;
+}
+
+int compare_longs(const void* a, const void* b) {
+    long x = *(const long*)a, y = *(const long*)b;
+    return (x > y) - (x < y);
+}
+
+long percentile(const long* sorted, long n, double p) {
+    return (n == 0 ? 0 : sorted[(long)(p * (n - 1))]);
+}
+
+void report(const Client* clients, int nclients, long elapsed) {
+    long n = 0, errors = 0, bytes = 0, statuses[6] = { 0 };
+    for (int i = 0; i < nclients; ++i) {
+        n += clients[i].nlatencies;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+        for (int j = 0; j < 6; ++j) {
+            statuses[j] += clients[i].statuses[j];
+        }
+    }
+
+    long* latencies = Malloc((n > 0 ? n : 1) * sizeof(long));
+    long sum = 0;
+    for (int i = 0, k = 0; i < nclients; ++i) {
+        for (long j = 0; j < clients[i].nlatencies; ++j) {
+            latencies[k++] = clients[i].latencies[j];
+            sum += clients[i].latencies[j];
+        }
+    }
+    qsort(latencies, n, sizeof(long), compare_longs);
+
+    double seconds = elapsed / 1e6;
+    printf("requests %ld  errors %ld  1xx %ld  2xx %ld  3xx %ld  4xx %ld  5xx %ld  other %ld\n",
+           n, errors, statuses[1], statuses[2], statuses[3], statuses[4], statuses[5],
+           statuses[0]);
+    printf("throughput %.1f requests/s  %.2f MB/s\n", n / seconds, bytes / seconds / 1e6);
+    printf("latency us  mean %ld  p50 %ld  p90 %ld  p99 %ld  p999 %ld  max %ld\n",
+           n > 0 ? sum / n : 0, percentile(latencies, n, 0.5), percentile(latencies, n, 0.9),
+           percentile(latencies, n, 0.99), percentile(latencies, n, 0.999),
+           n > 0 ? latencies[n - 1] : 0);
+
+    free(latencies);
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    int nclients = DEFAULT_CONNECTION_COUNT;
+    int duration = DEFAULT_DURATION;
+    double rate = 0;
+    int nkeys = DEFAULT_KEY_COUNT;
+    double skew = DEFAULT_SKEW;
+    const char* paths = NULL;
+    const char* template = DEFAULT_TEMPLATE;
+    char* proxy = NULL;
+    Load load;
+    memset(&load, 0, sizeof(load));
+
+    while ((opt = getopt(argc, argv, "c:d:r:Kx:f:u:k:s:")) != -1) {
+        switch (opt) {
+            case 'c': nclients = atoi(optarg);  break;
+            case 'd': duration = atoi(optarg);  break;
+            case 'r': rate = atof(optarg);      break;
+            case 'K': load.keep_alive = 1;      break;
+            case 'x': proxy = optarg;           break;
+            case 'f': paths = optarg;           break;
+            case 'u': template = optarg;        break;
+            case 'k': nkeys = atoi(optarg);     break;
+            case 's': skew = atof(optarg);      break;
+            default:  usage(argv[0]);           break;
+        }
+    }
+
+    if (optind != argc - 2 || nclients <= 0 || duration <= 0 || rate < 0 || nkeys <= 0 ||
+        skew < 0 || strstr(template, "%d") == NULL) {
+        usage(argv[0]);
+    }
+
+    char* host = argv[optind];
+    char* port = argv[optind + 1];
+    snprintf(load.host, sizeof(load.host), "%s:%s", host, port);
+    if (proxy != NULL) {
+        char* colon = strrchr(proxy, ':');
+        if (colon == NULL) {
+            usage(argv[0]);
+        }
+        *colon = '\0';
+        load.connect_host = proxy;
+        load.connect_port = colon + 1;
+        snprintf(load.prefix, sizeof(load.prefix), "http://%s:%s", host, port);
+    } else {
+        load.connect_host = host;
+        load.connect_port = port;
+    }
+
+    if (paths != NULL) {
+        read_paths(&load, paths);
+    } else {
+        make_paths(&load, template, nkeys);
+    }
+    if (load.npaths == 0) {
+        fprintf(stderr, "No paths\n");
+        exit(1);
+    }
+    make_cdf(&load, skew);
+
+    if (rate > 0) {
+        load.interval = (long)(1e6 * nclients / rate);
+        if (load.interval <= 0) {
+            fprintf(stderr, "Rate too high for %d connections\n", nclients);
+            exit(1);
+        }
+    }
+
+    printf("%d paths, skew %.2f, %d connections, %s, %s, %d s, %s %s:%s\n",
+           load.npaths, skew, nclients, load.keep_alive ? "keep-alive" : "close",
+           rate > 0 ? "open loop" : "closed loop", duration,
+           proxy != NULL ? "through proxy" : "direct to", load.connect_host, load.connect_port);
+    if (rate > 0) {
+        printf("target %.1f requests/s\n", rate);
+    }
+
+    /* a server closing on us must not kill the run */
+    Signal(SIGPIPE, SIG_IGN);
+
+    pthread_t* tids = Malloc(nclients * sizeof(pthread_t));
+    Client* clients = Calloc(nclients, sizeof(Client));
+    load.start = now_us();
+    load.end = load.start + duration * 1000000L;
+    for (int i = 0; i < nclients; ++i) {
+        clients[i].load = &load;
+        clients[i].seed = i + 1;
+        /* spread the connections of an open loop over the interval */
+        clients[i].offset = load.interval * i / nclients;
+        Pthread_create(&tids[i], NULL, client_routine, &clients[i]);
+    }
+    for (int i = 0; i < nclients; ++i) {
+        Pthread_join(tids[i], NULL);
+    }
+
+    report(clients, nclients, now_us() - load.start);
+
+    return 0;
+}
@@ -0,0 +1,164 @@
+#include <time.h>
+#include "log.h"
+
+typedef struct Logger {
+    LogRing* rings;               /* rings of every thread that logged */
+    int nrings;
+    pthread_mutex_t mutex;        /* protect the list, taken once per thread */
+    pthread_mutex_t flushing;     /* the logger and exit may both flush */
+} Logger;
+
+static Logger logger = { NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+
+static __thread LogRing* local;
+
+static const char* level_names[] = { "error", "warn", "info", "debug" };
+
+enum LogLevel log_level = LOG_LEVEL_INFO;
+
+static LogRing* local_ring();
+static int format_record(char* buf, const LogRecord* record, int id);
+static void* log_routine(void* argp);
+static void flush_at_exit();
+
+/* set the level by name and start the logger, it must run after the
+   signals are blocked, returns 0 if the level is unknown */
+int init_log(const char* level) {
+    int found = 0;
+    for (int i = 0; i < sizeof(level_names) / sizeof(level_names[0]); ++i) {
+        if (strcmp(level_names[i], level) == 0) {
+            log_level = i;
+            found = 1;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "Unknown log level %s\n", level);
+        return 0;
+    }
+
+    pthread_t tid;
+    Pthread_create(&tid, NULL, log_routine, NULL);
+    atexit(flush_at_exit);
+
+    return 1;
+}
+
+/* format the message into the next record of the ring of the thread, the
+   arguments may point to buffers reused right after, so the text is made
+   here, the logger only adds the prefix and writes it out */
+void log_write(enum LogLevel level, const char* format, ...) {
+    LogRing* ring = local_ring();
+
+    unsigned long head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogRecord* record = &ring->records[head & (LOG_RING_SIZE - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record->time = ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+    record->level = level;
+
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(record->text, LOG_TEXT_SIZE, format, ap);
+    va_end(ap);
+    record->len = (n < 0 ? 0 : (n < LOG_TEXT_SIZE ? n : LOG_TEXT_SIZE - 1));
+
+    /* the record is complete before the logger can see it */
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* write out the records of every ring, returns how many */
+int flush_log() {
+    static char buf[LOG_RING_SIZE * (LOG_TEXT_SIZE + 64)];
+    int nflushed = 0;
+
+    pthread_mutex_lock(&logger.flushing);
+
+    for (LogRing* ring = __atomic_load_n(&logger.rings, __ATOMIC_ACQUIRE);
+         ring != NULL; ring = ring->next) {
+        unsigned long tail = ring->tail;
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail == head && __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED) == ring->reported) {
+            continue;
+        }
+
+        int len = 0;
+        for (; tail != head; ++tail) {
+            len += format_record(buf + len, &ring->records[tail & (LOG_RING_SIZE - 1)], ring->id);
+            nflushed++;
+        }
+
+        /* the slots are free again once formatted */
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped > ring->reported) {
+            len += sprintf(buf + len, "log: thread %d dropped %ld records\n",
+                           ring->id, dropped - ring->reported);
+            ring->reported = dropped;
+        }
+
+        if (rio_writen(STDOUT_FILENO, buf, len) != len) {
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&logger.flushing);
+
+    return nflushed;
+}
+
+/* the ring of the calling thread, linked in on its first record */
+static LogRing* local_ring() {
+    if (local == NULL) {
+        void* p = NULL;
+        if (posix_memalign(&p, 64, sizeof(LogRing)) != 0) {
+            unix_error("posix_memalign error");
+        }
+        local = p;
+        local->head = local->tail = 0;
+        local->dropped = local->reported = 0;
+
+        pthread_mutex_lock(&logger.mutex);
+        local->id = logger.nrings++;
+        local->next = logger.rings;
+        __atomic_store_n(&logger.rings, local, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&logger.mutex);
+    }
+
+    return local;
+}
+
+/* time, level, thread and text on one line */
+static int format_record(char* buf, const LogRecord* record, int id) {
+    struct tm tm;
+    time_t seconds = record->time / 1000000;
+    localtime_r(&seconds, &tm);
+
+    int len = strftime(buf, 32, "%H:%M:%S", &tm);
+    len += sprintf(buf + len, ".%06ld %-5s [%d] %.*s\n", record->time % 1000000,
+                   level_names[record->level], id, record->len, record->text);
+
+    return len;
+}
+
+static void* log_routine(void* argp) {
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        if (flush_log() == 0) {
+            usleep(LOG_FLUSH_INTERVAL * 1000);
+        }
+    }
+
+    return NULL;
+}
+
+/* exit comes from the snapshot thread or a fatal error, keep the tail */
+static void flush_at_exit() {
+    flush_log();
+}
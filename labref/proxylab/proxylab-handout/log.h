@@ -0,0 +1,65 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include "csapp.h"
+
+/* Records per thread ring, a power of 2, and bytes of text per record,
+   longer messages are cut */
+#define LOG_RING_SIZE 256
+#define LOG_TEXT_SIZE 232
+
+/* Milliseconds the logger sleeps once the rings are empty */
+#define LOG_FLUSH_INTERVAL 10
+
+enum LogLevel {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+};
+
+#ifdef VERBOSE
+#define DEFAULT_LOG_LEVEL "debug"
+#else
+#define DEFAULT_LOG_LEVEL "info"
+#endif
+
+typedef struct LogRecord {
+    long time;                    /* microseconds since the epoch */
+    enum LogLevel level;
+    int len;                      /* bytes of text */
+    char text[LOG_TEXT_SIZE];
+} LogRecord;
+
+/*
+ * A ring of records with a single producer, the thread owning it, and a
+ * single consumer, the logger, so neither side takes a lock. head and tail
+ * live on their own cache lines. A full ring drops the record instead of
+ * making the thread wait.
+ */
+typedef struct LogRing {
+    unsigned long head __attribute__((aligned(64)));  /* next record to fill, written by the owner */
+    long dropped;                                     /* records lost to a full ring */
+    unsigned long tail __attribute__((aligned(64)));  /* next record to flush, written by the logger */
+    long reported;                                    /* drops already reported by the logger */
+    int id;                                           /* number of the thread in the output */
+    struct LogRing* next;                             /* next ring in the list of all */
+    LogRecord records[LOG_RING_SIZE] __attribute__((aligned(64)));
+} LogRing;
+
+extern enum LogLevel log_level;
+
+/* the arguments are only evaluated if the level is on */
+#define log_at(level, ...) \
+    do { if ((level) <= log_level) log_write((level), __VA_ARGS__); } while (0)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+int init_log(const char* level);
+void log_write(enum LogLevel level, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+int flush_log();
+
+#endif /* __LOG_H__ */
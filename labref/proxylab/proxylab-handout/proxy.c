@@ -1,662 +1,1126 @@
-#define _GNU_SOURCE // strcasestr
-#include <string.h>
-
+#define _GNU_SOURCE // splice
 #include <stdio.h>
 #include <stdlib.h>
-#include <limits.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/prctl.h>
 #include "csapp.h"
-
-#define VERBOSE
-
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
-#define MAX_OBJECT_COUNT (MAX_CACHE_SIZE / MAX_OBJECT_SIZE)
-
-#define MAX_HEADER_COUNT 20
-
-/* You won't lose style points for including this long line in your code */
-static const char *user_agent_hdr = 
-    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-
-enum StatusCode {
-    OK = 200,
-    Created = 201,
-    Accepted = 202,
-    NoContent = 204,
-    MovedPermanently = 301,
-    MovedTemporarily = 302,
-    NotModified = 304,
-    BadRequest = 400,
-    Unauthorized = 401,
-    Forbidden = 403,
-    NotFound = 404, 
-    InternalServerError = 500,
-    NotImplemented = 501,
-    BadGateway = 502,
-    ServiceUnavailable = 503,
-};
-
-typedef struct timeval timeval_t;
-
-typedef struct RequestLine {
-    char method[MAXLINE];
-    char version[MAXLINE];
-    char host[MAXLINE];
-    char port[MAXLINE];
-    char path[MAXLINE];
-} RequestLine;
-
-typedef struct RequestHeader {
-    char content[MAXLINE];
-} RequestHeader;
-
-typedef struct Request {
-    RequestLine line;
-    RequestHeader headers[MAX_HEADER_COUNT];
-    int nheaders;
-} Request;
-
-typedef struct CacheObject {
-    timeval_t timestamp;          /* for LRU replacement */
-    char* key;                    /* key for cached object */
-    char* data;                   /* cached data */
-    int size;                     /* size of the cache object */
-    int nreaders;                 /* number of readers */
-    sem_t mutex;                  /* protect nreaders */
-    sem_t rwlock;                 /* reader-writer's lock */
-} CacheObject;
-
-typedef struct Cache {
-    CacheObject objects[MAX_OBJECT_COUNT];
-} Cache;
-
-Cache cache;
-
-void init_cache();
-int read_cache(int clientfd, const char* key);
-void write_cache(char* buf, int size, const char* key);
-void deinit_cache();
-
-void status_message(enum StatusCode code, char* buf, int maxlen);
-void proxy_error(int connfd, enum StatusCode code, const char* details);
-
-void parse_uri(const char* uri, RequestLine* request_line);
-void print_request_line(const RequestLine* request_line);
-int generate_key(RequestLine* line, char* key, int maxlen);
-int is_least_recently(const timeval_t* t1, const timeval_t* t2);
-
-int forward_request(int clientfd, Request* request);
-int backward_response_from_cache(int clientfd, const char* key);
-int backward_response_from_server(int clientfd, int serverfd, const char* key);
+#include "sbuf.h"
+#include "http.h"
+#include "cache.h"
+#include "disk.h"
+#include "snapshot.h"
+#include "shared.h"
+#include "flight.h"
+#include "upstream.h"
+#include "resolver.h"
+#include "event.h"
+#include "tunnel.h"
+#include "range.h"
+#include "stats.h"
+#include "log.h"
+
+/* Default size of the worker pool and its connection queue */
+#define DEFAULT_THREAD_COUNT 16
+#define DEFAULT_QUEUE_SIZE 64
+
+/* Seconds a persistent client may stay idle between two requests */
+#define CLIENT_IDLE_TIMEOUT 5
+
+/* Bytes moved per splice of an uncacheable response */
+#define SPLICE_SIZE (1 << 20)
+
+int forward_request(int clientfd, Request* request, int* reused);
+int backward_response_from_cache(int clientfd, const Request* request, const char* key,
+                                 unsigned int hash, int* persistent, CacheObject** stale);
+int backward_response_from_shared(int clientfd, const Request* request, const char* key,
+                                  unsigned int hash, int* persistent);
+int backward_response_from_disk(int clientfd, const Request* request, const char* key,
+                                unsigned int hash, int* persistent);
+int send_range(int clientfd, const Request* request, const ChunkChain* chain,
+               const DiskObject* disk, int size, int* sent);
+int backward_response_from_server(int clientfd, int serverfd, Flight* flight,
+                                  int* received, CacheObject* stale, int* not_modified);
+int fetch_response(int clientfd, Request* request, Flight* flight, CacheObject* stale);
+int send_renewed(int clientfd, Flight* flight, CacheObject* object);
+long splice_response(int serverfd, int clientfd, long len);
+int backward_response_from_flight(int clientfd, Flight* flight, int* sent);
+void tunnel_client(int clientfd, rio_t* rio, Request* request);
+void serve_client(int clientfd, Request* request);
+int handle_client(int clientfd, rio_t* rio, Request* request, int first);
 void* proxy_routine(void* argp);
+int fork_workers(int n);
+
+sbuf_t sbuf; /* shared buffer of connected descriptors */
+static __thread int splice_pipe[2] = { -1, -1 }; /* kept by each worker for splice_response */
+
+void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-e] [-r] [-t threads] [-q queue size] [-p policy] [-d dir [-D MB]]\n"
+                    "       [-s snapshot [-i seconds]] [-l level] [-w workers [-S MB]]\n"
+                    "       [-T connect,first_byte,stall] [-m connections] <port>\n"
+                    "  -e  serve with event loops, -t gives their count (default: one per core,\n"
+                    "      one per worker process with -w)\n"
+                    "  -r  log client host names, which costs a reverse lookup per connection\n"
+                    "  -p  cache replacement policy: lru, clock or tinylfu (default: %s)\n"
+                    "  -d  keep objects evicted from memory in segment files in dir,\n"
+                    "      -D gives their total size (default: %d MB)\n"
+                    "  -s  start with the cache saved in the snapshot file, save it there\n"
+                    "      every -i seconds (default: %d) and on SIGINT or SIGTERM\n"
+                    "  -l  log level: error, warn, info or debug (default: %s)\n"
+                    "  -w  fork worker processes pinned to cores, all listening on the port,\n"
+                    "      sharing a cache of -S MB (default: %d MB), each worker keeps its\n"
+                    "      own disk tier in dir/<worker> and snapshot in snapshot.<worker>\n"
+                    "  -T  milliseconds to connect to a server, to get the first byte of its\n"
+                    "      response, and for a transfer making no progress, 0 for no limit\n"
+                    "      (default: %d,%d,%d), a server timing out gets the client a 504\n"
+                    "  -m  connections open to one server at most, 0 for no cap (default: %d)\n",
+            name, DEFAULT_CACHE_POLICY, DEFAULT_DISK_CACHE_MB, DEFAULT_SNAPSHOT_INTERVAL,
+            DEFAULT_LOG_LEVEL, DEFAULT_SHARED_CACHE_MB, DEFAULT_CONNECT_TIMEOUT,
+            DEFAULT_FIRST_BYTE_TIMEOUT, DEFAULT_STALL_TIMEOUT, DEFAULT_MAX_PER_HOST);
+    exit(1);
+}
 
 int main(int argc, char* argv[]) {
-    int rc;
-    int *clientfdp;
+    int rc, opt;
+    int clientfd;
     pthread_t tid;
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
     char hostname[MAXLINE], port[MAXLINE];
+    int nthreads = 0;
+    int queue_size = DEFAULT_QUEUE_SIZE;
+    int event_mode = 0;
+    int name_flags = NI_NUMERICHOST | NI_NUMERICSERV;
+    const char* policy = DEFAULT_CACHE_POLICY;
+    const char* disk_dir = NULL;
+    long disk_mb = DEFAULT_DISK_CACHE_MB;
+    const char* snapshot = NULL;
+    int snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+    const char* log_level_name = DEFAULT_LOG_LEVEL;
+    int nworkers = 0;
+    long shared_mb = DEFAULT_SHARED_CACHE_MB;
+    char worker_disk_dir[MAXLINE], worker_snapshot[MAXLINE];
+    UpstreamLimits* limits = &upstream_limits;
+    int ntimeouts = 3;
+
+    while ((opt = getopt(argc, argv, "ert:q:p:d:D:s:i:l:w:S:T:m:")) != -1) {
+        switch (opt) {
+            case 'e': event_mode = 1;            break;
+            case 'r': name_flags = 0;            break;
+            case 't': nthreads = atoi(optarg);   break;
+            case 'q': queue_size = atoi(optarg); break;
+            case 'p': policy = optarg;           break;
+            case 'd': disk_dir = optarg;         break;
+            case 'D': disk_mb = atol(optarg);    break;
+            case 's': snapshot = optarg;         break;
+            case 'i': snapshot_interval = atoi(optarg); break;
+            case 'l': log_level_name = optarg;   break;
+            case 'w': nworkers = atoi(optarg);   break;
+            case 'S': shared_mb = atol(optarg);  break;
+            case 'T':
+                ntimeouts = sscanf(optarg, "%d,%d,%d", &limits->connect_timeout,
+                                   &limits->first_byte_timeout, &limits->stall_timeout);
+                break;
+            case 'm': limits->max_per_host = atoi(optarg); break;
+            default:  usage(argv[0]);            break;
+        }
+    }
 
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>", argv[0]);
-        exit(1);
+    if (nthreads == 0) {
+        nthreads = (!event_mode ? DEFAULT_THREAD_COUNT :
+                    nworkers > 0 ? 1 : sysconf(_SC_NPROCESSORS_ONLN));
+    }
+
+    if (optind != argc - 1 || nthreads <= 0 || queue_size <= 0 || disk_mb <= 0 ||
+        snapshot_interval <= 0 || nworkers < 0 || shared_mb <= 0 || ntimeouts != 3 ||
+        limits->connect_timeout < 0 || limits->first_byte_timeout < 0 ||
+        limits->stall_timeout < 0 || limits->max_per_host < 0) {
+        usage(argv[0]);
+    }
+
+    /* the workers inherit the shared cache, and fork before any thread is
+       created, each keeps its disk tier and snapshot apart */
+    if (nworkers > 0) {
+        if (!init_shared(shared_mb << 20)) {
+            exit(1);
+        }
+        if (disk_dir != NULL && mkdir(disk_dir, 0755) < 0 && errno != EEXIST) {
+            fprintf(stderr, "mkdir %s error: %s\n", disk_dir, strerror(errno));
+            exit(1);
+        }
+
+        int worker = fork_workers(nworkers);
+        if (disk_dir != NULL) {
+            snprintf(worker_disk_dir, sizeof(worker_disk_dir), "%s/%d", disk_dir, worker);
+            disk_dir = worker_disk_dir;
+        }
+        if (snapshot != NULL) {
+            snprintf(worker_snapshot, sizeof(worker_snapshot), "%s.%d", snapshot, worker);
+            snapshot = worker_snapshot;
+        }
+    }
+
+    /* before any thread is created */
+    if (snapshot != NULL) {
+        init_snapshots(snapshot, snapshot_interval);
+    }
+    if (!init_log(log_level_name)) {
+        usage(argv[0]);
     }
 
-    /* init cache */
-    init_cache(cache);
+    /* init cache, evicted objects go to disk if there is a second tier */
+    if (!init_cache(policy, disk_dir != NULL ? disk_store : NULL)) {
+        usage(argv[0]);
+    }
+    if (disk_dir != NULL && !init_disk(disk_dir, disk_mb << 20)) {
+        exit(1);
+    }
+    init_flights();
+    init_upstreams();
+    init_resolver();
+    init_chunks();
+
+    /* warm the cache up before accepting any connection */
+    if (snapshot != NULL) {
+        load_snapshot();
+        start_snapshots();
+    }
 
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
-        fprintf(stderr, "overwrite signal handler for SIGPIPE failure");
+        log_error("overwrite signal handler for SIGPIPE failure");
         exit(1);
     }
 
-    /* listen */
-    int listenfd = Open_listenfd(argv[1]);
+    /* listen, every worker on a socket of its own */
+    int listenfd = (nworkers > 0 ? Open_reuseport_listenfd(argv[optind]) :
+                    Open_listenfd(argv[optind]));
+
+    /* event-driven engine, never returns */
+    if (event_mode) {
+        run_event_loops(listenfd, nthreads);
+    }
+
+    /* prethread the workers */
+    sbuf_init(&sbuf, queue_size);
+    for (int i = 0; i < nthreads; ++i) {
+        Pthread_create(&tid, NULL, proxy_routine, NULL);
+    }
 
     /* main loop */
     while (1) {
-        clientfdp = (int*)malloc(sizeof(int));
-        if (clientfdp == NULL) {
-            fprintf(stderr, "malloc error");
-            continue;
-        }
-
         /* accept */
         clientlen = sizeof(clientaddr);
-        *clientfdp = accept(listenfd, (struct sockaddr *)&clientaddr, &clientlen);
-        if (*clientfdp < 0) {
-            fprintf(stderr, "accept error");
-            free(clientfdp);
+        clientfd = accept(listenfd, (struct sockaddr *)&clientaddr, &clientlen);
+        if (clientfd < 0) {
+            log_error("accept error");
             continue;
         }
 
-        /* get info */
-        if ((rc = getnameinfo((struct sockaddr*)&clientaddr,
-                              clientlen, hostname, MAXLINE, port, MAXLINE, 0))) {
-            fprintf(stderr, "getnameinfo error: %s\n", gai_strerror(rc));
-            proxy_error(*clientfdp, Unauthorized, "getnameinfo error");
-            close(*clientfdp);
-            free(clientfdp);
+        /* get info, numeric unless asked otherwise, so a slow reverse lookup
+           can't hold up the accepts */
+        if ((rc = getnameinfo((struct sockaddr*)&clientaddr, clientlen,
+                              hostname, MAXLINE, port, MAXLINE, name_flags))) {
+            log_error("getnameinfo error: %s", gai_strerror(rc));
+            proxy_error(clientfd, Unauthorized, "getnameinfo error");
+            close(clientfd);
             continue;
         }
 
-#ifdef VERBOSE
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
-#endif
+        log_debug("Accepted connection from (%s, %s)", hostname, port);
 
-        /* create thread to server the request */
-        if (pthread_create(&tid, NULL, proxy_routine, clientfdp) != 0) {
-            proxy_error(*clientfdp, InternalServerError, "pthread_create error");
-            close(*clientfdp);
-            free(clientfdp);
+        /* hand over to the workers, turn the client away if all are busy */
+        if (!sbuf_try_insert(&sbuf, clientfd)) {
+            proxy_error(clientfd, ServiceUnavailable, "Proxy is too busy, try again later");
+            close(clientfd);
             continue;
         }
-
-#ifdef VERBOSE
-        printf("Create thread %ld to handle proxy routine\n", tid);
-#endif
     }
 
     /* destroy cache, never reached */
+    sbuf_deinit(&sbuf);
+    deinit_upstreams();
+    deinit_resolver();
+    deinit_flights();
     deinit_cache();
+    deinit_disk();
+    deinit_chunks();
 
     return 0;
 }
 
-void init_cache() {
-    for (int i = 0; i < MAX_OBJECT_COUNT; ++i) {
-        cache.objects[i].timestamp.tv_sec = 0;
-        cache.objects[i].timestamp.tv_usec = 0;
-        cache.objects[i].key = Malloc(MAXLINE);
-        cache.objects[i].data = Malloc(MAX_OBJECT_SIZE);
-        cache.objects[i].size = 0;
-        cache.objects[i].nreaders = 0;
-        Sem_init(&cache.objects[i].mutex, 0, 1);
-        Sem_init(&cache.objects[i].rwlock, 0, 1);
-    }
-}
+/* fork n worker processes, each pinned to a core, returns the index of the
+   worker in the child; the parent never returns, it only forwards SIGINT
+   and SIGTERM to the workers and replaces one that a signal killed */
+int fork_workers(int n) {
+    sigset_t signals, prev;
+    Sigemptyset(&signals);
+    Sigaddset(&signals, SIGINT);
+    Sigaddset(&signals, SIGTERM);
+    Sigaddset(&signals, SIGCHLD);
+    Sigprocmask(SIG_BLOCK, &signals, &prev);
+
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pid_t* pids = Calloc(n, sizeof(pid_t)); /* 0 to fork, -1 once exited */
+    int nalive = 0;
 
-int read_cache(int clientfd, const char* key) {
-    int found = 0;
-    for (int i = 0; i < MAX_OBJECT_COUNT; ++i) {
-        /* lock mutex for nreaders */
-        P(&cache.objects[i].mutex);
-        cache.objects[i].nreaders++;
-
-        /* if first reader, lock the rwlock to prevent data race with writter */
-        if (cache.objects[i].nreaders == 1) {
-            P(&cache.objects[i].rwlock);
-        }
-
-        /* unlock mutex for other readers */
-        V(&cache.objects[i].mutex);
-
-        /* begin rwlock critical section */
-        if (strcmp(cache.objects[i].key, key) == 0) {
-            found = 1;
-            /* LRU replacement */
-            P(&cache.objects[i].mutex);
-            gettimeofday(&cache.objects[i].timestamp, NULL);
-            V(&cache.objects[i].mutex);
-
-            /* send data to the client */
-            int len = cache.objects[i].size;
-            if (len != rio_writen(clientfd, cache.objects[i].data, len)) {
-                fprintf(stderr, "Proxy write data to client failure\n");
+    while (1) {
+        for (int i = 0; i < n; ++i) {
+            if (pids[i] != 0) {
+                continue;
             }
+
+            if ((pids[i] = Fork()) == 0) {
+                Sigprocmask(SIG_SETMASK, &prev, NULL);
+                free(pids);
+
+                /* don't outlive the parent */
+                prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(i % ncpus, &cpus);
+                if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+                    fprintf(stderr, "sched_setaffinity error: %s\n", strerror(errno));
+                }
+                return i;
+            }
+            nalive++;
         }
-        /* end rwlock critical section */
 
-        /* lock mutex for nreaders */
-        P(&cache.objects[i].mutex);
-        cache.objects[i].nreaders--;
-        
-        /* if no other readers, unlock the rwlock for other readers/writters */
-        if (cache.objects[i].nreaders == 0) {
-            V(&cache.objects[i].rwlock);
+        int sig;
+        if (sigwait(&signals, &sig) != 0) {
+            continue;
         }
 
+        if (sig != SIGCHLD) {
+            for (int i = 0; i < n; ++i) {
+                if (pids[i] > 0) {
+                    kill(pids[i], sig);
+                }
+            }
+            while (wait(NULL) > 0) {
+            }
+            exit(0);
+        }
 
-        /* unlock mutex for other readers/writters */
-        V(&cache.objects[i].mutex);
+        /* a worker that exited by itself would fail again, a crash may not */
+        int status, restarting = 0;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < n; ++i) {
+                if (pids[i] != pid) {
+                    continue;
+                }
+                nalive--;
+                if (WIFSIGNALED(status)) {
+                    fprintf(stderr, "worker %d killed by signal %d, restarting\n",
+                            i, WTERMSIG(status));
+                    pids[i] = 0;
+                    restarting = 1;
+                } else {
+                    fprintf(stderr, "worker %d exited with status %d\n",
+                            i, WEXITSTATUS(status));
+                    pids[i] = -1;
+                }
+            }
+        }
 
-        if (found) {
-            break;
+        if (nalive == 0 && !restarting) {
+            exit(1);
         }
     }
+}
 
-#ifdef VERBOSE
-    printf("read_cache: %d\n", found);
-#endif
+/* read the next request of the client, a persistent client that closes or
+   stays idle between requests is not an error unless it is the first one,
+   the lines are read straight into the arena of the request */
+int parse_request(int clientfd, rio_t* rio, Request* request, int first) {
+    char err_message[MAXLINE];
+    int room;
 
-    return found;
-}
+    reset_request(request);
 
-void write_cache(char* buf, int size, const char* key) {
-    /* find the victim using the approximate LRU, 
-       despite the timestamp may get changed during comparision */
-    int index = 0;
-    timeval_t min_timestamp = { LONG_MAX, LONG_MAX };
-    for (int i = 0; i < MAX_OBJECT_COUNT; ++i) {
-        P(&cache.objects[i].mutex);
-        if (is_least_recently(&cache.objects[i].timestamp, &min_timestamp)) {
-            index = i;
-            min_timestamp = cache.objects[i].timestamp;
-        }        
-        V(&cache.objects[i].mutex);
+    /* 1. receive request from client */
+    /* 1.1 read the request line: Method URI HTTP/version */
+    char* line = request_tail(request, &room);
+    int rc = rio_readlineb(rio, line, room);
+    if (rc <= 0 && !first) {
+        return 0;
+    } else if (rc == -1) { /* error */
+        sprintf(err_message, "rio_readlineb: ");
+        int len = strlen(err_message);
+        strerror_r(errno, err_message + len, MAXLINE - len);
+        log_warn("%s", err_message);
+        proxy_error(clientfd, InternalServerError, err_message);
+        return 0;
+    } else if (rc == 0) {  /* no data */
+        proxy_error(clientfd, NoContent, "No actual data received");
+        return 0;
+    } else {
+        if (rc == room - 1) {
+            log_warn("app error: line to long");
+            proxy_error(clientfd, BadRequest, "Request too long to handle");
+            return 0;
+        }
     }
 
-    /* begin rwlock critical section */
-    P(&cache.objects[index].rwlock);
+    /* 1.2 parse the request line */
+    enum StatusCode code;
+    if (!parse_request_line(request, rc, &code, err_message)) {
+        log_warn("%s", err_message);
+        proxy_error(clientfd, code, err_message);
+        return 0;
+    }
 
-    /* update timestamp */
-    gettimeofday(&cache.objects[index].timestamp, NULL);
+    /* 1.3 parse request headers */
+    while (1) {
+        /* a line filling the rest of the arena may be cut short */
+        line = request_tail(request, &room);
+        if (room < 2 ||
+            ((rc = rio_readlineb(rio, line, room)) == room - 1 && line[rc - 1] != '\n')) {
+            log_warn("app error: request headers too long");
+            proxy_error(clientfd, BadRequest, "Request headers too long to handle");
+            return 0;
+        }
 
-    /* update key */
-    strcpy(cache.objects[index].key, key);
+        if (rc <= 0) {
+            break;
+        }
 
-    /* update data and its size */
-    memcpy(cache.objects[index].data, buf, size);
-    cache.objects[index].size = size;
+        /* end of request header */
+        if (strcmp(line, "\r\n") == 0) {
+            break;
+        }
 
-    V(&cache.objects[index].rwlock);
-    /* end rwlock critical section  */
+        if (!add_request_header(request, rc, &code, err_message)) {
+            log_warn("app error: %s", err_message);
+            proxy_error(clientfd, code, err_message);
+            return 0;
+        }
+    }
 
-#ifdef VERBOSE
-    printf("write to cache object %d\n", index);
-#endif
+    return rc >= 0;
 }
 
-void deinit_cache() {
-    for (int i = 0; i < MAX_OBJECT_COUNT; ++i) {
-        free(cache.objects[i].key);
-        free(cache.objects[i].data);
-        sem_destroy(&cache.objects[i].mutex);
-        sem_destroy(&cache.objects[i].rwlock);
+/* send the request on a pooled or new connection to the server, returns it,
+   reused tells if it was pooled, errors on a pooled one are left to the caller */
+int forward_request(int clientfd, Request* request, int* reused) {
+    char new_request[REQUEST_ARENA_SIZE];
+    *reused = 0;
+    int len = build_request(request, new_request, sizeof(new_request), 1);
+    if (len < 0) {
+        proxy_error(clientfd, BadRequest, "Request headers too long to forward");
+        return -1;
+    }
+
+    log_debug("New request: %s %s %s", request->line.method, request->line.path,
+              request->line.version);
+
+    /* 2 forward request to server */
+    /* 2.1 establish connection to server */
+    int serverfd = upstream_acquire(request->line.host, request->line.port, reused);
+    if (serverfd == SERVER_TIMEOUT) {
+        proxy_error(clientfd, GatewayTimeout, "Proxy timed out connecting to server");
+        return -1;
+    } else if (serverfd < 0) {
+        proxy_error(clientfd, BadGateway, "Proxy cannot connect to server");
+        return -1;
     }
+
+    log_debug("%s connection to (%s, %s)", *reused ? "Reuse" : "Establish",
+              request->line.host, request->line.port);
+
+    /* 2.2 forward request header */
+    int rc = rio_writen(serverfd, new_request, len);
+    if (rc != len) {
+        if (!*reused) {
+            proxy_error(clientfd, BadGateway, "Proxy forward header failure");
+        }
+        upstream_close(request->line.host, request->line.port, serverfd);
+        return -1;
+    }
+
+    return serverfd;
 }
 
-void parse_uri(const char* uri, RequestLine* request_line) {
-    // According to HTTP/1.0 Protocal
-    // https://datatracker.ietf.org/doc/html/rfc1945#section-5.1,
-    // if method is GET, and proxy used, then the request line will be
-    //     GET SP Request-URI SP HTTP/1.0 CLRF
-    //     the Request-URI should be absoluteURI:
-    //         http://www.xxx.com[:port][/path]
-    // According to HTTP/1.1 Protocol 
-    // https://datatracker.ietf.org/doc/html/rfc2616#page-36,
-    // if method is GET, then the request line will be
-    //     GET SP /abs/path SP HTTP/1.1 CLRF, followed by
-    //     Host: SP http://www.xxxx.com:port CLRF
-    // According to HTTP/1.1 Protocol 
-    // https://datatracker.ietf.org/doc/html/rfc2616#page-36,
-    // if method is CONNECT, the request is made to a proxy,
-    // then the request line will be
-    //     CONNECT SP Request-URI SP HTTP/1.1 CLRF
-    //     the Request-URI will be absoluteURI:
-    //         http://www.xxx.com[:port][/path]
-
-    // We'll assume the proxy to be absoluteURI as request is sent to the proxy
-    // if (strcasecmp(request_line->method, "CONNECT") == 0) {
-    //     strcpy(request_line->method, "GET");
-    // }
-
-    strcpy(request_line->port, "80");
-
-    // const char* https_prefix = "https://";
-    // if (strncmp(uri, https_prefix, strlen(https_prefix)) == 0) {
-    //     strcpy(request_line->port, "443");
-    // }
-
-    const char* p = strstr(uri, "://");
-    p = (p ? p + 3 : uri);
-    int host_pos = 0, port_pos = 0, path_pos = 0;
-    int port_detected = 0, path_detected = 0;
-
-    for (char c = *p; c != '\0'; c = *++p) {
-        if (path_detected) {
-            request_line->path[path_pos++] = c;
-        } else if (port_detected) {
-            if (c == '/') {
-                path_detected = 1;
-                request_line->path[path_pos++] = c;
-            } else {
-                request_line->port[port_pos++] = c;
-            }
+/* send the cached response if it is still fresh, or the ranges of it the
+   request asks for, returns 0 on a miss, persistent tells if the client
+   connection can carry another request, stale gets the pinned object if it
+   expired but can be revalidated */
+int backward_response_from_cache(int clientfd, const Request* request, const char* key,
+                                 unsigned int hash, int* persistent, CacheObject** stale) {
+    *stale = NULL;
+    CacheObject* object = cache_lookup(key, hash);
+    if (object == NULL) {
+        return 0;
+    }
+
+    if (!is_fresh(object, time(NULL))) {
+        if (object->freshness.etag[0] != '\0' || object->freshness.last_modified[0] != '\0') {
+            *stale = object;
         } else {
-            if (c == '/') {
-                path_detected = 1;
-                request_line->path[path_pos++] = c;
-            } else if (c == ':') {
-                port_detected = 1;
-            } else {
-                request_line->host[host_pos++] = c;
-            }
+            cache_release(object);
         }
+        return 0;
     }
 
-    request_line->host[host_pos] = '\0';
+    stats_count(STATS_MEMORY_HITS, 1);
+    stats_first_byte();
 
-    if (port_detected) {
-        request_line->port[port_pos] = '\0';
+    /* send data to the client without holding any lock */
+    *persistent = 0;
+    int sent = object->size;
+    if (!send_range(clientfd, request, object->chain, NULL, object->size, &sent) &&
+        object->size != chain_writen(clientfd, object->chain, 0, object->size)) {
+        sent = -1;
     }
-
-    if (path_pos == 0) {
-        request_line->path[path_pos++] = '/';
+    if (sent < 0) {
+        log_warn("Proxy write data to client failure");
+    } else {
+        *persistent = is_persistent_response(object->chain, object->size);
+        stats_count(STATS_BYTES_MEMORY, sent);
     }
-    request_line->path[path_pos] = '\0';
-}
 
-void status_message(enum StatusCode code, char* buf, int maxlen) {
-    char message[32];
-    switch (code) {
-        case OK:                  strcpy(message, "OK");                    break;
-        case Created:             strcpy(message, "Created");               break;
-        case Accepted:            strcpy(message, "Accepted");              break;
-        case NoContent:           strcpy(message, "No Content");            break;
-        case MovedPermanently:    strcpy(message, "Moved Permanently");     break;
-        case MovedTemporarily:    strcpy(message, "Moved Temporarily");     break;
-        case NotModified:         strcpy(message, "Not Modified");          break;
-        case BadRequest:          strcpy(message, "Bad Request");           break;
-        case Unauthorized:        strcpy(message, "Unauthorized");          break;
-        case Forbidden:           strcpy(message, "Forbidden");             break;
-        case NotFound:            strcpy(message, "Not Found");             break;
-        case InternalServerError: strcpy(message, "Internal Server Error"); break;
-        case NotImplemented:      strcpy(message, "Not Implemented");       break;
-        case BadGateway:          strcpy(message, "Bad Gateway");           break;
-        case ServiceUnavailable:  strcpy(message, "Service Unavailable");   break;
-        default:                  strcpy(message, "Unknown");               break;
-    }
-
-    int message_len = strlen(message);
-    if (message_len + 1 > maxlen) {
-        message_len = maxlen - 1;
-    }
-
-    memcpy(buf, message, message_len);
-    buf[message_len] = '\0';
+    cache_release(object);
+
+    return 1;
 }
 
-void proxy_error(int connfd, enum StatusCode code, const char* details) {
-    char buf[MAXLINE];
+/* send a fresh response another worker cached, it is copied into the
+   memory cache first, returns 0 on a miss, like backward_response_from_cache */
+int backward_response_from_shared(int clientfd, const Request* request, const char* key,
+                                  unsigned int hash, int* persistent) {
+    CacheObject* object = shared_lookup(key, hash);
+    if (object == NULL) {
+        return 0;
+    }
 
-    const char* err_template = 
-        "<html>\r\n"
-        "<head>\r\n"
-        "  <title>Proxy Error</title>\r\n"
-        "</head>\r\n"
-        "<body>\r\n"
-        "  <h1>HTTP Status %d - %s</h1>\r\n"
-        "  <p>%s</p>\r\n"
-        "</body>\r\n"
-        "</html>\r\n";
-
-    char message[32];
-    status_message(code, message, sizeof(message));
-
-    /* HTTP response header */
-    sprintf(buf, "HTTP/1.0 %d %s\r\n", code, message);
-    rio_writen(connfd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n\r\n");
-    rio_writen(connfd, buf, strlen(buf));
-
-    /* HTTP response body */
-    sprintf(buf, err_template, code, message, details);
-    rio_writen(connfd, buf, strlen(buf));
-}
+    stats_count(STATS_SHARED_HITS, 1);
+    stats_first_byte();
 
-int parse_request(int clientfd, Request* request) {
-    rio_t rio;
-    char line[MAXLINE];
-    char err_message[MAXLINE];
+    *persistent = 0;
+    int sent = object->size;
+    if (!send_range(clientfd, request, object->chain, NULL, object->size, &sent) &&
+        object->size != chain_writen(clientfd, object->chain, 0, object->size)) {
+        sent = -1;
+    }
+    if (sent < 0) {
+        log_warn("Proxy write data to client failure");
+    } else {
+        *persistent = is_persistent_response(object->chain, object->size);
+        stats_count(STATS_BYTES_MEMORY, sent);
+    }
 
-    Rio_readinitb(&rio, clientfd);
-    /* 1. receive request from client */
-    /* 1.1 read the request line: Method URI HTTP/version */
-    int rc = rio_readlineb(&rio, line, MAXLINE);
-    if (rc == -1) { /* error */
-        sprintf(err_message, "rio_readlineb: ");
-        int len = strlen(err_message);
-        strerror_r(errno, err_message + len, MAXLINE - len);
-        fprintf(stderr, "%s", err_message);
-        proxy_error(clientfd, InternalServerError, err_message);
-        return 0;
-    } else if (rc == 0) {  /* no data */
-        proxy_error(clientfd, NoContent, "No actual data received");
+    cache_release(object);
+
+    return 1;
+}
+
+/* send the response stored on disk straight from the segment file,
+   returns 0 on a miss, like backward_response_from_cache */
+int backward_response_from_disk(int clientfd, const Request* request, const char* key,
+                                unsigned int hash, int* persistent) {
+    DiskObject* object = disk_lookup(key, hash);
+    if (object == NULL) {
         return 0;
+    }
+
+    stats_count(STATS_DISK_HITS, 1);
+    stats_first_byte();
+
+    *persistent = 0;
+    int sent = object->size;
+    if (!send_range(clientfd, request, NULL, object, object->size, &sent) &&
+        object->size != disk_writen(clientfd, object, 0, object->size)) {
+        sent = -1;
+    }
+    if (sent < 0) {
+        log_warn("Proxy write data to client failure");
     } else {
-        if (rc == MAXLINE - 1) {
-            fprintf(stderr, "app error: line to long\n");
-            proxy_error(clientfd, BadRequest, "Request too long to handle");
-            return 0;
-        }
+        *persistent = object->persistent;
+        stats_count(STATS_BYTES_DISK, sent);
     }
 
-    /* 1.2 parse the request line */
-    char uri[MAXLINE];
-    if (sscanf(line, "%s %s %s", request->line.method, uri, request->line.version) != 3) {
-        sprintf(err_message, "invalid http request line: %s", line);
-        fprintf(stderr, "%s", err_message);
-        proxy_error(clientfd, BadRequest, err_message);
+    disk_release(object);
+
+    return 1;
+}
+
+/* answer a Range request from a cached response, in memory if chain isn't
+   NULL, else on disk, returns 0 if the whole response should go out
+   instead, otherwise sent gets the bytes sent, -1 if the client went away */
+int send_range(int clientfd, const Request* request, const ChunkChain* chain,
+               const DiskObject* disk, int size, int* sent) {
+    if (request->range < 0) {
         return 0;
     }
 
-    if (strcasecmp(request->line.method, "GET")) {
-        fprintf(stderr, "Proxy doesn't support %s\n", request->line.method);
-        proxy_error(clientfd, NotImplemented, "Proxy only support GET method");
+    char head[MAXBUF];
+    int head_len = (size < MAXBUF ? size : MAXBUF);
+    if (chain != NULL) {
+        chain_copy(chain, head, 0, head_len);
+    } else if (disk_read(disk, head, 0, head_len) != head_len) {
         return 0;
     }
 
-    if (strcasecmp(request->line.version, "HTTP/1.1") == 0) {
-        strcpy(request->line.version, "HTTP/1.0");
+    RangeReply reply;
+    if (!prepare_range(request, head, head_len, size, &reply)) {
+        return 0;
     }
 
-    parse_uri(uri, &request->line);
+    stats_count(STATS_RANGES, 1);
 
-    /* 1.3 parse request headers */
-    request->nheaders = 0;
-    while(Rio_readlineb(&rio, line, MAXLINE) > 0) {
-        /* end of request header */
-        if (strcmp(line, "\r\n") == 0) {
+    *sent = -1;
+    for (int i = 0; i < reply.nparts; ++i) {
+        const RangePart* part = &reply.parts[i];
+        int len = part->to - part->from;
+        if (part->text_len != rio_writen(clientfd, reply.buf + part->text, part->text_len) ||
+            (chain != NULL && len != chain_writen(clientfd, chain, part->from, part->to)) ||
+            (chain == NULL && len != disk_writen(clientfd, disk, part->from, part->to))) {
+            return 1;
+        }
+    }
+    *sent = reply.size;
+
+    return 1;
+}
+
+/* relay one response to the client, the leader of a flight also shares
+   it with followers, returns 1 if the whole
+   response arrived and the connection can carry another request, 0 if it
+   arrived but the server closes, -2 if the server stalled past its timeout,
+   -1 otherwise, received counts the bytes
+   read from the server; when revalidating a stale object, the head is held
+   back until its status is known, and a 304 renews the object instead of
+   being relayed, setting not_modified */
+int backward_response_from_server(int clientfd, int serverfd, Flight* flight,
+                                  int* received, CacheObject* stale, int* not_modified) {
+    ResponseParser parser;
+    init_response_parser(&parser);
+
+    char buf[MAXLINE];
+    int client_alive = 1;
+    int trailing = 0;
+    int sharing = (flight != NULL);
+    int holding = (stale != NULL);
+    int held = 0;
+    *received = 0;
+    *not_modified = 0;
+
+    /* a persistent connection never reaches EOF, so read no further than
+       the framing of the response says */
+    while (parser.state != RESPONSE_DONE) {
+        /* nobody else wants the rest of the body, move it to the client
+           without copying it through user space */
+        if (!sharing && client_alive &&
+            (parser.state == RESPONSE_BODY || parser.state == RESPONSE_UNTIL_CLOSE)) {
+            long len = (parser.state == RESPONSE_BODY ? parser.remaining : -1);
+            long n = splice_response(serverfd, clientfd, len);
+            if (n < 0) {
+                return n;
+            }
+            *received += n;
+            stats_count(STATS_BYTES_ORIGIN, n);
+            if (len < 0) {
+                return 0;
+            }
+            if (n < len) {
+                return -1;
+            }
+            parser.remaining = 0;
+            parser.state = RESPONSE_DONE;
             break;
         }
 
-        strcpy(request->headers[request->nheaders++].content, line);
-        if (request->nheaders == MAX_HEADER_COUNT) {
-            fprintf(stderr, "app error: request headers to long, need code optimization\n");
-            proxy_error(clientfd, InternalServerError, "Proxy run out of memory for request headers");
-            return 0;
+        /* the leader reads straight into the flight, which is the copy the
+           followers and the cache get */
+        int room = 0;
+        char* tail = (sharing && !holding ? flight_tail(flight, &room) : NULL);
+        char* rbuf = (room > 0 ? tail : buf + held);
+        int rlen = (room > 0 ? room : MAXLINE - held);
+
+        int n = read(serverfd, rbuf, rlen);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                log_warn("Proxy timed out reading from server");
+                return -2;
+            }
+            log_warn("Proxy read data from server failure");
+            return -1;
+        }
+
+        if (n == 0) {
+            /* only a response without length ends with the connection */
+            return (parser.state == RESPONSE_UNTIL_CLOSE ? 0 : -1);
+        }
+
+        log_debug("Receive %d bytes from server", n);
+
+        /* the response started, the rest must only keep coming */
+        if (*received == 0) {
+            upstream_await(serverfd, 0);
+        }
+        *received += n;
+        int len = parse_response(&parser, rbuf, n);
+        if (len < 0) {
+            log_warn("Proxy malformed response from server");
+            return -1;
+        }
+
+        if (holding) {
+            if (parser.state == RESPONSE_HEAD) {
+                held += n;
+                if (held == MAXLINE) {
+                    log_warn("Proxy response head too long");
+                    return -1;
+                }
+                continue;
+            }
+            holding = 0;
+
+            if (parser.status == NotModified) {
+                Freshness freshness;
+                response_freshness(&parser, time(NULL), &freshness);
+                cache_renew(stale, &freshness);
+                shared_store(stale);
+                *not_modified = 1;
+                return (parser.keep_alive && len == n);
+            }
+
+            /* the object changed, relay the held head like a miss */
+            rbuf = buf;
+            n += held;
+            len += held;
+        }
+
+        /* the server sent more than one response, drop the rest */
+        trailing = (len < n);
+
+        /* a body too large to cache, or a response the head says not to
+           cache, isn't worth sharing, the followers fetch it themselves,
+           decided before they see a byte so none is cut off midway */
+        if (sharing && parser.state != RESPONSE_HEAD && !flight->cacheable) {
+            flight->cacheable = (parser.content_length <= MAX_OBJECT_SIZE &&
+                                 response_freshness(&parser, time(NULL), &flight->freshness));
+            if (!flight->cacheable) {
+                flight_finish(flight, FLIGHT_ABANDONED);
+            }
+        }
+
+        /* share the bytes with followers before our own client write,
+           a partial head stays with the leader until the decision */
+        sharing = (sharing &&
+                   flight_append(flight, rbuf, len, parser.state != RESPONSE_HEAD));
+
+        if (client_alive) {
+            stats_first_byte();
+            if (len != rio_writen(clientfd, rbuf, len)) {
+                log_warn("Proxy write data to client failure");
+                client_alive = 0;
+            } else {
+                stats_count(STATS_BYTES_ORIGIN, len);
+            }
+        }
+
+        /* keep receiving for the followers even if our client is gone */
+        if (!client_alive && !sharing) {
+            return -1;
         }
     }
 
-    return 1;
+    return (parser.keep_alive && !trailing);
 }
 
-int generate_key(RequestLine* request_line, char* key, int maxlen) {
-    /* host */ 
-    char* p = request_line->host;
-    for (char ch = *p; ch != '\0'; ch = *++p) {
-        if (--maxlen <= 0) {
-            return 0;
+/* move len bytes, or everything until EOF if len < 0, from the server to
+   the client through the pipe of the thread, returns the bytes moved, -2
+   if the server stalled past its timeout or -1 on another error */
+long splice_response(int serverfd, int clientfd, long len) {
+    int* pipefd = splice_pipe;
+    if (pipefd[0] < 0) {
+        if (pipe2(pipefd, O_CLOEXEC) < 0) {
+            log_error("pipe2 error: %s", strerror(errno));
+            pipefd[0] = pipefd[1] = -1;
+            return -1;
         }
 
-        *(key++) = ch;
+        /* a larger pipe means fewer round trips, the default still works */
+        if (fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_SIZE) < 0) {
+            log_warn("F_SETPIPE_SZ error: %s", strerror(errno));
+        }
     }
 
-    /* path */
-    p = request_line->path;
-    for (char ch = *p; ch != '\0'; ch = *++p) {
-        if (--maxlen <= 0) {
-            return 0;
+    long moved = 0;
+    while (len < 0 || moved < len) {
+        long size = (len < 0 || len - moved > SPLICE_SIZE ? SPLICE_SIZE : len - moved);
+        ssize_t n = splice(serverfd, NULL, pipefd[1], NULL, size, SPLICE_F_MOVE);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                log_warn("Proxy timed out reading from server");
+                moved = -2;
+                break;
+            }
+            log_warn("Proxy read data from server failure");
+            moved = -1;
+            break;
         }
 
-        *(key++) = ch;
-    }
+        if (n == 0) {
+            break;
+        }
 
-    *key = '\0';
+        /* drain the pipe before filling it again, without SPLICE_F_MORE,
+           which would hold back the last bytes the client waits for */
+        ssize_t left = n;
+        while (left > 0) {
+            ssize_t m = splice(pipefd[0], NULL, clientfd, NULL, left, SPLICE_F_MOVE);
+            if (m < 0 && errno == EINTR) {
+                continue;
+            }
+            if (m <= 0) {
+                log_warn("Proxy write data to client failure");
+                break;
+            }
+            left -= m;
+        }
+        if (left > 0) {
+            moved = -1;
+            break;
+        }
 
-    return 1;
-}
+        moved += n;
+    }
 
-int is_least_recently(const timeval_t* t1, const timeval_t* t2) {
-    if ((t1->tv_sec < t2->tv_sec) || 
-        ((t1->tv_sec == t2->tv_sec) && (t1->tv_usec < t2->tv_usec))) {
-        return 1;
-    } else {
-        return 0;
+    /* bytes left in the pipe would go to the next client */
+    if (moved < 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        pipefd[0] = pipefd[1] = -1;
     }
+
+    log_debug("splice_response: %ld bytes", moved);
+
+    return moved;
 }
 
-int forward_request(int clientfd, Request* request) {
-    char new_request[MAXBUF];
-    sprintf(new_request, "%s %s %s\r\n", 
-            request->line.method, request->line.path, request->line.version);
-    strcat(new_request, "Host: ");
-    strcat(new_request, request->line.host);
-    strcat(new_request, ":");
-    strcat(new_request, request->line.port);
-    strcat(new_request, "\r\n");
-    strcat(new_request, "Connection: close\r\n");
-    strcat(new_request, "Proxy-Connection: close\r\n");
-
-    int find_user_agent_hdr = 0;
-    for (int i = 0; i < request->nheaders; ++i) {
-        char* content = request->headers[i].content;
-        /* filter some fields */
-        if (strcasestr(content, "Host:") ||
-            strcasestr(content, "Connection:") || 
-            strcasestr(content, "Proxy-Connection:")) {
+/* fetch the response from the server and relay it, a pooled connection the
+   server closed before answering is retried on another one, but not one
+   that timed out, the leader of a flight publishes the outcome, returns the
+   outcome of the last relay; the leader may revalidate the stale object it
+   pinned, whose pin it takes over */
+int fetch_response(int clientfd, Request* request, Flight* flight, CacheObject* stale) {
+    int reused, received, not_modified = 0;
+    int serverfd, rc;
+
+    request->stale = (stale != NULL ? &stale->freshness : NULL);
+
+    do {
+        serverfd = forward_request(clientfd, request, &reused);
+        if (serverfd < 0) {
+            rc = -1;
+            received = 0;
             continue;
         }
 
-        if (strcasestr(content, "User-Agent:")) {
-            find_user_agent_hdr = 1;
+        rc = backward_response_from_server(clientfd, serverfd, flight, &received,
+                                           stale, &not_modified);
+        if (rc > 0) {
+            upstream_release(request->line.host, request->line.port, serverfd);
+        } else {
+            upstream_close(request->line.host, request->line.port, serverfd);
         }
+    } while (rc == -1 && received == 0 && reused);
 
-        /* fill in the fields */
-        strcat(new_request, content);
+    /* a server that never answered gets the client a fast 504 */
+    if (rc == -2) {
+        stats_count(STATS_ORIGIN_TIMEOUTS, 1);
+        if (received == 0) {
+            proxy_error(clientfd, GatewayTimeout, "Proxy timed out waiting for server");
+        }
     }
 
-    if (!find_user_agent_hdr) {
-        strcat(new_request, user_agent_hdr);
+    if (not_modified) {
+        return send_renewed(clientfd, flight, stale);
+    }
+    if (stale != NULL) {
+        cache_release(stale);
     }
 
-    strcat(new_request, "\r\n");
+    if (flight != NULL && flight->state == FLIGHT_RUNNING) {
+        if (rc >= 0) {
+            flight_finish(flight, FLIGHT_DONE);
+        } else {
+            flight_finish(flight, FLIGHT_FAILED);
+        }
+    }
 
-#ifdef VERBOSE
-    printf("\nNew request:\n%s", new_request);
-#endif
+    return rc;
+}
 
-    /* 2 forward request to server */
-    /* 2.1 establish connection to server */
-    int serverfd = open_clientfd(request->line.host, request->line.port);
-    if (serverfd < 0) {
-        proxy_error(clientfd, BadGateway, "Proxy cannot connect to server");
-        return -1;
+/* the server renewed the stale object, the followers and our client get
+   it from the cache, returns 1 if the client connection can carry another
+   request, 0 if not, -1 if the client went away */
+int send_renewed(int clientfd, Flight* flight, CacheObject* object) {
+    if (flight != NULL) {
+        flight->object = object;
+        flight_finish(flight, FLIGHT_NOT_MODIFIED);
     }
 
-#ifdef VERBOSE
-    printf("Establish connection to (%s, %s)\n", request->line.host, request->line.port);
-#endif
+    stats_count(STATS_REVALIDATED, 1);
+    stats_first_byte();
 
-    /* 2.2 forward request header */
-    int len = strlen(new_request);
-    int rc = rio_writen(serverfd, new_request, strlen(new_request));
-    if (rc != len) {
-        proxy_error(clientfd, BadGateway, "Proxy forward header failure");
-        close(serverfd);
-        return -1;
+    int rc = 1;
+    if (object->size != chain_writen(clientfd, object->chain, 0, object->size)) {
+        log_warn("Proxy write data to client failure");
+        rc = -1;
+    } else if (!is_persistent_response(object->chain, object->size)) {
+        rc = 0;
+    }
+    if (rc >= 0) {
+        stats_count(STATS_BYTES_MEMORY, object->size);
     }
 
-    return serverfd;
-}
+    if (flight == NULL) {
+        cache_release(object);
+    }
 
-int backward_response_from_cache(int clientfd, const char* key) {
-    return read_cache(clientfd, key);
+    return rc;
 }
 
-int backward_response_from_server(int clientfd, int serverfd, const char* key) {
-    rio_t rio;
-    rio_readinitb(&rio, serverfd);
+/* stream the bytes of the leader as they arrive, returns 1 if the whole
+   response was sent, otherwise sent tells how many bytes the client got */
+int backward_response_from_flight(int clientfd, Flight* flight, int* sent) {
+    enum FlightState state = FLIGHT_RUNNING;
+    int pos = 0;
 
-    char buf[MAXLINE];
-    char object_buf[MAX_OBJECT_SIZE];
-    int n, total = 0;
-    int success = 1;
-
-    while ((n = rio_readnb(&rio, buf, MAXLINE))) {
-#ifdef VERBOSE
-        printf("Receive %d btyes from server\n", n);
-#endif
-
-        if (n == -1) {
-            fprintf(stderr, "Proxy read data from server failure\n");
-            success = 0;
+    while (1) {
+        int size = flight_wait(flight, pos, &state);
+        if (size > pos) {
+            stats_first_byte();
+            if (size - pos != chain_writen(clientfd, flight->chain, pos, size)) {
+                log_warn("Proxy write data to client failure");
+                *sent = -1;
+                return 0;
+            }
+            stats_count(STATS_BYTES_ORIGIN, size - pos);
+            pos = size;
+        } else if (state != FLIGHT_RUNNING) {
             break;
         }
+    }
 
-        if (n != rio_writen(clientfd, buf, n)){
-            fprintf(stderr, "Proxy write data to client failure\n");
-            success = 0;
-            break;
+    /* the leader only renewed the cached object, send that */
+    if (state == FLIGHT_NOT_MODIFIED) {
+        CacheObject* object = flight->object;
+        stats_first_byte();
+        if (object->size != chain_writen(clientfd, object->chain, 0, object->size)) {
+            log_warn("Proxy write data to client failure");
+            *sent = -1;
+            return 0;
         }
+        stats_count(STATS_BYTES_MEMORY, object->size);
+        pos = object->size;
+    }
 
-        if (total <= MAX_OBJECT_SIZE) {
-            memcpy(object_buf + total, buf, n);
-        }
+    log_debug("backward_response_from_flight: %d bytes, state %d", pos, state);
+
+    *sent = pos;
+    return (state == FLIGHT_DONE || state == FLIGHT_NOT_MODIFIED);
+}
 
-        total += n;
+/* connect to the server of a CONNECT and relay both ways, until both sides
+   are done or the tunnel stays idle for TUNNEL_IDLE_TIMEOUT seconds */
+void tunnel_client(int clientfd, rio_t* rio, Request* request) {
+    long start = stats_now();
+    int serverfd = open_serverfd(request->line.host, request->line.port,
+                                 upstream_limits.connect_timeout);
+    if (serverfd == SERVER_TIMEOUT) {
+        stats_count(STATS_ORIGIN_TIMEOUTS, 1);
+        proxy_error(clientfd, GatewayTimeout, "Proxy timed out connecting to server");
+        return;
+    } else if (serverfd < 0) {
+        proxy_error(clientfd, BadGateway, "Proxy cannot connect to server");
+        return;
+    }
+    stats_count(STATS_ORIGIN_CONNECTS, 1);
+    stats_record(STATS_CONNECT, stats_now() - start);
+
+    log_debug("Tunnel to (%s, %s)", request->line.host, request->line.port);
+
+    /* the client may have sent bytes past its head, they wait in rio */
+    Tunnel* tunnel = new_tunnel();
+    if (!open_tunnel(tunnel, clientfd, serverfd) ||
+        !tunnel_preload(tunnel, TUNNEL_UP, rio->rio_bufptr, rio->rio_cnt) ||
+        !tunnel_preload(tunnel, TUNNEL_DOWN, TUNNEL_ESTABLISHED, strlen(TUNNEL_ESTABLISHED))) {
+        proxy_error(clientfd, InternalServerError, "Proxy cannot open tunnel");
+        free_tunnel(tunnel);
+        close(serverfd);
+        return;
     }
 
-    if (total <= MAX_OBJECT_SIZE) {
-        write_cache(object_buf, total, key);
+    struct pollfd fds[2] = { { clientfd, 0, 0 }, { serverfd, 0, 0 } };
+    int events[2];
+    while (pump_tunnel(tunnel, &events[0], &events[1]) > 0) {
+        for (int i = 0; i < 2; ++i) {
+            fds[i].fd = (tunnel_done(tunnel, i) ? -1 : tunnel->fds[i]);
+            fds[i].events = events[i];
+        }
+        int n = poll(fds, 2, TUNNEL_IDLE_TIMEOUT * 1000);
+        if (n == 0 || (n < 0 && errno != EINTR)) {
+            break;
+        }
     }
 
-    return success;
+    free_tunnel(tunnel);
+    close(serverfd);
 }
 
 void* proxy_routine(void* argp) {
-    int clientfd = *(int*)argp;
-    free(argp);
+    Pthread_detach(pthread_self());
+
+    /* a request is too large for the stack, reuse one per worker */
+    Request* request = new_request();
+
+    while (1) {
+        int clientfd = sbuf_remove(&sbuf);
+        serve_client(clientfd, request);
+        close(clientfd);
+    }
+
+    return NULL;
+}
 
-    /* detach the thread */
-    if (pthread_detach(pthread_self()) != 0) {
-        fprintf(stderr, "pthread_detach error");
-        proxy_error(clientfd, InternalServerError, "pthread_detach error");
-        goto CLEAN_UP;
+/* serve the requests of a client one after another, pipelined requests
+   wait in the rio buffer, so the responses go out in order */
+void serve_client(int clientfd, Request* request) {
+    rio_t rio;
+    Rio_readinitb(&rio, clientfd);
+
+    /* an idle persistent client must not hold the worker forever, nor one
+       that stops reading its response */
+    struct timeval timeout = { CLIENT_IDLE_TIMEOUT, 0 };
+    int stall = upstream_limits.stall_timeout;
+    struct timeval send_timeout = { stall / 1000, (stall % 1000) * 1000 };
+    if (setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+        setsockopt(clientfd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout)) < 0) {
+        log_error("setsockopt error: %s", strerror(errno));
     }
 
+    stats_count(STATS_CONNECTIONS, 1);
+    stats_count(STATS_ACTIVE_CONNECTIONS, 1);
+
+    int first = 1;
+    int more;
+    do {
+        more = handle_client(clientfd, &rio, request, first);
+        stats_request_end();
+        first = 0;
+    } while (more);
+
+    stats_count(STATS_ACTIVE_CONNECTIONS, -1);
+}
+
+/* handle one request, returns 1 if the connection can carry another one */
+int handle_client(int clientfd, rio_t* rio, Request* request, int first) {
     /* parse request line */
-    Request request;
-    if (!parse_request(clientfd, &request)) {
-        goto CLEAN_UP;
+    if (!parse_request(clientfd, rio, request, first)) {
+        return 0;
     }
 
+    /* the proxy answers the stats path itself, whatever the host */
+    if (strcmp(request->line.path, STATS_PATH) == 0) {
+        char buf[MAXBUF];
+        int len = format_stats(buf, sizeof(buf));
+        if (len != rio_writen(clientfd, buf, len)) {
+            log_warn("Proxy write data to client failure");
+        }
+        return 0;
+    }
+
+    /* a tunnel holds the worker until both sides are done */
+    if (request->tunnel) {
+        tunnel_client(clientfd, rio, request);
+        return 0;
+    }
+
+    stats_request_begin();
+
     /* generate key */
     char key[MAXLINE];
-    if (!generate_key(&request.line, key, sizeof(key))) {
-        fprintf(stderr, "generate_key error");
+    if (!generate_key(&request->line, key, sizeof(key))) {
+        log_error("generate_key error");
         proxy_error(clientfd, InternalServerError, "generate_key error");
-        goto CLEAN_UP;
+        return 0;
     }
 
-    /* search cache for response */
-    if (backward_response_from_cache(clientfd, key)) {
-        goto CLEAN_UP;
+    /* hash the key once for both cache lookup and update */
+    unsigned int hash = hash_key(key);
+
+    /* search the caches for response, nearest first, a stale copy in
+       memory is newer than any on disk, but another worker may have
+       fetched a fresh one */
+    int persistent;
+    CacheObject* stale;
+    if (backward_response_from_cache(clientfd, request, key, hash, &persistent, &stale)) {
+        return request->keep_alive && persistent;
+    }
+    if (backward_response_from_shared(clientfd, request, key, hash, &persistent) ||
+        (stale == NULL && backward_response_from_disk(clientfd, request, key, hash, &persistent))) {
+        if (stale != NULL) {
+            cache_release(stale);
+        }
+        return request->keep_alive && persistent;
     }
 
-    /* forward request to the remote client */
-    int serverfd = forward_request(clientfd, &request);
-    if (serverfd >= 0) {
-        backward_response_from_server(clientfd, serverfd, key);
-        close(serverfd);
+    /* the server answers a range with a part of the object, which neither
+       the cache nor the followers of a flight could use */
+    if (request->range >= 0) {
+        if (stale != NULL) {
+            cache_release(stale);
+        }
+        stats_count(STATS_MISSES, 1);
+        return request->keep_alive && fetch_response(clientfd, request, NULL, NULL) > 0;
     }
 
-    printf("%s: %d\n", __func__, __LINE__);
+    /* join the fetch of the same object if another thread is on it */
+    int leader;
+    Flight* flight = flight_join(key, hash, &leader);
+    if (!leader) {
+        stats_count(STATS_COALESCED, 1);
+        if (stale != NULL) {
+            cache_release(stale);
+        }
 
-CLEAN_UP:
-    close(clientfd);
-    return NULL;
-}
\ No newline at end of file
+        int sent;
+        if (backward_response_from_flight(clientfd, flight, &sent) || sent < 0) {
+            const ChunkChain* chain = (flight->state == FLIGHT_NOT_MODIFIED ?
+                                       flight->object->chain : flight->chain);
+            persistent = (sent > 0 && is_persistent_response(chain, sent));
+            flight_release(flight);
+            return request->keep_alive && persistent;
+        }
+
+        /* the leader couldn't deliver the whole object, a new response could
+           differ from the part already sent, so only a client that got
+           nothing fetches it again, the others are cut off */
+        flight_release(flight);
+        if (sent > 0) {
+            return 0;
+        }
+        return request->keep_alive && fetch_response(clientfd, request, NULL, NULL) > 0;
+    }
+
+    /* forward request to the remote client */
+    stats_count(STATS_MISSES, 1);
+    persistent = (fetch_response(clientfd, request, flight, stale) > 0);
+    flight_release(flight);
+
+    return request->keep_alive && persistent;
+}
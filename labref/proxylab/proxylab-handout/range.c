@@ -0,0 +1,310 @@
+#include "range.h"
+
+/* a satisfiable range, both ends included, offsets in the body */
+typedef struct ByteRange {
+    long first;
+    long last;
+} ByteRange;
+
+static int parse_head(const char* head, int head_len, ResponseParser* parser);
+static int if_range_matches(const Request* request, const ResponseParser* parser);
+static int parse_ranges(const char* value, int len, long length, ByteRange* ranges);
+static int copy_head(RangeReply* reply, const char* head, int body, int status,
+                     int keep_type, char* content_type, int maxlen);
+static int format_part_header(char* buf, int maxlen, const char* content_type,
+                              const ByteRange* range, long length);
+static void add_part(RangeReply* reply, int text, int from, int to);
+static int append_text(RangeReply* reply, const char* format, ...);
+
+/* answer the Range header of the request from the cached response of size
+   bytes, whose first head_len bytes are in head, returns 0 if the whole
+   response should go out instead: the request has no Range, its If-Range
+   doesn't match, the range is malformed or the response isn't a plain 200 */
+int prepare_range(const Request* request, const char* head, int head_len, int size,
+                  RangeReply* reply) {
+    if (request->range < 0) {
+        return 0;
+    }
+
+    ResponseParser parser;
+    int body = parse_head(head, head_len, &parser);
+    if (body < 0 || parser.status != OK || parser.chunked) {
+        return 0;
+    }
+
+    long length = size - body;
+    if (parser.content_length >= 0 && parser.content_length != length) {
+        return 0;
+    }
+
+    if (request->if_range >= 0 && !if_range_matches(request, &parser)) {
+        return 0;
+    }
+
+    ByteRange ranges[MAX_RANGES];
+    const RequestHeader* header = &request->headers[request->range];
+    int nranges = parse_ranges(request->arena + header->value.offset, header->value.len,
+                               length, ranges);
+    if (nranges < 0) {
+        return 0;
+    }
+
+    char content_type[MAXLINE];
+    reply->status = (nranges > 0 ? PartialContent : RangeNotSatisfiable);
+    reply->nparts = 0;
+    reply->size = 0;
+    reply->len = 0;
+    if (!copy_head(reply, head, body, reply->status, nranges <= 1, content_type,
+                   sizeof(content_type))) {
+        return 0;
+    }
+
+    /* none of the ranges overlaps the body */
+    if (nranges == 0) {
+        if (!append_text(reply, "Content-Range: bytes */%ld\r\n"
+                                "Content-Length: 0\r\n\r\n", length)) {
+            return 0;
+        }
+        add_part(reply, 0, 0, 0);
+        return 1;
+    }
+
+    if (nranges == 1) {
+        if (!append_text(reply, "Content-Range: bytes %ld-%ld/%ld\r\n"
+                                "Content-Length: %ld\r\n\r\n",
+                         ranges[0].first, ranges[0].last, length,
+                         ranges[0].last - ranges[0].first + 1)) {
+            return 0;
+        }
+        add_part(reply, 0, body + ranges[0].first, body + ranges[0].last + 1);
+        return 1;
+    }
+
+    /* each range is a part of a multipart/byteranges body, the type of the
+       object moves to the header of each part */
+    long body_size = strlen("\r\n--" RANGE_BOUNDARY "--\r\n");
+    for (int i = 0; i < nranges; ++i) {
+        body_size += format_part_header(NULL, 0, content_type, &ranges[i], length) +
+                     ranges[i].last - ranges[i].first + 1;
+    }
+    if (!append_text(reply, "Content-Type: multipart/byteranges; boundary=%s\r\n"
+                            "Content-Length: %ld\r\n\r\n", RANGE_BOUNDARY, body_size)) {
+        return 0;
+    }
+    add_part(reply, 0, 0, 0);
+
+    for (int i = 0; i < nranges; ++i) {
+        int text = reply->len;
+        int n = format_part_header(reply->buf + text, RANGE_TEXT_SIZE - text, content_type,
+                                   &ranges[i], length);
+        if (n >= RANGE_TEXT_SIZE - text) {
+            return 0;
+        }
+        reply->len += n;
+        add_part(reply, text, body + ranges[i].first, body + ranges[i].last + 1);
+    }
+
+    int text = reply->len;
+    if (!append_text(reply, "\r\n--%s--\r\n", RANGE_BOUNDARY)) {
+        return 0;
+    }
+    add_part(reply, text, 0, 0);
+
+    return 1;
+}
+
+/* parse the head of the cached response, returns the offset of its body,
+   or -1 if the head isn't all in the head_len bytes */
+static int parse_head(const char* head, int head_len, ResponseParser* parser) {
+    init_response_parser(parser);
+
+    /* byte by byte, past its head the parser would take the body in too */
+    int pos = 0;
+    while (pos < head_len && parser->state == RESPONSE_HEAD) {
+        if (parse_response(parser, head + pos, 1) < 0) {
+            return -1;
+        }
+        pos++;
+    }
+
+    return (parser->state == RESPONSE_HEAD ? -1 : pos);
+}
+
+/* If-Range holds an entity tag or a date, either must be exactly the one
+   of the cached response, a weak tag never matches */
+static int if_range_matches(const Request* request, const ResponseParser* parser) {
+    const RequestHeader* header = &request->headers[request->if_range];
+    const char* value = request->arena + header->value.offset;
+    int len = header->value.len;
+
+    const char* validator = (value[0] == '"' ? parser->etag :
+                             strncmp(value, "W/", 2) == 0 ? "" : parser->last_modified);
+    return (len > 0 && strlen(validator) == len && strncmp(validator, value, len) == 0);
+}
+
+/* the ranges of a Range value that overlap a body of length bytes, clamped
+   to it, returns how many, or -1 if the value is malformed, isn't in bytes
+   or asks for more than MAX_RANGES, the whole object goes out then */
+static int parse_ranges(const char* value, int len, long length, ByteRange* ranges) {
+    char spec[MAXLINE];
+    if (len >= sizeof(spec) || len < 6 || strncasecmp(value, "bytes=", 6) != 0) {
+        return -1;
+    }
+    memcpy(spec, value + 6, len - 6);
+    spec[len - 6] = '\0';
+
+    int nranges = 0, count = 0;
+    char* saveptr;
+    for (char* p = strtok_r(spec, ",", &saveptr); p != NULL; p = strtok_r(NULL, ",", &saveptr)) {
+        p += strspn(p, " \t");
+        char* end = p + strlen(p);
+        while (end > p && (end[-1] == ' ' || end[-1] == '\t')) {
+            *--end = '\0';
+        }
+
+        /* empty elements of the list are allowed */
+        if (*p == '\0') {
+            continue;
+        }
+        if (++count > MAX_RANGES) {
+            return -1;
+        }
+
+        long first, last;
+        if (*p == '-') {
+            /* the last n bytes */
+            if (!isdigit(p[1])) {
+                return -1;
+            }
+            long n = strtol(p + 1, &end, 10);
+            if (*end != '\0') {
+                return -1;
+            }
+            if (n == 0 || length == 0) {
+                continue;
+            }
+            first = (n < length ? length - n : 0);
+            last = length - 1;
+        } else {
+            if (!isdigit(*p)) {
+                return -1;
+            }
+            first = strtol(p, &end, 10);
+            if (*end++ != '-') {
+                return -1;
+            }
+            last = length - 1;
+            if (*end != '\0') {
+                if (!isdigit(*end)) {
+                    return -1;
+                }
+                last = strtol(end, &end, 10);
+                if (*end != '\0' || last < first) {
+                    return -1;
+                }
+            }
+            if (first >= length) {
+                continue;
+            }
+            if (last >= length) {
+                last = length - 1;
+            }
+        }
+
+        ranges[nranges].first = first;
+        ranges[nranges].last = last;
+        nranges++;
+    }
+
+    return (count > 0 ? nranges : -1);
+}
+
+/* the status line and the headers of the cached head that still hold,
+   the framing ones go, and the type unless keep_type, it moves to the parts
+   of a multipart body, so it is copied out */
+static int copy_head(RangeReply* reply, const char* head, int body, int status,
+                     int keep_type, char* content_type, int maxlen) {
+    static const char* dropped[] = {
+        "Content-Length:", "Transfer-Encoding:", "Content-Range:",
+    };
+
+    char message[32];
+    status_message(status, message, sizeof(message));
+
+    /* keep the version of the cached response */
+    int version_len = strcspn(head, " \r\n");
+    if (!append_text(reply, "%.*s %d %s\r\n", version_len, head, status, message)) {
+        return 0;
+    }
+
+    strcpy(content_type, "application/octet-stream");
+
+    const char* line = memchr(head, '\n', body);
+    while (line != NULL && ++line < head + body) {
+        const char* eol = memchr(line, '\n', head + body - line);
+        int len = (eol != NULL ? eol + 1 - line : head + body - line);
+        if (line[0] == '\r' || line[0] == '\n') {
+            break;
+        }
+
+        int keep = 1;
+        for (int i = 0; i < sizeof(dropped) / sizeof(dropped[0]); ++i) {
+            if (strncasecmp(line, dropped[i], strlen(dropped[i])) == 0) {
+                keep = 0;
+            }
+        }
+
+        if (strncasecmp(line, "Content-Type:", 13) == 0) {
+            keep = keep_type;
+            const char* value = line + 13 + strspn(line + 13, " \t");
+            int value_len = strcspn(value, "\r\n");
+            if (value_len < maxlen) {
+                memcpy(content_type, value, value_len);
+                content_type[value_len] = '\0';
+            }
+        }
+
+        if (keep && !append_text(reply, "%.*s", len, line)) {
+            return 0;
+        }
+        line = eol;
+    }
+
+    return 1;
+}
+
+/* the delimiter and header before the data of a part, like snprintf */
+static int format_part_header(char* buf, int maxlen, const char* content_type,
+                              const ByteRange* range, long length) {
+    return snprintf(buf, maxlen, "\r\n--%s\r\n"
+                                 "Content-Type: %s\r\n"
+                                 "Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                    RANGE_BOUNDARY, content_type, range->first, range->last, length);
+}
+
+/* the text from offset text to the end of buf, then bytes [from, to) */
+static void add_part(RangeReply* reply, int text, int from, int to) {
+    RangePart* part = &reply->parts[reply->nparts++];
+    part->text = text;
+    part->text_len = reply->len - text;
+    part->from = from;
+    part->to = to;
+    reply->size += part->text_len + to - from;
+}
+
+/* returns 0 if the text doesn't fit */
+static int append_text(RangeReply* reply, const char* format, ...) {
+    int room = RANGE_TEXT_SIZE - reply->len;
+
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(reply->buf + reply->len, room, format, ap);
+    va_end(ap);
+
+    if (n < 0 || n >= room) {
+        return 0;
+    }
+    reply->len += n;
+
+    return 1;
+}
@@ -0,0 +1,41 @@
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+#include "csapp.h"
+#include "http.h"
+
+/* Ranges answered in one reply, a request asking for more gets the whole
+   object, and room for the text of a reply, heads and part headers */
+#define MAX_RANGES 8
+#define RANGE_TEXT_SIZE (MAXBUF + MAX_RANGES * 256)
+
+/* Separates the parts of a multipart/byteranges reply */
+#define RANGE_BOUNDARY "PROXY_BYTERANGES_5f3a9c1e7b20d864"
+
+/* text from the buffer of the reply, then bytes of the cached response */
+typedef struct RangePart {
+    int text;                     /* offset of the text in buf */
+    int text_len;
+    int from;                     /* bytes [from, to) of the cached response */
+    int to;
+} RangePart;
+
+/*
+ * The answer to a Range request built from a cached response, a 206 with
+ * one range or a multipart/byteranges body, or a 416. Its head keeps the
+ * headers of the cached one, so the client sees the same validators and
+ * the same connection handling.
+ */
+typedef struct RangeReply {
+    int status;                   /* PartialContent or RangeNotSatisfiable */
+    int nparts;
+    RangePart parts[MAX_RANGES + 2];  /* a multipart has a head and an end without data */
+    int size;                     /* bytes of the whole reply */
+    int len;                      /* bytes of buf */
+    char buf[RANGE_TEXT_SIZE];
+} RangeReply;
+
+int prepare_range(const Request* request, const char* head, int head_len, int size,
+                  RangeReply* reply);
+
+#endif /* __RANGE_H__ */
@@ -0,0 +1,337 @@
+#include <poll.h>
+#include "resolver.h"
+#include "cache.h"
+#include "log.h"
+
+typedef struct Resolver {
+    ResolverEntry* buckets[RESOLVER_BUCKET_COUNT];
+    int nentries;
+    ResolverEntry* pending_head;  /* entries waiting for a resolver thread */
+    ResolverEntry* pending_tail;
+    pthread_mutex_t mutex;        /* protect everything above and the entries */
+    pthread_cond_t pending;       /* signaled when an entry is queued */
+    pthread_cond_t resolved;      /* signaled when a lookup is done */
+} Resolver;
+
+static Resolver resolver;
+
+static void* resolver_routine(void* argp);
+static unsigned int hash_server(const char* host, const char* port);
+static ResolverEntry* find_entry(const char* host, const char* port, unsigned int hash);
+static ResolverEntry* new_entry(const char* host, const char* port, unsigned int hash);
+static void push_pending(ResolverEntry* entry);
+static void sweep_entries(time_t now);
+static void lookup(ResolverEntry* entry);
+static int connect_within(int fd, const ResolverAddr* addr, int timeout);
+static long now_ms();
+
+void init_resolver() {
+    pthread_t tid;
+
+    for (int i = 0; i < RESOLVER_BUCKET_COUNT; ++i) {
+        resolver.buckets[i] = NULL;
+    }
+    resolver.nentries = 0;
+    resolver.pending_head = resolver.pending_tail = NULL;
+
+    pthread_mutex_init(&resolver.mutex, NULL);
+    pthread_cond_init(&resolver.pending, NULL);
+    pthread_cond_init(&resolver.resolved, NULL);
+
+    for (int i = 0; i < RESOLVER_THREAD_COUNT; ++i) {
+        Pthread_create(&tid, NULL, resolver_routine, NULL);
+    }
+}
+
+/* copy the addresses of host:port into addrs, returns their count,
+   0 if the host can't be resolved */
+int resolve(const char* host, const char* port, ResolverAddr* addrs, int maxaddrs) {
+    unsigned int hash = hash_server(host, port);
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&resolver.mutex);
+
+    ResolverEntry* entry = find_entry(host, port, hash);
+    if (entry == NULL) {
+        entry = new_entry(host, port, hash);
+        push_pending(entry);
+    } else if (entry->state != RESOLVER_PENDING && now >= entry->expires) {
+        if (entry->state == RESOLVER_FAILED) {
+            /* nothing worth serving, look it up again and wait */
+            entry->state = RESOLVER_PENDING;
+            push_pending(entry);
+        } else if (!entry->refreshing) {
+            /* serve the stale addresses, refresh them in the background */
+            entry->refreshing = 1;
+            push_pending(entry);
+        }
+    }
+
+    /* a waited on entry is never swept */
+    entry->nwaiters++;
+    while (entry->state == RESOLVER_PENDING) {
+        pthread_cond_wait(&resolver.resolved, &resolver.mutex);
+    }
+    entry->nwaiters--;
+
+    int naddrs = 0;
+    if (entry->state == RESOLVER_RESOLVED) {
+        naddrs = (entry->naddrs < maxaddrs ? entry->naddrs : maxaddrs);
+        memcpy(addrs, entry->addrs, naddrs * sizeof(ResolverAddr));
+    }
+
+    pthread_mutex_unlock(&resolver.mutex);
+
+    return naddrs;
+}
+
+/* like open_clientfd, but through the resolver cache, and giving up after
+   timeout milliseconds across all the addresses, 0 for no limit, returns
+   SERVER_UNRESOLVED, SERVER_UNREACHABLE or SERVER_TIMEOUT on failure */
+int open_serverfd(const char* host, const char* port, int timeout) {
+    ResolverAddr addrs[RESOLVER_MAX_ADDRS];
+    int naddrs = resolve(host, port, addrs, RESOLVER_MAX_ADDRS);
+    if (naddrs == 0) {
+        return SERVER_UNRESOLVED;
+    }
+
+    long deadline = now_ms() + timeout;
+    int rc = SERVER_UNREACHABLE;
+    for (int i = 0; i < naddrs; ++i) {
+        int left = (int)(deadline - now_ms());
+        if (timeout > 0 && left <= 0) {
+            return SERVER_TIMEOUT;
+        }
+
+        int fd = socket(addrs[i].family, addrs[i].socktype, addrs[i].protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        rc = connect_within(fd, &addrs[i], timeout > 0 ? left : -1);
+        if (rc == 0) {
+            return fd;
+        }
+        close(fd);
+    }
+
+    return rc;
+}
+
+void deinit_resolver() {
+    for (int i = 0; i < RESOLVER_BUCKET_COUNT; ++i) {
+        while (resolver.buckets[i] != NULL) {
+            ResolverEntry* entry = resolver.buckets[i];
+            resolver.buckets[i] = entry->next;
+            free(entry->host);
+            free(entry->port);
+            free(entry);
+        }
+    }
+    resolver.nentries = 0;
+
+    pthread_mutex_destroy(&resolver.mutex);
+    pthread_cond_destroy(&resolver.pending);
+    pthread_cond_destroy(&resolver.resolved);
+}
+
+static void* resolver_routine(void* argp) {
+    Pthread_detach(pthread_self());
+
+    pthread_mutex_lock(&resolver.mutex);
+    while (1) {
+        while (resolver.pending_head == NULL) {
+            pthread_cond_wait(&resolver.pending, &resolver.mutex);
+        }
+
+        ResolverEntry* entry = resolver.pending_head;
+        resolver.pending_head = entry->next_pending;
+        if (resolver.pending_head == NULL) {
+            resolver.pending_tail = NULL;
+        }
+
+        /* pending and refreshing entries are never swept,
+           so the entry outlives the unlocked lookup */
+        pthread_mutex_unlock(&resolver.mutex);
+        lookup(entry);
+        pthread_mutex_lock(&resolver.mutex);
+
+        pthread_cond_broadcast(&resolver.resolved);
+    }
+
+    return NULL;
+}
+
+static unsigned int hash_server(const char* host, const char* port) {
+    char server[MAXLINE];
+    snprintf(server, sizeof(server), "%s:%s", host, port);
+    return hash_key(server);
+}
+
+/* caller holds the mutex */
+static ResolverEntry* find_entry(const char* host, const char* port, unsigned int hash) {
+    ResolverEntry* entry = resolver.buckets[hash % RESOLVER_BUCKET_COUNT];
+    while (entry != NULL) {
+        if (entry->hash == hash && strcmp(entry->host, host) == 0 &&
+            strcmp(entry->port, port) == 0) {
+            break;
+        }
+        entry = entry->next;
+    }
+
+    return entry;
+}
+
+/* add a pending entry, caller holds the mutex */
+static ResolverEntry* new_entry(const char* host, const char* port, unsigned int hash) {
+    if (resolver.nentries >= RESOLVER_MAX_ENTRIES) {
+        sweep_entries(time(NULL));
+    }
+
+    ResolverEntry* entry = Malloc(sizeof(ResolverEntry));
+    entry->host = Malloc(strlen(host) + 1);
+    strcpy(entry->host, host);
+    entry->port = Malloc(strlen(port) + 1);
+    strcpy(entry->port, port);
+    entry->hash = hash;
+    entry->state = RESOLVER_PENDING;
+    entry->refreshing = 0;
+    entry->nwaiters = 0;
+    entry->expires = 0;
+    entry->naddrs = 0;
+
+    int bucket = hash % RESOLVER_BUCKET_COUNT;
+    entry->next = resolver.buckets[bucket];
+    resolver.buckets[bucket] = entry;
+    resolver.nentries++;
+
+    return entry;
+}
+
+/* queue the entry for the resolver threads, caller holds the mutex */
+static void push_pending(ResolverEntry* entry) {
+    entry->next_pending = NULL;
+    if (resolver.pending_tail != NULL) {
+        resolver.pending_tail->next_pending = entry;
+    } else {
+        resolver.pending_head = entry;
+    }
+    resolver.pending_tail = entry;
+
+    pthread_cond_signal(&resolver.pending);
+}
+
+/* drop the expired entries, or every idle one if none expired,
+   caller holds the mutex */
+static void sweep_entries(time_t now) {
+    int nswept = 0;
+
+    for (int pass = 0; pass < 2 && nswept == 0; ++pass) {
+        for (int i = 0; i < RESOLVER_BUCKET_COUNT; ++i) {
+            ResolverEntry** link = &resolver.buckets[i];
+            while (*link != NULL) {
+                ResolverEntry* entry = *link;
+                int idle = (entry->state != RESOLVER_PENDING && !entry->refreshing &&
+                            entry->nwaiters == 0);
+                if (!idle || (pass == 0 && now < entry->expires)) {
+                    link = &entry->next;
+                    continue;
+                }
+
+                *link = entry->next;
+                free(entry->host);
+                free(entry->port);
+                free(entry);
+                resolver.nentries--;
+                nswept++;
+            }
+        }
+    }
+
+    log_debug("sweep_entries: %d entries swept", nswept);
+}
+
+/* resolve the entry without holding the mutex, then publish the result */
+static void lookup(ResolverEntry* entry) {
+    struct addrinfo hints, *listp, *p;
+    ResolverAddr addrs[RESOLVER_MAX_ADDRS];
+    int naddrs = 0;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    int rc = getaddrinfo(entry->host, entry->port, &hints, &listp);
+    if (rc != 0) {
+        log_warn("getaddrinfo failed (%s:%s): %s",
+                 entry->host, entry->port, gai_strerror(rc));
+    } else {
+        for (p = listp; p != NULL && naddrs < RESOLVER_MAX_ADDRS; p = p->ai_next) {
+            addrs[naddrs].family = p->ai_family;
+            addrs[naddrs].socktype = p->ai_socktype;
+            addrs[naddrs].protocol = p->ai_protocol;
+            addrs[naddrs].addrlen = p->ai_addrlen;
+            memcpy(&addrs[naddrs].addr, p->ai_addr, p->ai_addrlen);
+            naddrs++;
+        }
+        freeaddrinfo(listp);
+    }
+
+    pthread_mutex_lock(&resolver.mutex);
+
+    if (naddrs > 0) {
+        memcpy(entry->addrs, addrs, naddrs * sizeof(ResolverAddr));
+        entry->naddrs = naddrs;
+        entry->state = RESOLVER_RESOLVED;
+        entry->expires = time(NULL) + RESOLVER_TTL;
+    } else if (!entry->refreshing) {
+        entry->state = RESOLVER_FAILED;
+        entry->expires = time(NULL) + RESOLVER_NEGATIVE_TTL;
+    } else {
+        /* a failed refresh keeps the last good addresses a while longer */
+        entry->expires = time(NULL) + RESOLVER_NEGATIVE_TTL;
+    }
+    entry->refreshing = 0;
+
+    pthread_mutex_unlock(&resolver.mutex);
+}
+
+/* connect without blocking and wait at most timeout milliseconds, -1 for
+   as long as the kernel tries, the socket is blocking again on success */
+static int connect_within(int fd, const ResolverAddr* addr, int timeout) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return SERVER_UNREACHABLE;
+    }
+
+    if (connect(fd, (struct sockaddr*)&addr->addr, addr->addrlen) < 0) {
+        if (errno != EINPROGRESS) {
+            return SERVER_UNREACHABLE;
+        }
+
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        int n;
+        while ((n = poll(&pfd, 1, timeout)) < 0 && errno == EINTR) {
+        }
+        if (n == 0) {
+            return SERVER_TIMEOUT;
+        }
+
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (n < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+            return SERVER_UNREACHABLE;
+        }
+    }
+
+    if (fcntl(fd, F_SETFL, flags) < 0) {
+        return SERVER_UNREACHABLE;
+    }
+
+    return 0;
+}
+
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,59 @@
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include "csapp.h"
+
+/* Lookups are cached for RESOLVER_TTL seconds, failures for
+   RESOLVER_NEGATIVE_TTL seconds */
+#define RESOLVER_BUCKET_COUNT 256
+#define RESOLVER_MAX_ENTRIES 1024
+#define RESOLVER_MAX_ADDRS 8
+#define RESOLVER_TTL 60
+#define RESOLVER_NEGATIVE_TTL 10
+#define RESOLVER_THREAD_COUNT 2
+
+/* Failures of open_serverfd */
+#define SERVER_UNREACHABLE -1
+#define SERVER_UNRESOLVED -2
+#define SERVER_TIMEOUT -3
+
+enum ResolverState {
+    RESOLVER_PENDING,             /* a resolver thread is looking it up */
+    RESOLVER_RESOLVED,            /* addrs holds the result */
+    RESOLVER_FAILED,              /* the lookup failed */
+};
+
+typedef struct ResolverAddr {
+    int family;                   /* arguments for socket() */
+    int socktype;
+    int protocol;
+    socklen_t addrlen;            /* arguments for connect() */
+    struct sockaddr_storage addr;
+} ResolverAddr;
+
+/*
+ * A cached lookup of host:port. Lookups run on the resolver threads and the
+ * workers wait for them, so concurrent misses on a host share one lookup.
+ * An expired entry that resolved is still served while it is refreshed in
+ * the background, so a hot host never waits for DNS again.
+ */
+typedef struct ResolverEntry {
+    char* host;
+    char* port;
+    unsigned int hash;            /* hash of host:port */
+    enum ResolverState state;
+    int refreshing;               /* queued for a lookup while still served */
+    int nwaiters;                 /* workers waiting for the lookup */
+    time_t expires;               /* when the result gets stale */
+    int naddrs;
+    ResolverAddr addrs[RESOLVER_MAX_ADDRS];
+    struct ResolverEntry* next;   /* next entry in the same bucket */
+    struct ResolverEntry* next_pending;  /* queue of the resolver threads */
+} ResolverEntry;
+
+void init_resolver();
+int resolve(const char* host, const char* port, ResolverAddr* addrs, int maxaddrs);
+int open_serverfd(const char* host, const char* port, int timeout);
+void deinit_resolver();
+
+#endif /* __RESOLVER_H__ */
@@ -0,0 +1,280 @@
+#include "shared.h"
+#include "log.h"
+
+/* Records start on 8-byte boundaries */
+#define RECORD_ALIGN 8
+
+static SharedCache* shared;       /* NULL without worker processes */
+static char* records;             /* the log, right after the header */
+
+static SharedRecord* record_at(long offset);
+static pthread_mutex_t* stripe_of(unsigned int hash);
+static void init_lock(pthread_mutex_t* mutex);
+static void lock_writer();
+static void lock_stripe(pthread_mutex_t* stripe);
+static void reset_shared();
+static long* find_record(const char* key, unsigned int hash);
+static void unlink_record(long* link);
+static void evict_records(long limit);
+
+/* map the cache before the workers are forked, they inherit the mapping,
+   capacity is in bytes, returns 0 on failure */
+int init_shared(long capacity) {
+    /* room for a few of the largest records at least */
+    long min_capacity = 4 * (sizeof(SharedRecord) + MAXLINE + MAX_OBJECT_SIZE);
+    capacity = (capacity < min_capacity ? min_capacity : capacity);
+    capacity -= capacity % RECORD_ALIGN;
+
+    long header = (sizeof(SharedCache) + 4095) & ~4095L;
+    void* p = mmap(NULL, header + capacity, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "mmap shared cache error: %s\n", strerror(errno));
+        return 0;
+    }
+
+    shared = p;
+    records = (char*)p + header;
+    shared->capacity = capacity;
+    shared->head = shared->tail = 0;
+    shared->nobjects = 0;
+    shared->size = 0;
+
+    /* the locks live in the mapping, so they work across processes */
+    init_lock(&shared->writer);
+    for (int i = 0; i < SHARED_STRIPE_COUNT; ++i) {
+        init_lock(&shared->stripes[i]);
+    }
+    for (int i = 0; i < SHARED_BUCKET_COUNT; ++i) {
+        shared->buckets[i] = -1;
+    }
+
+    return 1;
+}
+
+/* append a copy of the object for the other workers, it replaces any
+   older one under the key, the oldest records make room */
+void shared_store(const CacheObject* object) {
+    if (shared == NULL || object->size > MAX_OBJECT_SIZE) {
+        return;
+    }
+
+    int keylen = strlen(object->key) + 1;
+    long length = sizeof(SharedRecord) + keylen + object->size;
+    length = (length + RECORD_ALIGN - 1) & ~(long)(RECORD_ALIGN - 1);
+
+    lock_writer();
+
+    /* a record doesn't wrap, the rest of the log becomes a pad */
+    long start = shared->head;
+    long room = shared->capacity - start % shared->capacity;
+    if (room < length) {
+        start += room;
+    }
+    long end = start + length;
+
+    evict_records(end - shared->capacity);
+
+    pthread_mutex_t* stripe = stripe_of(object->hash);
+    lock_stripe(stripe);
+    long* link = find_record(object->key, object->hash);
+    if (*link >= 0) {
+        unlink_record(link);
+    }
+    pthread_mutex_unlock(stripe);
+
+    /* a reader checks head after copying a record, so head moves before
+       any byte it covers is overwritten */
+    __atomic_store_n(&shared->head, end, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (room < length && room >= sizeof(SharedRecord)) {
+        SharedRecord* pad = record_at(start - room);
+        pad->length = room;
+        pad->keylen = 0;
+        pad->linked = 0;
+    }
+
+    SharedRecord* record = record_at(start);
+    record->length = length;
+    record->hash = object->hash;
+    record->keylen = keylen;
+    record->size = object->size;
+    record->freshness = object->freshness;
+    char* key = (char*)(record + 1);
+    memcpy(key, object->key, keylen);
+    chain_copy(object->chain, key + keylen, 0, object->size);
+
+    /* readers only find the record once it is complete */
+    lock_stripe(stripe);
+    long* bucket = &shared->buckets[object->hash & (SHARED_BUCKET_COUNT - 1)];
+    record->next = *bucket;
+    record->linked = 1;
+    *bucket = start;
+    shared->nobjects++;
+    shared->size += object->size;
+    pthread_mutex_unlock(stripe);
+
+    pthread_mutex_unlock(&shared->writer);
+}
+
+/* copy a fresh object another worker stored into the memory cache of this
+   process, returns it pinned, the caller must cache_release it, or NULL */
+CacheObject* shared_lookup(const char* key, unsigned int hash) {
+    if (shared == NULL) {
+        return NULL;
+    }
+
+    SharedRecord record;
+    pthread_mutex_t* stripe = stripe_of(hash);
+    lock_stripe(stripe);
+    long offset = *find_record(key, hash);
+    if (offset >= 0) {
+        record = *record_at(offset);
+    }
+    pthread_mutex_unlock(stripe);
+
+    if (offset < 0 || time(NULL) >= record.freshness.expires) {
+        return NULL;
+    }
+
+    /* copy without any lock, a writer lapping the log meanwhile may have
+       overwritten it, which head tells */
+    ChunkChain* chain = new_chain(record.size);
+    chain_append(chain, (char*)(record_at(offset) + 1) + record.keylen, record.size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&shared->head, __ATOMIC_RELAXED) - offset > shared->capacity) {
+        free_chain(chain);
+        return NULL;
+    }
+
+    return write_cache(chain, key, hash, &record.freshness);
+}
+
+/* returns 0 without worker processes */
+int shared_stats(long* nobjects, long* size) {
+    if (shared == NULL) {
+        return 0;
+    }
+
+    lock_writer();
+    *nobjects = shared->nobjects;
+    *size = shared->size;
+    pthread_mutex_unlock(&shared->writer);
+
+    return 1;
+}
+
+static SharedRecord* record_at(long offset) {
+    return (SharedRecord*)(records + offset % shared->capacity);
+}
+
+static pthread_mutex_t* stripe_of(unsigned int hash) {
+    return &shared->stripes[hash & (SHARED_STRIPE_COUNT - 1)];
+}
+
+/* shared by the processes, and robust, so the lock of a worker that died
+   holding it passes to the next one with EOWNERDEAD */
+static void init_lock(pthread_mutex_t* mutex) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int rc = pthread_mutex_init(mutex, &attr);
+    if (rc != 0) {
+        posix_error(rc, "pthread_mutex_init error");
+    }
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* a worker that died holding the writer may have left the log, the index
+   or the counts half updated, the cache starts over empty */
+static void lock_writer() {
+    int rc = pthread_mutex_lock(&shared->writer);
+    if (rc == EOWNERDEAD) {
+        log_warn("shared cache: a worker died while storing, emptying the cache");
+        reset_shared();
+        pthread_mutex_consistent(&shared->writer);
+    } else if (rc != 0) {
+        posix_error(rc, "pthread_mutex_lock error");
+    }
+}
+
+/* the buckets stay walkable at every step of a link or an unlink, and only
+   a writer changes them, the next one resets the cache, so a stripe whose
+   holder died is just made consistent */
+static void lock_stripe(pthread_mutex_t* stripe) {
+    int rc = pthread_mutex_lock(stripe);
+    if (rc == EOWNERDEAD) {
+        pthread_mutex_consistent(stripe);
+    } else if (rc != 0) {
+        posix_error(rc, "pthread_mutex_lock error");
+    }
+}
+
+/* drop every record, caller holds the writer */
+static void reset_shared() {
+    for (int i = 0; i < SHARED_STRIPE_COUNT; ++i) {
+        lock_stripe(&shared->stripes[i]);
+        for (int j = i; j < SHARED_BUCKET_COUNT; j += SHARED_STRIPE_COUNT) {
+            shared->buckets[j] = -1;
+        }
+        pthread_mutex_unlock(&shared->stripes[i]);
+    }
+
+    shared->tail = shared->head;
+    shared->nobjects = 0;
+    shared->size = 0;
+}
+
+/* find the link to the record with the key, or the -1 ending its bucket,
+   caller holds the stripe */
+static long* find_record(const char* key, unsigned int hash) {
+    long* link = &shared->buckets[hash & (SHARED_BUCKET_COUNT - 1)];
+    while (*link >= 0) {
+        SharedRecord* record = record_at(*link);
+        if (record->hash == hash && strcmp((char*)(record + 1), key) == 0) {
+            break;
+        }
+        link = &record->next;
+    }
+
+    return link;
+}
+
+/* caller holds the writer and the stripe */
+static void unlink_record(long* link) {
+    SharedRecord* record = record_at(*link);
+    *link = record->next;
+    record->linked = 0;
+    shared->nobjects--;
+    shared->size -= record->size;
+}
+
+/* drop the records starting before limit, whose bytes are about to be
+   overwritten, caller holds the writer */
+static void evict_records(long limit) {
+    while (shared->tail < limit) {
+        long tail = shared->tail;
+
+        /* too little room left for a pad header, skip to the start */
+        long room = shared->capacity - tail % shared->capacity;
+        if (room < sizeof(SharedRecord)) {
+            shared->tail += room;
+            continue;
+        }
+
+        SharedRecord* record = record_at(tail);
+        if (record->linked) {
+            pthread_mutex_t* stripe = stripe_of(record->hash);
+            lock_stripe(stripe);
+            long* link = &shared->buckets[record->hash & (SHARED_BUCKET_COUNT - 1)];
+            while (*link != tail) {
+                link = &record_at(*link)->next;
+            }
+            unlink_record(link);
+            pthread_mutex_unlock(stripe);
+        }
+        shared->tail += record->length;
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef __SHARED_H__
+#define __SHARED_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* Default size of the cache shared by the worker processes, and its index
+   size, the bucket and stripe counts must be powers of 2 */
+#define DEFAULT_SHARED_CACHE_MB 64
+#define SHARED_BUCKET_COUNT (1 << 14)
+#define SHARED_STRIPE_COUNT 64
+
+/*
+ * The cache shared by the worker processes lives in one anonymous shared
+ * mapping made before they are forked, so offsets replace pointers. The
+ * objects are appended to a circular log and the oldest are overwritten,
+ * first in, first out. Offsets are logical and only grow, the record at
+ * offset o lives at o % capacity until head passes o + capacity. A record
+ * never wraps around the end of the log, a pad fills the end instead.
+ * The locks are robust, a worker killed while holding one doesn't stall
+ * the others, the cache is emptied instead if it was writing.
+ */
+typedef struct SharedRecord {
+    long next;                    /* next record in the same bucket, -1 if none */
+    long length;                  /* bytes of the record, this header included */
+    unsigned int hash;            /* hash of the key */
+    int linked;                   /* in the index, not yet replaced or evicted */
+    int keylen;                   /* bytes of the key, null included, 0 for a pad */
+    int size;                     /* bytes of the data */
+    Freshness freshness;
+    /* the key follows, then the data */
+} SharedRecord;
+
+typedef struct SharedCache {
+    long capacity;                /* bytes of the log */
+    long head;                    /* offset of the next record */
+    long tail;                    /* offset of the oldest record */
+    long nobjects;                /* number of linked objects */
+    long size;                    /* bytes of linked objects */
+    pthread_mutex_t writer;       /* serialize the writers of every process */
+    pthread_mutex_t stripes[SHARED_STRIPE_COUNT];  /* bucket i is guarded by stripe i % SHARED_STRIPE_COUNT */
+    long buckets[SHARED_BUCKET_COUNT];   /* offset of the first record, -1 if none */
+} SharedCache;
+
+int init_shared(long capacity);
+void shared_store(const CacheObject* object);
+CacheObject* shared_lookup(const char* key, unsigned int hash);
+int shared_stats(long* nobjects, long* size);
+
+#endif /* __SHARED_H__ */
@@ -0,0 +1,220 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "log.h"
+
+typedef struct Snapshots {
+    char path[MAXLINE];           /* the snapshot file */
+    int interval;                 /* seconds between two snapshots */
+    sigset_t signals;             /* signals asking for a graceful shutdown */
+} Snapshots;
+
+static Snapshots snapshots;
+
+/* offset basis of the 64-bit FNV-1a checksum */
+#define CHECKSUM_BASIS 14695981039346656037ul
+
+static void* snapshot_routine(void* argp);
+static unsigned long checksum(unsigned long sum, const char* buf, long n);
+static int write_checked(int fd, const void* buf, long n, unsigned long* sum);
+
+/* must run before any thread is created, the threads inherit the blocked
+   signals, so only the snapshot thread ever receives them */
+void init_snapshots(const char* path, int interval) {
+    strncpy(snapshots.path, path, MAXLINE - 8);
+    snapshots.path[MAXLINE - 8] = '\0';
+    snapshots.interval = interval;
+
+    sigemptyset(&snapshots.signals);
+    sigaddset(&snapshots.signals, SIGINT);
+    sigaddset(&snapshots.signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &snapshots.signals, NULL);
+}
+
+/* put the objects of the snapshot back in the cache, returns how many,
+   -1 if there is no valid snapshot */
+int load_snapshot() {
+    SnapshotHeader header;
+    struct stat st;
+
+    int fd = open(snapshots.path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            log_error("open %s error: %s", snapshots.path, strerror(errno));
+        }
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(header)) {
+        log_warn("Snapshot %s is truncated", snapshots.path);
+        close(fd);
+        return -1;
+    }
+
+    char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        log_error("mmap %s error: %s", snapshots.path, strerror(errno));
+        return -1;
+    }
+
+    /* check the whole file before touching the cache */
+    memcpy(&header, data, sizeof(header));
+    char* p = data + sizeof(header);
+    char* end = data + st.st_size;
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        header.version != SNAPSHOT_VERSION ||
+        header.max_object_size != MAX_OBJECT_SIZE ||
+        header.size != end - p ||
+        header.checksum != checksum(CHECKSUM_BASIS, p, end - p)) {
+        log_warn("Snapshot %s is not valid, starting cold", snapshots.path);
+        munmap(data, st.st_size);
+        return -1;
+    }
+
+    int nloaded = 0;
+    for (long i = 0; i < header.nobjects; ++i) {
+        SnapshotRecord record;
+        if (end - p < sizeof(record)) {
+            break;
+        }
+        memcpy(&record, p, sizeof(record));
+        p += sizeof(record);
+
+        /* a valid checksum doesn't make the records sane */
+        char* key = p;
+        if (record.keylen <= 0 || record.size < 0 || record.size > MAX_OBJECT_SIZE ||
+            (record.segment != SEGMENT_WINDOW && record.segment != SEGMENT_MAIN) ||
+            end - p < (long)record.keylen + record.size ||
+            key[record.keylen - 1] != '\0' || hash_key(key) != record.hash ||
+            memchr(record.freshness.etag, '\0', MAX_VALIDATOR_LEN) == NULL ||
+            memchr(record.freshness.last_modified, '\0', MAX_VALIDATOR_LEN) == NULL) {
+            log_warn("Snapshot %s has a bad record, %d objects loaded",
+                     snapshots.path, nloaded);
+            break;
+        }
+        p += record.keylen;
+
+        ChunkChain* chain = new_chain(record.size);
+        chain_append(chain, p, record.size);
+        nloaded += cache_restore(chain, key, record.hash, &record.freshness,
+                                 record.segment);
+        p += record.size;
+    }
+
+    munmap(data, st.st_size);
+
+    log_info("load_snapshot: %d objects from %s", nloaded, snapshots.path);
+
+    return nloaded;
+}
+
+/* write the cached objects to a temporary file, then rename it over the
+   snapshot, so a crash midway leaves the previous snapshot intact,
+   returns 0 on failure */
+int save_snapshot() {
+    char tmp[MAXLINE];
+    SnapshotHeader header;
+    CacheObject** objects;
+
+    sprintf(tmp, "%s.tmp", snapshots.path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log_error("open %s error: %s", tmp, strerror(errno));
+        return 0;
+    }
+
+    /* the objects are immutable, so write them without any cache lock */
+    int nmain;
+    int nobjects = cache_pin_objects(&objects, &nmain);
+    char* buf = Malloc(MAX_OBJECT_SIZE);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.max_object_size = MAX_OBJECT_SIZE;
+    header.nobjects = nobjects;
+    header.size = 0;
+    header.checksum = CHECKSUM_BASIS;
+
+    int ok = write_checked(fd, &header, sizeof(header), NULL);
+    for (int i = 0; i < nobjects; ++i) {
+        CacheObject* object = objects[i];
+        if (ok) {
+            SnapshotRecord record;
+            memset(&record, 0, sizeof(record));
+            record.hash = object->hash;
+            record.keylen = strlen(object->key) + 1;
+            record.size = object->size;
+            record.segment = (i < nmain ? SEGMENT_MAIN : SEGMENT_WINDOW);
+            record.freshness = object->freshness;
+            chain_copy(object->chain, buf, 0, object->size);
+
+            ok = write_checked(fd, &record, sizeof(record), &header.checksum) &&
+                 write_checked(fd, object->key, record.keylen, &header.checksum) &&
+                 write_checked(fd, buf, record.size, &header.checksum);
+            header.size += sizeof(record) + record.keylen + record.size;
+        }
+        cache_release(object);
+    }
+
+    free(buf);
+    free(objects);
+
+    /* the header goes last, with the size and checksum filled in */
+    ok = ok && lseek(fd, 0, SEEK_SET) == 0 &&
+         write_checked(fd, &header, sizeof(header), NULL) && fsync(fd) == 0;
+    if (close(fd) < 0 || !ok || rename(tmp, snapshots.path) < 0) {
+        log_error("Write snapshot %s failure: %s", snapshots.path, strerror(errno));
+        unlink(tmp);
+        return 0;
+    }
+
+    log_info("save_snapshot: %d objects to %s", nobjects, snapshots.path);
+
+    return 1;
+}
+
+/* take a snapshot every interval, and a last one on SIGINT or SIGTERM */
+void start_snapshots() {
+    pthread_t tid;
+    Pthread_create(&tid, NULL, snapshot_routine, NULL);
+}
+
+static void* snapshot_routine(void* argp) {
+    Pthread_detach(pthread_self());
+
+    struct timespec timeout = { snapshots.interval, 0 };
+    while (1) {
+        int sig = sigtimedwait(&snapshots.signals, NULL, &timeout);
+        if (sig < 0 && errno == EINTR) {
+            continue;
+        }
+
+        save_snapshot();
+
+        if (sig > 0) {
+            exit(0);
+        }
+    }
+
+    return NULL;
+}
+
+/* FNV-1a, continued from sum */
+static unsigned long checksum(unsigned long sum, const char* buf, long n) {
+    for (long i = 0; i < n; ++i) {
+        sum ^= (unsigned char)buf[i];
+        sum *= 1099511628211ul;
+    }
+
+    return sum;
+}
+
+/* write all n bytes, adding them to the checksum if any, returns 0 on error */
+static int write_checked(int fd, const void* buf, long n, unsigned long* sum) {
+    if (sum != NULL) {
+        *sum = checksum(*sum, buf, n);
+    }
+
+    return rio_writen(fd, (void*)buf, n) == n;
+}
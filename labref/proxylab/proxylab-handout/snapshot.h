@@ -0,0 +1,41 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+#define SNAPSHOT_MAGIC "PXYSNAP"
+#define SNAPSHOT_VERSION 3
+
+/* Seconds between two snapshots taken while serving */
+#define DEFAULT_SNAPSHOT_INTERVAL 300
+
+/*
+ * A snapshot file is a header followed by one record per cached object,
+ * ring by ring, the next to be evicted first. A record is the fixed part below, then
+ * the key with its null, then the data. The checksum covers every byte
+ * after the header, so a torn or foreign file is never loaded.
+ */
+typedef struct SnapshotHeader {
+    char magic[8];                /* SNAPSHOT_MAGIC */
+    int version;                  /* SNAPSHOT_VERSION */
+    int max_object_size;          /* MAX_OBJECT_SIZE of the proxy that wrote it */
+    long nobjects;                /* number of records */
+    long size;                    /* bytes after the header */
+    unsigned long checksum;       /* FNV-1a of the bytes after the header */
+} SnapshotHeader;
+
+typedef struct SnapshotRecord {
+    unsigned int hash;            /* hash of the key */
+    int keylen;                   /* bytes of the key, null included */
+    int size;                     /* bytes of the data */
+    int segment;                  /* ring the object was on, a CacheSegment */
+    Freshness freshness;          /* expiry and validators of the object */
+} SnapshotRecord;
+
+void init_snapshots(const char* path, int interval);
+int load_snapshot();
+int save_snapshot();
+void start_snapshots();
+
+#endif /* __SNAPSHOT_H__ */
@@ -0,0 +1,218 @@
+#include <time.h>
+#include "stats.h"
+#include "cache.h"
+#include "disk.h"
+#include "shared.h"
+
+typedef struct Stats {
+    StatsShard* shards;           /* shards of every thread that counted */
+    pthread_mutex_t mutex;        /* protect the list, taken once per thread */
+} Stats;
+
+static Stats stats = { NULL, PTHREAD_MUTEX_INITIALIZER };
+
+static __thread StatsShard* local;
+
+static const char* counter_names[STATS_COUNTER_COUNT] = {
+    "connections", "active_connections", "requests", "memory_hits", "disk_hits",
+    "shared_hits", "coalesced", "misses", "revalidated", "ranges", "origin_connects",
+    "origin_timeouts", "host_waits", "tunnels",
+    "bytes_memory", "bytes_disk", "bytes_origin", "bytes_tunneled",
+};
+
+static const char* histogram_names[STATS_HISTOGRAM_COUNT] = {
+    "first_byte_us", "total_us", "connect_us",
+};
+
+static StatsShard* local_shard();
+static void add(long* counter, long n);
+static int histogram_bucket(long usecs);
+static long bucket_limit(int bucket);
+static long percentile(const Histogram* histogram, double fraction);
+
+/* monotonic clock in microseconds */
+long stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void stats_count(enum StatsCounter counter, long n) {
+    add(&local_shard()->counters[counter], n);
+}
+
+void stats_record(enum StatsHistogram histogram, long usecs) {
+    Histogram* h = &local_shard()->histograms[histogram];
+    add(&h->count, 1);
+    add(&h->sum, usecs);
+    add(&h->buckets[histogram_bucket(usecs)], 1);
+    if (usecs > h->max) {
+        __atomic_store_n(&h->max, usecs, __ATOMIC_RELAXED);
+    }
+}
+
+/* the threaded engine serves one request per thread at a time, so the
+   shard can time it, the event engine times each connection itself */
+void stats_request_begin() {
+    StatsShard* shard = local_shard();
+    shard->request_start = stats_now();
+    shard->first_byte = 0;
+    add(&shard->counters[STATS_REQUESTS], 1);
+}
+
+/* the first call per request counts */
+void stats_first_byte() {
+    StatsShard* shard = local_shard();
+    if (shard->request_start != 0 && !shard->first_byte) {
+        shard->first_byte = 1;
+        stats_record(STATS_FIRST_BYTE, stats_now() - shard->request_start);
+    }
+}
+
+void stats_request_end() {
+    StatsShard* shard = local_shard();
+    if (shard->request_start != 0) {
+        stats_record(STATS_TOTAL, stats_now() - shard->request_start);
+        shard->request_start = 0;
+    }
+}
+
+/* format the whole response to a stats request, returns its length */
+int format_stats(char* buf, int maxlen) {
+    long counters[STATS_COUNTER_COUNT] = { 0 };
+    Histogram* histograms = Calloc(STATS_HISTOGRAM_COUNT, sizeof(Histogram));
+
+    pthread_mutex_lock(&stats.mutex);
+    for (StatsShard* shard = stats.shards; shard != NULL; shard = shard->next) {
+        for (int i = 0; i < STATS_COUNTER_COUNT; ++i) {
+            counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < STATS_HISTOGRAM_COUNT; ++i) {
+            const Histogram* from = &shard->histograms[i];
+            Histogram* to = &histograms[i];
+            to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+            to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+            long max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+            to->max = (max > to->max ? max : to->max);
+            for (int j = 0; j < HISTOGRAM_BUCKET_COUNT; ++j) {
+                to->buckets[j] += __atomic_load_n(&from->buckets[j], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_mutex_unlock(&stats.mutex);
+
+    /* the body first, its length goes in the head */
+    char body[MAXBUF];
+    int len = 0;
+    for (int i = 0; i < STATS_COUNTER_COUNT; ++i) {
+        len += snprintf(body + len, sizeof(body) - len, "%s %ld\n", counter_names[i], counters[i]);
+    }
+
+    long hits = counters[STATS_MEMORY_HITS] + counters[STATS_DISK_HITS] +
+                counters[STATS_SHARED_HITS];
+    long requests = counters[STATS_REQUESTS];
+    len += snprintf(body + len, sizeof(body) - len, "hit_ratio %.4f\n",
+                    requests > 0 ? (double)hits / requests : 0.0);
+
+    int nobjects, size;
+    long nevicted;
+    cache_stats(&nobjects, &size, &nevicted);
+    len += snprintf(body + len, sizeof(body) - len,
+                    "cache_objects %d\ncache_bytes %d\ncache_evictions %ld\n",
+                    nobjects, size, nevicted);
+
+    long disk_objects, disk_size;
+    if (disk_stats(&disk_objects, &disk_size)) {
+        len += snprintf(body + len, sizeof(body) - len, "disk_objects %ld\ndisk_bytes %ld\n",
+                        disk_objects, disk_size);
+    }
+
+    long shared_objects, shared_size;
+    if (shared_stats(&shared_objects, &shared_size)) {
+        len += snprintf(body + len, sizeof(body) - len, "shared_objects %ld\nshared_bytes %ld\n",
+                        shared_objects, shared_size);
+    }
+
+    for (int i = 0; i < STATS_HISTOGRAM_COUNT; ++i) {
+        const Histogram* h = &histograms[i];
+        len += snprintf(body + len, sizeof(body) - len,
+                        "%s count=%ld mean=%ld p50=%ld p90=%ld p99=%ld p999=%ld max=%ld\n",
+                        histogram_names[i], h->count, h->count > 0 ? h->sum / h->count : 0,
+                        percentile(h, 0.5), percentile(h, 0.9), percentile(h, 0.99),
+                        percentile(h, 0.999), h->max);
+    }
+
+    free(histograms);
+
+    return snprintf(buf, maxlen, "HTTP/1.0 200 OK\r\n"
+                    "Content-Type: text/plain\r\n"
+                    "Content-Length: %d\r\n"
+                    "Cache-Control: no-store\r\n"
+                    "Connection: close\r\n\r\n%s", len, body);
+}
+
+/* the shard of the calling thread, linked in on its first use */
+static StatsShard* local_shard() {
+    if (local == NULL) {
+        local = Calloc(1, sizeof(StatsShard));
+
+        pthread_mutex_lock(&stats.mutex);
+        local->next = stats.shards;
+        stats.shards = local;
+        pthread_mutex_unlock(&stats.mutex);
+    }
+
+    return local;
+}
+
+/* only the owner writes a shard, a plain add is enough, the atomic load
+   and store just keep a concurrent reader from seeing a torn value */
+static void add(long* counter, long n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/* values below 2^SUB_BITS get a bucket each, above that every power of 2
+   is split into 2^SUB_BITS linear buckets */
+static int histogram_bucket(long usecs) {
+    if (usecs < 0) {
+        usecs = 0;
+    } else if (usecs >= 1L << HISTOGRAM_MAX_BITS) {
+        usecs = (1L << HISTOGRAM_MAX_BITS) - 1;
+    }
+
+    if (usecs < 1 << HISTOGRAM_SUB_BITS) {
+        return usecs;
+    }
+
+    int msb = 63 - __builtin_clzl(usecs);
+    int sub = (usecs >> (msb - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return ((msb - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub;
+}
+
+/* largest value falling in the bucket */
+static long bucket_limit(int bucket) {
+    int next = bucket + 1;
+    if (next < 1 << HISTOGRAM_SUB_BITS) {
+        return bucket;
+    }
+
+    int shift = (next >> HISTOGRAM_SUB_BITS) - 1;
+    long base = (1 << HISTOGRAM_SUB_BITS) + (next & ((1 << HISTOGRAM_SUB_BITS) - 1));
+    return (base << shift) - 1;
+}
+
+static long percentile(const Histogram* histogram, double fraction) {
+    long rank = (long)(fraction * histogram->count + 0.5);
+    rank = (rank < 1 ? 1 : rank);
+
+    long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKET_COUNT; ++i) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            long limit = bucket_limit(i);
+            return (limit < histogram->max ? limit : histogram->max);
+        }
+    }
+
+    return histogram->max;
+}
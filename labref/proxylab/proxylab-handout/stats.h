@@ -0,0 +1,73 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "csapp.h"
+
+/* Path the proxy answers itself, with the counters as plain text */
+#define STATS_PATH "/__proxy_stats"
+
+/* A histogram has 2^SUB_BITS linear buckets per power of 2, about 12%
+   precision, for values below 2^MAX_BITS microseconds */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKET_COUNT ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+enum StatsCounter {
+    STATS_CONNECTIONS,            /* client connections accepted */
+    STATS_ACTIVE_CONNECTIONS,     /* client connections open */
+    STATS_REQUESTS,               /* requests parsed, the stats ones aside */
+    STATS_MEMORY_HITS,            /* fresh objects sent from memory */
+    STATS_DISK_HITS,              /* fresh objects sent from disk */
+    STATS_SHARED_HITS,            /* fresh objects another worker process cached */
+    STATS_COALESCED,              /* requests that joined the fetch of another */
+    STATS_MISSES,                 /* requests fetched from the server */
+    STATS_REVALIDATED,            /* stale objects the server renewed with a 304 */
+    STATS_RANGES,                 /* hits answered with the ranges the client asked for */
+    STATS_ORIGIN_CONNECTS,        /* connections opened to servers */
+    STATS_ORIGIN_TIMEOUTS,        /* connects and responses that timed out */
+    STATS_HOST_WAITS,             /* connects held back by the cap on their server */
+    STATS_TUNNELS,                /* CONNECT tunnels opened */
+    STATS_BYTES_MEMORY,           /* bytes sent from memory */
+    STATS_BYTES_DISK,             /* bytes sent from disk */
+    STATS_BYTES_ORIGIN,           /* bytes relayed from servers, to followers too */
+    STATS_BYTES_TUNNELED,         /* bytes relayed through tunnels, both ways */
+    STATS_COUNTER_COUNT,
+};
+
+enum StatsHistogram {
+    STATS_FIRST_BYTE,             /* from the parsed request to the first byte sent */
+    STATS_TOTAL,                  /* from the parsed request to the end of the response */
+    STATS_CONNECT,                /* opening a connection to a server */
+    STATS_HISTOGRAM_COUNT,
+};
+
+/* latencies in microseconds */
+typedef struct Histogram {
+    long count;
+    long sum;
+    long max;
+    long buckets[HISTOGRAM_BUCKET_COUNT];
+} Histogram;
+
+/*
+ * Every thread counts into a shard of its own, which no other thread
+ * writes, so recording takes no lock and no atomic read-modify-write.
+ * A reader sums the shards and may see a request half counted.
+ */
+typedef struct StatsShard {
+    long counters[STATS_COUNTER_COUNT];
+    Histogram histograms[STATS_HISTOGRAM_COUNT];
+    long request_start;           /* request the thread serves, 0 if none */
+    int first_byte;               /* its first byte was recorded */
+    struct StatsShard* next;      /* next shard in the list of all */
+} StatsShard;
+
+long stats_now();
+void stats_count(enum StatsCounter counter, long n);
+void stats_record(enum StatsHistogram histogram, long usecs);
+void stats_request_begin();
+void stats_first_byte();
+void stats_request_end();
+int format_stats(char* buf, int maxlen);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,155 @@
+#define _GNU_SOURCE // splice
+#include <poll.h>
+#include "tunnel.h"
+#include "stats.h"
+#include "log.h"
+
+static int pump_direction(Tunnel* tunnel, int direction);
+
+Tunnel* new_tunnel() {
+    Tunnel* tunnel = Malloc(sizeof(Tunnel));
+    tunnel->fds[0] = tunnel->fds[1] = -1;
+    for (int i = 0; i < 2; ++i) {
+        TunnelPipe* pipe = &tunnel->pipes[i];
+        pipe->fds[0] = pipe->fds[1] = -1;
+        pipe->len = pipe->eof = pipe->shut = 0;
+    }
+
+    return tunnel;
+}
+
+/* make both sockets non-blocking and open the pipes, returns 0 on failure */
+int open_tunnel(Tunnel* tunnel, int clientfd, int serverfd) {
+    tunnel->fds[TUNNEL_UP] = clientfd;
+    tunnel->fds[TUNNEL_DOWN] = serverfd;
+
+    for (int i = 0; i < 2; ++i) {
+        int flags = fcntl(tunnel->fds[i], F_GETFL, 0);
+        if (flags < 0 || fcntl(tunnel->fds[i], F_SETFL, flags | O_NONBLOCK) < 0) {
+            log_error("fcntl error: %s", strerror(errno));
+            return 0;
+        }
+
+        TunnelPipe* pipe = &tunnel->pipes[i];
+        if (pipe2(pipe->fds, O_CLOEXEC | O_NONBLOCK) < 0) {
+            log_error("pipe2 error: %s", strerror(errno));
+            pipe->fds[0] = pipe->fds[1] = -1;
+            return 0;
+        }
+
+        /* a larger pipe means fewer round trips, the default still works */
+        fcntl(pipe->fds[1], F_SETPIPE_SZ, TUNNEL_PIPE_SIZE);
+    }
+
+    stats_count(STATS_TUNNELS, 1);
+
+    return 1;
+}
+
+/* queue bytes that don't come from the source socket, the reply to the
+   CONNECT or what the client sent past its head, ahead of the relay,
+   returns 0 if they don't fit the pipe */
+int tunnel_preload(Tunnel* tunnel, int direction, const char* buf, int n) {
+    TunnelPipe* pipe = &tunnel->pipes[direction];
+    if (n > 0 && write(pipe->fds[1], buf, n) != n) {
+        return 0;
+    }
+    pipe->len += n;
+
+    return 1;
+}
+
+/* move what can move without blocking, returns 1 while the tunnel is open,
+   with the poll events to wait for on each socket, which equal the epoll
+   ones, 0 once both directions ended, -1 on error */
+int pump_tunnel(Tunnel* tunnel, int* client_events, int* server_events) {
+    int* events[2] = { client_events, server_events };
+    *client_events = *server_events = 0;
+
+    int open = 0;
+    for (int d = 0; d < 2; ++d) {
+        if (pump_direction(tunnel, d) < 0) {
+            return -1;
+        }
+
+        /* bytes waiting for the destination, or a source still open */
+        TunnelPipe* pipe = &tunnel->pipes[d];
+        if (pipe->len > 0) {
+            *events[1 - d] |= POLLOUT;
+        } else if (!pipe->eof) {
+            *events[d] |= POLLIN;
+        }
+        open |= !pipe->shut;
+    }
+
+    return open;
+}
+
+/* the socket of a side, TUNNEL_UP for the client's, needs nothing more:
+   it reached EOF and was shut for writing, a poll or epoll on it would only
+   keep reporting the hangup */
+int tunnel_done(const Tunnel* tunnel, int side) {
+    return tunnel->pipes[side].eof && tunnel->pipes[1 - side].shut;
+}
+
+/* the sockets are left to the caller */
+void free_tunnel(Tunnel* tunnel) {
+    for (int i = 0; i < 2; ++i) {
+        TunnelPipe* pipe = &tunnel->pipes[i];
+        if (pipe->fds[0] >= 0) {
+            close(pipe->fds[0]);
+            close(pipe->fds[1]);
+        }
+    }
+    free(tunnel);
+}
+
+/* drain the pipe to the destination and refill it from the source until
+   either would block, returns -1 on error */
+static int pump_direction(Tunnel* tunnel, int direction) {
+    TunnelPipe* pipe = &tunnel->pipes[direction];
+    int src = tunnel->fds[direction];
+    int dst = tunnel->fds[1 - direction];
+
+    /* no SPLICE_F_MORE, the peer is waiting for these very bytes, and
+       corking them stalls the tunnel */
+    for (int round = 0; round < TUNNEL_MAX_ROUNDS && !pipe->shut; ) {
+        if (pipe->len > 0) {
+            ssize_t n = splice(pipe->fds[0], NULL, dst, NULL, pipe->len,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return (errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1);
+            }
+            pipe->len -= n;
+            stats_count(STATS_BYTES_TUNNELED, n);
+            continue;
+        }
+
+        /* the source is done and everything reached the destination */
+        if (pipe->eof) {
+            shutdown(dst, SHUT_WR);
+            pipe->shut = 1;
+            break;
+        }
+
+        ssize_t n = splice(src, NULL, pipe->fds[1], NULL, TUNNEL_PIPE_SIZE,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1);
+        }
+        if (n == 0) {
+            pipe->eof = 1;
+            continue;
+        }
+        pipe->len += n;
+        round++;
+    }
+
+    return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#include "csapp.h"
+
+/* Bytes a tunnel pipe holds, and moves per splice, and how many times a
+   direction is refilled per pump, so one busy tunnel can't starve an event
+   loop; the pages of a pipe are only allocated while bytes wait in it */
+#define TUNNEL_PIPE_SIZE (1 << 18)
+#define TUNNEL_MAX_ROUNDS 4
+
+/* Seconds a tunnel may stay idle in both directions */
+#define TUNNEL_IDLE_TIMEOUT 300
+
+/* The reply once the server is connected, the client speaks TLS after it */
+#define TUNNEL_ESTABLISHED "HTTP/1.1 200 Connection established\r\n\r\n"
+
+/* The directions of a tunnel */
+#define TUNNEL_UP 0                   /* client to server */
+#define TUNNEL_DOWN 1                 /* server to client */
+
+typedef struct TunnelPipe {
+    int fds[2];                   /* read and write ends, -1 until opened */
+    int len;                      /* bytes in the pipe */
+    int eof;                      /* the source shut its side */
+    int shut;                     /* the destination was shut for writing */
+} TunnelPipe;
+
+/*
+ * The bidirectional relay of a CONNECT. Each direction moves bytes from
+ * one socket to the other through a pipe with splice, so they are never
+ * copied to user space. A direction ends when its source reaches EOF and
+ * its pipe is drained; the destination is then shut for writing, so a
+ * half-closed connection keeps working the other way. Both sockets are
+ * non-blocking and belong to the caller, who waits for the events that
+ * pump_tunnel asks for, with poll or epoll.
+ */
+typedef struct Tunnel {
+    int fds[2];                   /* client and server sockets */
+    TunnelPipe pipes[2];          /* indexed by direction */
+} Tunnel;
+
+Tunnel* new_tunnel();
+int open_tunnel(Tunnel* tunnel, int clientfd, int serverfd);
+int tunnel_preload(Tunnel* tunnel, int direction, const char* buf, int n);
+int pump_tunnel(Tunnel* tunnel, int* client_events, int* server_events);
+int tunnel_done(const Tunnel* tunnel, int side);
+void free_tunnel(Tunnel* tunnel);
+
+#endif /* __TUNNEL_H__ */
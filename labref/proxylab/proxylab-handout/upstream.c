@@ -0,0 +1,349 @@
+#include "upstream.h"
+#include "resolver.h"
+#include "cache.h"
+#include "stats.h"
+#include "log.h"
+
+typedef struct UpstreamPool {
+    UpstreamConn* buckets[UPSTREAM_BUCKET_COUNT];
+    UpstreamServer* servers[UPSTREAM_BUCKET_COUNT];
+    int nidle;                    /* idle connections in all buckets */
+    pthread_mutex_t mutex;        /* protect everything above and the servers */
+    pthread_cond_t released;      /* broadcast when a connection is parked or closed */
+} UpstreamPool;
+
+static UpstreamPool pool;
+
+UpstreamLimits upstream_limits = {
+    DEFAULT_CONNECT_TIMEOUT, DEFAULT_FIRST_BYTE_TIMEOUT, DEFAULT_STALL_TIMEOUT,
+    DEFAULT_MAX_PER_HOST,
+};
+
+static unsigned int hash_server(const char* host, const char* port);
+static UpstreamConn* take_idle(const char* host, const char* port, unsigned int hash,
+                               UpstreamConn** expired);
+static UpstreamServer* find_server(const char* host, const char* port, unsigned int hash);
+static UpstreamServer* get_server(const char* host, const char* port, unsigned int hash);
+static void drop_connection(UpstreamServer* server);
+static void put_server(UpstreamServer* server);
+static int is_alive(int fd);
+static void set_timeout(int fd, int option, int ms);
+
+void init_upstreams() {
+    for (int i = 0; i < UPSTREAM_BUCKET_COUNT; ++i) {
+        pool.buckets[i] = NULL;
+        pool.servers[i] = NULL;
+    }
+    pool.nidle = 0;
+
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.released, NULL);
+}
+
+/* take an idle connection to the server out of the pool, or open a new
+   one if fewer than max_per_host are open, waiting for one otherwise, all
+   within the connect timeout, returns a failure of open_serverfd, which
+   is SERVER_TIMEOUT if the time ran out */
+int upstream_acquire(const char* host, const char* port, int* reused) {
+    unsigned int hash = hash_server(host, port);
+    int timeout = upstream_limits.connect_timeout;
+    int max = upstream_limits.max_per_host;
+    long start = stats_now();
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    UpstreamConn* found;
+    UpstreamConn* expired = NULL;
+    UpstreamServer* server = NULL;
+    int waited = 0, timed_out = 0;
+
+    pthread_mutex_lock(&pool.mutex);
+
+    /* a waiter keeps the server alive, so it is still there after the wait */
+    while ((found = take_idle(host, port, hash, &expired)) == NULL) {
+        server = get_server(host, port, hash);
+        if (max <= 0 || server->nopen < max) {
+            server->nopen++;
+            break;
+        }
+        if (timed_out) {
+            put_server(server);
+            server = NULL;
+            break;
+        }
+
+        waited = 1;
+        server->nwaiters++;
+        if (timeout > 0) {
+            timed_out = (pthread_cond_timedwait(&pool.released, &pool.mutex, &deadline) == ETIMEDOUT);
+        } else {
+            pthread_cond_wait(&pool.released, &pool.mutex);
+        }
+        server->nwaiters--;
+    }
+
+    pthread_mutex_unlock(&pool.mutex);
+
+    /* close the expired ones outside the lock */
+    while (expired != NULL) {
+        UpstreamConn* conn = expired;
+        expired = conn->next;
+        close(conn->fd);
+        free(conn);
+    }
+
+    if (waited) {
+        stats_count(STATS_HOST_WAITS, 1);
+    }
+
+    if (found != NULL) {
+        int fd = found->fd;
+        server = found->server;
+        free(found);
+
+        /* the server may have closed it while it was idle, then its slot
+           goes to a new connection */
+        if (is_alive(fd)) {
+            *reused = 1;
+            upstream_await(fd, 1);
+            return fd;
+        }
+        close(fd);
+    }
+
+    *reused = 0;
+    if (server == NULL) {
+        stats_count(STATS_ORIGIN_TIMEOUTS, 1);
+        log_warn("upstream_acquire (%s, %s): no connection free within %d ms",
+                 host, port, timeout);
+        return SERVER_TIMEOUT;
+    }
+
+    int left = timeout - (int)((stats_now() - start) / 1000);
+    int fd = (timeout <= 0 ? open_serverfd(host, port, 0) :
+              left > 0 ? open_serverfd(host, port, left) : SERVER_TIMEOUT);
+    if (fd < 0) {
+        if (fd == SERVER_TIMEOUT) {
+            stats_count(STATS_ORIGIN_TIMEOUTS, 1);
+        }
+        pthread_mutex_lock(&pool.mutex);
+        drop_connection(server);
+        pthread_mutex_unlock(&pool.mutex);
+        return fd;
+    }
+
+    stats_count(STATS_ORIGIN_CONNECTS, 1);
+    stats_record(STATS_CONNECT, stats_now() - start);
+
+    set_timeout(fd, SO_SNDTIMEO, upstream_limits.stall_timeout);
+    upstream_await(fd, 1);
+
+    return fd;
+}
+
+/* park a connection whose last response was read completely,
+   closes it if the pool is full */
+void upstream_release(const char* host, const char* port, int fd) {
+    unsigned int hash = hash_server(host, port);
+
+    UpstreamConn* conn = Malloc(sizeof(UpstreamConn));
+    conn->fd = fd;
+    conn->idle_since = time(NULL);
+
+    pthread_mutex_lock(&pool.mutex);
+
+    UpstreamServer* server = find_server(host, port, hash);
+    conn->server = server;
+
+    int nsame = 0;
+    UpstreamConn** bucket = &pool.buckets[hash % UPSTREAM_BUCKET_COUNT];
+    for (UpstreamConn* p = *bucket; p != NULL; p = p->next) {
+        if (p->server == server) {
+            nsame++;
+        }
+    }
+
+    int parked = (nsame < UPSTREAM_MAX_IDLE_PER_HOST && pool.nidle < UPSTREAM_MAX_IDLE);
+    if (parked) {
+        conn->next = *bucket;
+        *bucket = conn;
+        pool.nidle++;
+        if (server->nwaiters > 0) {
+            pthread_cond_broadcast(&pool.released);
+        }
+    } else {
+        drop_connection(server);
+    }
+
+    pthread_mutex_unlock(&pool.mutex);
+
+    if (!parked) {
+        close(fd);
+        free(conn);
+    }
+
+    log_debug("upstream_release (%s, %s): %s", host, port, parked ? "parked" : "closed");
+}
+
+/* close an acquired connection that can't carry another request */
+void upstream_close(const char* host, const char* port, int fd) {
+    close(fd);
+
+    pthread_mutex_lock(&pool.mutex);
+    drop_connection(find_server(host, port, hash_server(host, port)));
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+/* bound the wait for the next bytes from the server, the first byte of a
+   response may take longer to come than the ones after it */
+void upstream_await(int fd, int first) {
+    set_timeout(fd, SO_RCVTIMEO, first ? upstream_limits.first_byte_timeout :
+                                         upstream_limits.stall_timeout);
+}
+
+void deinit_upstreams() {
+    for (int i = 0; i < UPSTREAM_BUCKET_COUNT; ++i) {
+        while (pool.buckets[i] != NULL) {
+            UpstreamConn* conn = pool.buckets[i];
+            pool.buckets[i] = conn->next;
+            close(conn->fd);
+            free(conn);
+        }
+        while (pool.servers[i] != NULL) {
+            UpstreamServer* server = pool.servers[i];
+            pool.servers[i] = server->next;
+            free(server->host);
+            free(server->port);
+            free(server);
+        }
+    }
+    pool.nidle = 0;
+
+    pthread_mutex_destroy(&pool.mutex);
+    pthread_cond_destroy(&pool.released);
+}
+
+static unsigned int hash_server(const char* host, const char* port) {
+    char server[MAXLINE];
+    snprintf(server, sizeof(server), "%s:%s", host, port);
+    return hash_key(server);
+}
+
+/* unlink the first idle connection to the server, NULL if none, the
+   expired ones met on the way go to the expired list, caller holds the mutex */
+static UpstreamConn* take_idle(const char* host, const char* port, unsigned int hash,
+                               UpstreamConn** expired) {
+    time_t now = time(NULL);
+    UpstreamConn* found = NULL;
+
+    UpstreamConn** link = &pool.buckets[hash % UPSTREAM_BUCKET_COUNT];
+    while (*link != NULL) {
+        UpstreamConn* conn = *link;
+        UpstreamServer* server = conn->server;
+        int expire = (now - conn->idle_since >= UPSTREAM_IDLE_TIMEOUT);
+        int match = (server->hash == hash && strcmp(server->host, host) == 0 &&
+                     strcmp(server->port, port) == 0);
+        if (!expire && !(match && found == NULL)) {
+            link = &conn->next;
+            continue;
+        }
+
+        *link = conn->next;
+        pool.nidle--;
+        if (expire) {
+            conn->next = *expired;
+            *expired = conn;
+            drop_connection(server);
+        } else {
+            found = conn;
+        }
+    }
+
+    return found;
+}
+
+/* caller holds the mutex */
+static UpstreamServer* find_server(const char* host, const char* port, unsigned int hash) {
+    UpstreamServer* server = pool.servers[hash % UPSTREAM_BUCKET_COUNT];
+    while (server != NULL && (server->hash != hash || strcmp(server->host, host) != 0 ||
+                              strcmp(server->port, port) != 0)) {
+        server = server->next;
+    }
+
+    return server;
+}
+
+/* find the server or add it, caller holds the mutex and counts a connection
+   or a waiter on it, or puts it back, before letting go of the mutex */
+static UpstreamServer* get_server(const char* host, const char* port, unsigned int hash) {
+    UpstreamServer* server = find_server(host, port, hash);
+    if (server != NULL) {
+        return server;
+    }
+
+    server = Malloc(sizeof(UpstreamServer));
+    server->host = Malloc(strlen(host) + 1);
+    strcpy(server->host, host);
+    server->port = Malloc(strlen(port) + 1);
+    strcpy(server->port, port);
+    server->hash = hash;
+    server->nopen = 0;
+    server->nwaiters = 0;
+
+    UpstreamServer** bucket = &pool.servers[hash % UPSTREAM_BUCKET_COUNT];
+    server->next = *bucket;
+    *bucket = server;
+
+    return server;
+}
+
+/* a connection to the server closed, its slot may go to a waiter,
+   caller holds the mutex */
+static void drop_connection(UpstreamServer* server) {
+    server->nopen--;
+    if (server->nwaiters > 0) {
+        pthread_cond_broadcast(&pool.released);
+    }
+    put_server(server);
+}
+
+/* free the server once no connection or waiter needs it, caller holds the mutex */
+static void put_server(UpstreamServer* server) {
+    if (server->nopen > 0 || server->nwaiters > 0) {
+        return;
+    }
+
+    UpstreamServer** link = &pool.servers[server->hash % UPSTREAM_BUCKET_COUNT];
+    while (*link != server) {
+        link = &(*link)->next;
+    }
+    *link = server->next;
+
+    free(server->host);
+    free(server->port);
+    free(server);
+}
+
+/* an idle connection must have nothing to read: data or EOF means the
+   server closed it or broke the protocol */
+static int is_alive(int fd) {
+    char c;
+    int n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+/* SO_RCVTIMEO or SO_SNDTIMEO in milliseconds, 0 for none, a call blocked
+   that long then fails with EAGAIN */
+static void set_timeout(int fd, int option, int ms) {
+    struct timeval timeout = { ms / 1000, (ms % 1000) * 1000 };
+    if (setsockopt(fd, SOL_SOCKET, option, &timeout, sizeof(timeout)) < 0) {
+        log_error("setsockopt error: %s", strerror(errno));
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include "csapp.h"
+
+/* Idle connections kept per (host, port) and in total, and for how long */
+#define UPSTREAM_BUCKET_COUNT 256
+#define UPSTREAM_MAX_IDLE_PER_HOST 8
+#define UPSTREAM_MAX_IDLE 256
+#define UPSTREAM_IDLE_TIMEOUT 30
+
+/* Default limits, timeouts in milliseconds */
+#define DEFAULT_CONNECT_TIMEOUT 3000
+#define DEFAULT_FIRST_BYTE_TIMEOUT 15000
+#define DEFAULT_STALL_TIMEOUT 30000
+#define DEFAULT_MAX_PER_HOST 32
+
+/* 0 disables a limit */
+typedef struct UpstreamLimits {
+    int connect_timeout;          /* to connect, waiting for a free slot included */
+    int first_byte_timeout;       /* from the forwarded request to the response */
+    int stall_timeout;            /* a response or a client write making no progress */
+    int max_per_host;             /* connections open to a (host, port), idle or not */
+} UpstreamLimits;
+
+/*
+ * A (host, port) with connections open, it counts them to enforce the cap
+ * and lives as long as one is open or a worker waits for one.
+ */
+typedef struct UpstreamServer {
+    char* host;
+    char* port;
+    unsigned int hash;            /* hash of host:port */
+    int nopen;                    /* connections open, idle or in use */
+    int nwaiters;                 /* workers waiting for one to close */
+    struct UpstreamServer* next;  /* next server in the same bucket */
+} UpstreamServer;
+
+/*
+ * A persistent connection to a server, parked in the pool between two
+ * requests. A worker takes it out before use, so a connection is never
+ * shared by two requests at the same time.
+ */
+typedef struct UpstreamConn {
+    UpstreamServer* server;       /* server the connection goes to */
+    int fd;                       /* connected socket */
+    time_t idle_since;            /* when it was returned to the pool */
+    struct UpstreamConn* next;    /* next idle connection in the same bucket */
+} UpstreamConn;
+
+extern UpstreamLimits upstream_limits;
+
+void init_upstreams();
+int upstream_acquire(const char* host, const char* port, int* reused);
+void upstream_release(const char* host, const char* port, int fd);
+void upstream_close(const char* host, const char* port, int fd);
+void upstream_await(int fd, int first);
+void deinit_upstreams();
+
+#endif /* __UPSTREAM_H__ */